@@ -22,104 +22,462 @@
  * 3. This notice may not be removed or altered from any source distribution.
  */
 
+/*
+ * Usage:
+ *     bench [-s samples] [-f filter] [-p nodes] [-j]  run the corpus, -j for JSON
+ *     bench -c old.json new.json [-t percent]         compare two JSON runs
+ *
+ * Compile, eval and free are timed separately. Each sample times a batch of
+ * operations with a monotonic clock, and the per-operation times of all
+ * samples are reported as percentiles. The bytes and allocations per compile
+ * are counted through te_set_allocator. -p turns on node pools of that size.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 #include "tinyexpr.h"
 
 
+#define DEFAULT_SAMPLES 31
+#define WARMUP 3
+#define COMPILE_BATCH 200
+#define EVAL_BATCH 20000
+#define DEFAULT_THRESHOLD 10.0
 
-#define loops 10000
 
+typedef double (*function1)(double);
 
+typedef struct bench_case {
+    const char *name;
+    const char *category;
+    const char *expression;
+    function1 native;
+} bench_case;
 
-typedef double (*function1)(double);
+typedef struct summary {
+    double min, p50, p90, p99, mean;
+} summary;
 
-void bench(const char *expr, function1 func) {
-    int i, j;
-    volatile double d;
-    double tmp;
-    clock_t start;
+typedef struct result {
+    summary compile, eval, free, native;
+    double bytes, allocations;
+} result;
 
-    te_variable lk = {"a", &tmp};
 
-    printf("Expression: %s\n", expr);
 
-    printf("native ");
-    start = clock();
-    d = 0;
-    for (j = 0; j < loops; ++j)
-        for (i = 0; i < loops; ++i) {
-            tmp = i;
-            d += func(tmp);
-        }
-    const int nelapsed = (clock() - start) * 1000 / CLOCKS_PER_SEC;
+/* Allocation counting. */
+
+static unsigned long alloc_bytes = 0;
+static unsigned long alloc_count = 0;
+
+static void *count_alloc(void *context, size_t size) {
+    (void)context;
+    alloc_bytes += size;
+    ++alloc_count;
+    return malloc(size);
+}
+
+static void count_free(void *context, void *block) {
+    (void)context;
+    free(block);
+}
 
-    /*Million floats per second input.*/
-    printf(" %.5g", d);
-    if (nelapsed)
-        printf("\t%5dms\t%5dmfps\n", nelapsed, loops * loops / nelapsed / 1000);
-    else
-        printf("\tinf\n");
+static const te_allocator counting = {count_alloc, count_free, 0};
 
 
 
+static double now_ns(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#else
+    return (double)clock() * 1e9 / CLOCKS_PER_SEC;
+#endif
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static double percentile(const double *sorted, int count, double p) {
+    int i = (int)ceil(p / 100.0 * count) - 1;
+    if (i < 0) i = 0;
+    if (i >= count) i = count - 1;
+    return sorted[i];
+}
+
+
+static summary summarize(double *samples, int count) {
+    summary s;
+    int i;
+    qsort(samples, count, sizeof(double), compare_doubles);
+    s.min = samples[0];
+    s.p50 = percentile(samples, count, 50);
+    s.p90 = percentile(samples, count, 90);
+    s.p99 = percentile(samples, count, 99);
+    for (s.mean = 0, i = 0; i < count; ++i) s.mean += samples[i];
+    s.mean /= count;
+    return s;
+}
+
+
+
+/* Variables and closures bound by every expression in the corpus. */
+static double a, b, c, d, e, f, g, h;
+static double scale = 0.5;
+
+static double mix(void *context, double x, double y) {
+    const double t = *(const double*)context;
+    return x + (y - x) * t;
+}
+
+static double damp(void *context, double x) {
+    return x / (1.0 + fabs(x) * *(const double*)context);
+}
+
+static const te_variable vars[] = {
+    {"a", &a}, {"b", &b}, {"c", &c}, {"d", &d},
+    {"e", &e}, {"f", &f}, {"g", &g}, {"h", &h},
+    {"mix", mix, TE_CLOSURE2 | TE_FLAG_PURE, &scale},
+    {"damp", damp, TE_CLOSURE1, &scale},
+};
+
+
+static double a5(double x) {
+    return x+5;
+}
+
+static double a52(double x) {
+    return (x+5)*2;
+}
+
+static double a10(double x) {
+    return x+(5*2);
+}
+
+static double as(double x) {
+    return sqrt(pow(x, 1.5) + pow(x, 2.5));
+}
+
+static double al(double x) {
+    return (1/(x+1)+2/(x+2)+3/(x+3));
+}
+
+
+static const bench_case corpus[] = {
+    {"add", "short", "a+5", a5},
+    {"add_folded", "short", "a+(5*2)", a10},
+    {"add_mul", "short", "(a+5)*2", a52},
+    {"pow_sqrt", "short", "sqrt(a^1.5+a^2.5)", as},
+    {"reciprocals", "short", "(1/(a+1)+2/(a+2)+3/(a+3))", al},
+    {"long_sum", "long",
+        "a+b*2-c/3+d*4-e/5+f*6-g/7+h*8-a/9+b*10-c/11+d*12-e/13+f*14-g/15+h*16-a/17+b*18-c/19+d*20", 0},
+    {"deep_nest", "deep", "((((((((((((a+1)*2)+3)*4)+5)*6)+7)*8)+9)*10)+11)*12)", 0},
+    {"deep_calls", "deep", "sqrt(abs(sin(cos(tan(sqrt(abs(sin(cos(tan(a/1000))))))))))", 0},
+    {"builtins", "builtin",
+        "sin(a)*cos(b)+tan(c/10)+exp(-d/100)+ln(e+1)+sqrt(f+1)+abs(g-h)+floor(a/3)+ceil(b/3)+atan2(c,d+1)", 0},
+    {"closures", "closure", "mix(a,b)+mix(c,d)*damp(e)-damp(mix(f,g))+mix(damp(h),a)", 0},
+    {"many_vars", "variables", "a*b+c*d+e*f+g*h-(a+b+c+d+e+f+g+h)/8+a*h-b*g+c*f-d*e", 0},
+};
+
+#define CORPUS_SIZE ((int)(sizeof(corpus) / sizeof(corpus[0])))
+
+
+
+static void set_variables(int i) {
+    a = i;
+    b = i * 0.5 + 1;
+    c = i * 0.25 + 2;
+    d = i * 0.125 + 3;
+    e = i % 17 + 4;
+    f = i % 13 + 5;
+    g = i % 11 + 6;
+    h = i % 7 + 7;
+}
 
-    printf("interp ");
-    te_expr *n = te_compile(expr, &lk, 1, 0);
-    start = clock();
-    d = 0;
-    for (j = 0; j < loops; ++j)
-        for (i = 0; i < loops; ++i) {
-            tmp = i;
-            d += te_eval(n);
+
+static int run_case(const bench_case *bc, int samples, result *r) {
+    const int nvars = (int)(sizeof(vars) / sizeof(vars[0]));
+    te_expr *exprs[COMPILE_BATCH];
+    double *compile_ns, *eval_ns, *free_ns, *native_ns;
+    volatile double sink = 0;
+    unsigned long bytes = 0, count = 0;
+    int s, i, err;
+
+    exprs[0] = te_compile(bc->expression, vars, nvars, &err);
+    if (!exprs[0]) {
+        fprintf(stderr, "bench: %s doesn't compile (error at %d)\n", bc->name, err);
+        return 0;
+    }
+    te_free(exprs[0]);
+
+    /* One block holds all four series of samples, so there's one thing to free. */
+    compile_ns = malloc(sizeof(double) * samples * 4);
+    if (!compile_ns) {
+        fprintf(stderr, "bench: out of memory for %d samples of %s\n", samples, bc->name);
+        return 0;
+    }
+    eval_ns = compile_ns + samples;
+    free_ns = eval_ns + samples;
+    native_ns = free_ns + samples;
+
+    for (s = -WARMUP; s < samples; ++s) {
+        double start, t_compile, t_free, t_eval, t_native;
+        const unsigned long bytes0 = alloc_bytes, count0 = alloc_count;
+        double sum;
+
+        start = now_ns();
+        for (i = 0; i < COMPILE_BATCH; ++i) exprs[i] = te_compile(bc->expression, vars, nvars, 0);
+        t_compile = now_ns() - start;
+
+        if (s == 0) {
+            bytes = alloc_bytes - bytes0;
+            count = alloc_count - count0;
+        }
+
+        sum = 0;
+        start = now_ns();
+        for (i = 0; i < EVAL_BATCH; ++i) {
+            set_variables(i);
+            sum += te_eval(exprs[0]);
+        }
+        t_eval = now_ns() - start;
+        sink += sum;
+
+        t_native = 0;
+        if (bc->native) {
+            sum = 0;
+            start = now_ns();
+            for (i = 0; i < EVAL_BATCH; ++i) {
+                set_variables(i);
+                sum += bc->native(a);
+            }
+            t_native = now_ns() - start;
+            sink += sum;
+        }
+
+        start = now_ns();
+        for (i = 0; i < COMPILE_BATCH; ++i) te_free(exprs[i]);
+        t_free = now_ns() - start;
+
+        if (s >= 0) {
+            compile_ns[s] = t_compile / COMPILE_BATCH;
+            eval_ns[s] = t_eval / EVAL_BATCH;
+            free_ns[s] = t_free / COMPILE_BATCH;
+            native_ns[s] = t_native / EVAL_BATCH;
         }
-    const int eelapsed = (clock() - start) * 1000 / CLOCKS_PER_SEC;
-    te_free(n);
+    }
+
+    (void)sink;
+    r->compile = summarize(compile_ns, samples);
+    r->eval = summarize(eval_ns, samples);
+    r->free = summarize(free_ns, samples);
+    r->native = summarize(native_ns, samples);
+    r->bytes = (double)bytes / COMPILE_BATCH;
+    r->allocations = (double)count / COMPILE_BATCH;
+
+    free(compile_ns);
+    return 1;
+}
+
+
 
-    /*Million floats per second input.*/
-    printf(" %.5g", d);
-    if (eelapsed)
-        printf("\t%5dms\t%5dmfps\n", eelapsed, loops * loops / eelapsed / 1000);
-    else
-        printf("\tinf\n");
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+
+static void print_json_summary(const char *key, const summary *s) {
+    printf(", \"%s\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"mean\": %.3f}",
+            key, s->min, s->p50, s->p90, s->p99, s->mean);
+}
 
 
-    printf("%.2f%% longer\n", (((double)eelapsed / nelapsed) - 1.0) * 100.0);
+/* One result per line, so that -c can read it back without a JSON parser. */
+static void print_json(const bench_case *bc, const result *r, int first) {
+    printf("%s    {\"name\": ", first ? "" : ",\n");
+    print_json_string(bc->name);
+    printf(", \"category\": ");
+    print_json_string(bc->category);
+    printf(", \"expression\": ");
+    print_json_string(bc->expression);
+    print_json_summary("compile_ns", &r->compile);
+    print_json_summary("eval_ns", &r->eval);
+    print_json_summary("free_ns", &r->free);
+    if (bc->native) print_json_summary("native_ns", &r->native);
+    printf(", \"bytes\": %.1f, \"allocations\": %.1f}", r->bytes, r->allocations);
+}
 
 
+static void print_row(const bench_case *bc, const result *r) {
+    printf("%-12s %-10s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %8.0f %6.1f",
+            bc->name, bc->category,
+            r->compile.p50, r->compile.p99, r->eval.p50, r->eval.p99, r->free.p50, r->free.p99,
+            r->bytes, r->allocations);
+    if (bc->native) printf(" %9.1f %+7.0f%%", r->native.p50, (r->eval.p50 / r->native.p50 - 1.0) * 100.0);
     printf("\n");
 }
 
 
-double a5(double a) {
-    return a+5;
+
+/* Compare mode. */
+
+#define MAX_RESULTS 256
+#define MAX_LINE 4096
+
+typedef struct stored {
+    char name[64];
+    double compile, eval, free;
+} stored;
+
+
+static double read_p50(const char *line, const char *key) {
+    char pattern[64];
+    const char *p;
+    double v;
+    sprintf(pattern, "\"%s\": {", key);
+    p = strstr(line, pattern);
+    if (!p || !(p = strstr(p, "\"p50\": ")) || sscanf(p + 7, "%lf", &v) != 1) return -1;
+    return v;
 }
 
-double a52(double a) {
-    return (a+5)*2;
+
+static int read_results(const char *path, stored *out) {
+    static char line[MAX_LINE];
+    FILE *fp = fopen(path, "r");
+    int count = 0;
+
+    if (!fp) {
+        fprintf(stderr, "bench: can't open %s\n", path);
+        return -1;
+    }
+
+    while (count < MAX_RESULTS && fgets(line, sizeof(line), fp)) {
+        const char *p = strstr(line, "{\"name\": \"");
+        int len = 0;
+        if (!p) continue;
+        p += 10;
+        while (p[len] && p[len] != '"' && len < 63) ++len;
+        memcpy(out[count].name, p, len);
+        out[count].name[len] = '\0';
+        out[count].compile = read_p50(line, "compile_ns");
+        out[count].eval = read_p50(line, "eval_ns");
+        out[count].free = read_p50(line, "free_ns");
+        ++count;
+    }
+
+    fclose(fp);
+    return count;
 }
 
-double a10(double a) {
-    return a+(5*2);
+
+static int compare_metric(const char *name, const char *metric, double before, double after, double threshold) {
+    double change;
+    int regressed;
+    if (before <= 0 || after < 0) return 0;
+    change = (after / before - 1.0) * 100.0;
+    regressed = change > threshold;
+    printf("%-12s %-8s %10.1f %10.1f %+8.1f%%%s\n", name, metric, before, after, change,
+            regressed ? "  REGRESSION" : change < -threshold ? "  improved" : "");
+    return regressed;
 }
 
-double as(double a) {
-    return sqrt(pow(a, 1.5) + pow(a, 2.5));
+
+static int compare(const char *old_path, const char *new_path, double threshold) {
+    static stored before[MAX_RESULTS], after[MAX_RESULTS];
+    const int nb = read_results(old_path, before);
+    const int na = read_results(new_path, after);
+    int i, j, regressions = 0;
+
+    if (nb < 0 || na < 0) return 2;
+
+    printf("%-12s %-8s %10s %10s %9s\n", "name", "metric", "old p50", "new p50", "change");
+    for (i = 0; i < na; ++i) {
+        for (j = 0; j < nb && strcmp(before[j].name, after[i].name); ++j);
+        if (j == nb) {
+            printf("%-12s (new)\n", after[i].name);
+            continue;
+        }
+        regressions += compare_metric(after[i].name, "compile", before[j].compile, after[i].compile, threshold);
+        regressions += compare_metric(after[i].name, "eval", before[j].eval, after[i].eval, threshold);
+        regressions += compare_metric(after[i].name, "free", before[j].free, after[i].free, threshold);
+    }
+
+    printf("\n%d regression%s over %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+    return regressions != 0;
 }
 
-double al(double a) {
-    return (1/(a+1)+2/(a+2)+3/(a+3));
+
+
+static int usage(void) {
+    fprintf(stderr,
+        "Usage: bench [-s samples] [-f filter] [-p nodes] [-j]\n"
+        "       bench -c old.json new.json [-t percent]\n");
+    return 2;
 }
 
+
 int main(int argc, char *argv[])
 {
+    const char *filter = 0, *old_path = 0, *new_path = 0;
+    double threshold = DEFAULT_THRESHOLD;
+    int samples = DEFAULT_SAMPLES, json = 0, first = 1, i;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-j")) json = 1;
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc) samples = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc) filter = argv[++i];
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) threshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc) te_set_node_pool(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-c") && i + 2 < argc) {
+            old_path = argv[++i];
+            new_path = argv[++i];
+        }
+        else return usage();
+    }
+
+    if (old_path) return compare(old_path, new_path, threshold);
+    if (samples < 1) return usage();
+
+    te_set_allocator(&counting);
+
+    if (json) {
+        printf("{\n  \"samples\": %d, \"warmup\": %d, \"compile_batch\": %d, \"eval_batch\": %d,\n  \"results\": [\n",
+                samples, WARMUP, COMPILE_BATCH, EVAL_BATCH);
+    } else {
+        printf("Times are ns per operation over %d samples.\n\n", samples);
+        printf("%-12s %-10s %9s %9s %9s %9s %9s %9s %8s %6s %9s %8s\n",
+                "name", "category", "compile", "p99", "eval", "p99", "free", "p99", "bytes", "allocs", "native", "slower");
+    }
+
+    for (i = 0; i < CORPUS_SIZE; ++i) {
+        result r;
+        if (filter && !strstr(corpus[i].name, filter) && !strstr(corpus[i].category, filter)) continue;
+        if (!run_case(&corpus[i], samples, &r)) return 1;
+        if (json) {
+            print_json(&corpus[i], &r, first);
+            first = 0;
+        } else {
+            print_row(&corpus[i], &r);
+        }
+        fflush(stdout);
+    }
 
-    bench("sqrt(a^1.5+a^2.5)", as);
-    bench("a+5", a5);
-    bench("a+(5*2)", a10);
-    bench("(a+5)*2", a52);
-    bench("(1/(a+1)+2/(a+2)+3/(a+3))", al);
+    if (json) printf("\n  ]\n}\n");
 
     return 0;
 }
@@ -0,0 +1,481 @@
+/*
+ * TECOL - Evaluates TinyExpr expressions over columns of data
+ *
+ * Usage:
+ *     tecol [-i input.tec | -c input.csv] [-o output.tec] [-b rows] expr...
+ *
+ * Each expr is either an expression or "name=expression". The variables used
+ * in the expressions are bound by name to the input columns, and only the
+ * columns that are referenced are ever read.
+ *
+ * Input is either a binary column file (-i), which is memory-mapped, or CSV
+ * with a header line (-c, or standard input if neither is given). Results go
+ * to a binary column file (-o), which is memory-mapped and filled in place, or
+ * as CSV to standard output.
+ *
+ * Binary column files are little-endian:
+ *     offset  0  char[8]  magic "TECOLS01"
+ *     offset  8  uint32   number of columns
+ *     offset 12  uint32   reserved, 0
+ *     offset 16  uint64   number of rows
+ *     offset 24           one 48 byte descriptor per column:
+ *                 char[32] name, zero padded
+ *                 uint32   element type: 1 = double, 2 = float
+ *                 uint32   reserved, 0
+ *                 uint64   byte offset of the column's data in the file
+ * Column data is stored contiguously and aligned to its element size, so
+ * double columns are read without copying.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "tinyexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define MAGIC "TECOLS01"
+#define HEADER_SIZE 24
+#define DESCRIPTOR_SIZE 48
+#define NAME_SIZE 32
+#define TYPE_DOUBLE 1
+#define TYPE_FLOAT 2
+#define DEFAULT_BLOCK 65536
+#define MAX_LINE 65536
+
+
+typedef struct column {
+    char name[NAME_SIZE];
+    int type;
+    const unsigned char *data;  /* Mapped column data, or 0 for CSV. */
+    int used;                   /* Referenced by some expression. */
+    double *buffer;             /* Parsed CSV values for one block. */
+    const void *values;         /* Values of the current block. */
+    double slot;                /* Address bound by te_compile. */
+} column;
+
+typedef struct output {
+    char name[NAME_SIZE];
+    const char *text;
+    te_expr *expr;
+    double *values;
+} output;
+
+
+static void fail(const char *message, const char *detail) {
+    fprintf(stderr, "tecol: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) fail("out of memory", 0);
+    return p;
+}
+
+
+static unsigned long read_le(const unsigned char *p, int bytes) {
+    unsigned long v = 0;
+    while (bytes--) {
+        if (bytes >= (int)sizeof(unsigned long) && p[bytes]) fail("file too large for this platform", 0);
+        v = (v << 8) | p[bytes];
+    }
+    return v;
+}
+
+
+static void write_le(unsigned char *p, unsigned long v, int bytes) {
+    int i;
+    for (i = 0; i < bytes; ++i) {
+        p[i] = i < (int)sizeof(unsigned long) ? (unsigned char)(v & 0xFF) : 0;
+        if (i < (int)sizeof(unsigned long)) v >>= 8;
+    }
+}
+
+
+static int little_endian(void) {
+    const unsigned int one = 1;
+    return *(const unsigned char*)&one == 1;
+}
+
+
+static int is_name(const char *s) {
+    if (!(*s >= 'a' && *s <= 'z')) return 0;
+    for (++s; *s; ++s) {
+        if (!((*s >= 'a' && *s <= 'z') || (*s >= '0' && *s <= '9') || *s == '_')) return 0;
+    }
+    return 1;
+}
+
+
+/* Marks the columns whose names appear as identifiers in the expression. */
+static void mark_used(const char *text, column *cols, int col_count) {
+    while (*text) {
+        if (*text >= 'a' && *text <= 'z') {
+            const char *start = text;
+            int i;
+            while ((*text >= 'a' && *text <= 'z') || (*text >= '0' && *text <= '9') || *text == '_') ++text;
+            for (i = 0; i < col_count; ++i) {
+                if ((int)strlen(cols[i].name) == text - start && strncmp(cols[i].name, start, text - start) == 0) {
+                    cols[i].used = 1;
+                }
+            }
+        } else if ((*text >= '0' && *text <= '9') || *text == '.') {
+            /* Skip numbers so exponents like 1e5 aren't taken for names. */
+            strtod(text, (char**)&text);
+            if ((*text >= '0' && *text <= '9') || *text == '.') ++text;
+        } else {
+            ++text;
+        }
+    }
+}
+
+
+static void compile_outputs(output *outs, int out_count, column *cols, int col_count) {
+    te_variable *vars = xmalloc(sizeof(te_variable) * col_count);
+    int i;
+
+    for (i = 0; i < col_count; ++i) {
+        vars[i].name = cols[i].name;
+        vars[i].address = &cols[i].slot;
+        vars[i].type = TE_VARIABLE;
+        vars[i].context = 0;
+    }
+
+    for (i = 0; i < out_count; ++i) {
+        int err;
+        mark_used(outs[i].text, cols, col_count);
+        outs[i].expr = te_compile(outs[i].text, vars, col_count, &err);
+        if (!outs[i].expr) {
+            fprintf(stderr, "tecol: parse error in expression %d:\n\t%s\n\t%*s^\n", i + 1, outs[i].text, err - 1, "");
+            exit(1);
+        }
+    }
+
+    free(vars);
+}
+
+
+/* Evaluates every output for one block of rows, whose values are already in the column buffers. */
+static void eval_block(output *outs, int out_count, column *cols, int col_count, unsigned long offset, int rows) {
+    te_column *bind = xmalloc(sizeof(te_column) * col_count);
+    int i, used = 0;
+
+    for (i = 0; i < col_count; ++i) {
+        if (!cols[i].used) continue;
+        bind[used].address = &cols[i].slot;
+        bind[used].values = cols[i].values;
+        bind[used].type = cols[i].type == TYPE_FLOAT ? TE_FLOAT : TE_DOUBLE;
+        bind[used].stride = 0;
+        ++used;
+    }
+
+    for (i = 0; i < out_count; ++i) {
+        te_eval_array(outs[i].expr, bind, used, rows, outs[i].values + offset);
+    }
+
+    free(bind);
+}
+
+
+/* Results go to a mapped binary column file, or are printed as CSV one block at a time. */
+typedef struct sink {
+    const char *path;       /* Binary output file, or 0 for CSV. */
+    unsigned char *base;
+    size_t size;
+} sink;
+
+
+static void open_mapped(sink *s, output *outs, int out_count, unsigned long rows) {
+    const unsigned long header = HEADER_SIZE + (unsigned long)out_count * DESCRIPTOR_SIZE;
+    int fd, i;
+
+    /* Checked by division, as the product could wrap around. */
+    if (out_count && rows > (ULONG_MAX - header) / sizeof(double) / out_count) fail("too many rows for", s->path);
+    s->size = header + rows * out_count * sizeof(double);
+    fd = open(s->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, s->size) != 0) fail("can't create output", s->path);
+    s->base = mmap(0, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s->base == MAP_FAILED) fail("can't map output", s->path);
+    close(fd);
+
+    memcpy(s->base, MAGIC, 8);
+    write_le(s->base + 8, out_count, 4);
+    write_le(s->base + 12, 0, 4);
+    write_le(s->base + 16, rows, 8);
+
+    for (i = 0; i < out_count; ++i) {
+        unsigned char *d = s->base + HEADER_SIZE + i * DESCRIPTOR_SIZE;
+        const unsigned long offset = header + i * rows * sizeof(double);
+        memset(d, 0, DESCRIPTOR_SIZE);
+        memcpy(d, outs[i].name, strlen(outs[i].name));
+        write_le(d + 32, TYPE_DOUBLE, 4);
+        write_le(d + 40, offset, 8);
+        /* Results are written straight into the mapping. */
+        outs[i].values = (double*)(s->base + offset);
+    }
+}
+
+
+static void sink_open(sink *s, output *outs, int out_count, unsigned long rows, unsigned long block) {
+    int i;
+    if (s->path) {
+        open_mapped(s, outs, out_count, rows);
+        return;
+    }
+    for (i = 0; i < out_count; ++i) {
+        outs[i].values = xmalloc(sizeof(double) * block);
+        printf("%s%s", i ? "," : "", outs[i].name);
+    }
+    printf("\n");
+}
+
+
+/* Where the block starting at row first is evaluated to. */
+static unsigned long sink_offset(const sink *s, unsigned long first) {
+    return s->path ? first : 0;
+}
+
+
+static void sink_flush(const sink *s, output *outs, int out_count, int rows) {
+    int r, i;
+    if (s->path) return;
+    for (r = 0; r < rows; ++r) {
+        for (i = 0; i < out_count; ++i) {
+            printf("%s%.17g", i ? "," : "", outs[i].values[r]);
+        }
+        printf("\n");
+    }
+}
+
+
+static void sink_close(sink *s, output *outs, int out_count) {
+    int i;
+    if (s->path) {
+        if (s->base) munmap(s->base, s->size);
+        return;
+    }
+    for (i = 0; i < out_count; ++i) free(outs[i].values);
+}
+
+
+static void map_input(const char *path, column **cols_out, int *col_count, unsigned long *row_count) {
+    struct stat st;
+    const unsigned char *base;
+    column *cols;
+    int fd, i, count;
+    unsigned long rows, declared, size;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) fail("can't open input", path);
+    if (st.st_size < HEADER_SIZE) fail("not a column file", path);
+
+    base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) fail("can't map input", path);
+    close(fd);
+
+    if (memcmp(base, MAGIC, 8) != 0) fail("not a column file", path);
+    declared = read_le(base + 8, 4);
+    rows = read_le(base + 16, 8);
+    size = st.st_size;
+    if (declared > INT_MAX) fail("too many columns in", path);
+    if (declared > (size - HEADER_SIZE) / DESCRIPTOR_SIZE) fail("truncated header", path);
+    count = (int)declared;
+
+    cols = xmalloc(sizeof(column) * (count ? count : 1));
+    for (i = 0; i < count; ++i) {
+        const unsigned char *d = base + HEADER_SIZE + i * DESCRIPTOR_SIZE;
+        const unsigned long offset = read_le(d + 40, 8);
+        int width;
+
+        memcpy(cols[i].name, d, NAME_SIZE);
+        cols[i].name[NAME_SIZE - 1] = '\0';
+        cols[i].type = (int)read_le(d + 32, 4);
+        width = cols[i].type == TYPE_DOUBLE ? 8 : cols[i].type == TYPE_FLOAT ? 4 : 0;
+
+        if (!width) fail("unknown column type in", cols[i].name);
+        /* Checked by division, as offset + rows * width could wrap around. */
+        if (offset % width || offset > size || rows > (size - offset) / width) fail("bad column offset in", cols[i].name);
+
+        cols[i].data = base + offset;
+        cols[i].used = 0;
+        cols[i].buffer = 0;
+    }
+
+    *cols_out = cols;
+    *col_count = count;
+    *row_count = rows;
+}
+
+
+static void run_binary(const char *path, output *outs, int out_count, unsigned long block, sink *out) {
+    column *cols;
+    int col_count, i;
+    unsigned long rows, first;
+
+    map_input(path, &cols, &col_count, &rows);
+    compile_outputs(outs, out_count, cols, col_count);
+    sink_open(out, outs, out_count, rows, block);
+
+    for (first = 0; first < rows; first += block) {
+        const int len = (int)(rows - first < block ? rows - first : block);
+        for (i = 0; i < col_count; ++i) {
+            /* Zero copy: evaluate straight from the mapping, floats included. */
+            const unsigned long size = cols[i].type == TYPE_DOUBLE ? 8 : 4;
+            cols[i].values = cols[i].data + first * size;
+        }
+        eval_block(outs, out_count, cols, col_count, sink_offset(out, first), len);
+        sink_flush(out, outs, out_count, len);
+    }
+
+    free(cols);
+}
+
+
+/* Splits a CSV line in place. Returns the number of fields. */
+static int split_csv(char *line, char **fields, int max) {
+    int count = 0;
+    char *p = line;
+    for (;;) {
+        if (count < max) fields[count] = p;
+        ++count;
+        while (*p && *p != ',' && *p != '\n' && *p != '\r') ++p;
+        if (*p != ',') {
+            *p = '\0';
+            return count;
+        }
+        *p++ = '\0';
+    }
+}
+
+
+static void run_csv(FILE *in, output *outs, int out_count, unsigned long block, sink *out) {
+    static char line[MAX_LINE];
+    char **fields;
+    column *cols;
+    int col_count, i, len = 0;
+
+    if (!fgets(line, sizeof(line), in)) fail("empty CSV input", 0);
+    for (col_count = 1, i = 0; line[i]; ++i) col_count += line[i] == ',';
+    fields = xmalloc(sizeof(char*) * col_count);
+    split_csv(line, fields, col_count);
+
+    cols = xmalloc(sizeof(column) * col_count);
+    for (i = 0; i < col_count; ++i) {
+        while (*fields[i] == ' ') ++fields[i];
+        strncpy(cols[i].name, fields[i], NAME_SIZE - 1);
+        cols[i].name[NAME_SIZE - 1] = '\0';
+        cols[i].type = TYPE_DOUBLE;
+        cols[i].data = 0;
+        cols[i].used = 0;
+        cols[i].buffer = 0;
+        if (!is_name(cols[i].name)) fprintf(stderr, "tecol: column '%s' can't be used as a variable\n", cols[i].name);
+    }
+
+    compile_outputs(outs, out_count, cols, col_count);
+    sink_open(out, outs, out_count, block, block);
+
+    for (i = 0; i < col_count; ++i) {
+        if (cols[i].used) cols[i].values = cols[i].buffer = xmalloc(sizeof(double) * block);
+    }
+
+    for (;;) {
+        const int more = fgets(line, sizeof(line), in) != 0;
+        if (more) {
+            const int n = split_csv(line, fields, col_count);
+            if (n == 1 && !*fields[0]) continue;
+            if (n != col_count) fail("wrong number of fields on a CSV line", 0);
+            for (i = 0; i < col_count; ++i) {
+                if (cols[i].used) cols[i].buffer[len] = strtod(fields[i], 0);
+            }
+            ++len;
+        }
+        if (len == (int)block || (!more && len)) {
+            eval_block(outs, out_count, cols, col_count, 0, len);
+            sink_flush(out, outs, out_count, len);
+            len = 0;
+        }
+        if (!more) break;
+    }
+
+    for (i = 0; i < col_count; ++i) free(cols[i].buffer);
+    free(cols);
+    free(fields);
+}
+
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: tecol [-i input.tec | -c input.csv] [-o output.tec] [-b rows] expr...\n"
+        "  expr is an expression or name=expression over the input column names.\n"
+        "  Reads CSV from standard input and writes CSV to standard output by default.\n");
+    exit(2);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *binary_in = 0, *csv_in = 0, *binary_out = 0;
+    unsigned long block = DEFAULT_BLOCK;
+    output *outs;
+    int out_count = 0, i;
+    sink out;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+        if (i + 1 >= argc) usage();
+        switch (argv[i][1]) {
+            case 'i': binary_in = argv[++i]; break;
+            case 'c': csv_in = argv[++i]; break;
+            case 'o': binary_out = argv[++i]; break;
+            case 'b': block = strtoul(argv[++i], 0, 10); break;
+            default: usage();
+        }
+    }
+    if (i >= argc || block == 0 || block > INT_MAX || (binary_in && csv_in)) usage();
+    if (!little_endian() && (binary_in || binary_out)) fail("binary column files need a little-endian host", 0);
+
+    outs = xmalloc(sizeof(output) * (argc - i));
+    for (; i < argc; ++i, ++out_count) {
+        const char *eq = strchr(argv[i], '=');
+        output *o = &outs[out_count];
+        if (eq && eq - argv[i] < NAME_SIZE) {
+            memcpy(o->name, argv[i], eq - argv[i]);
+            o->name[eq - argv[i]] = '\0';
+            o->text = eq + 1;
+        } else {
+            sprintf(o->name, "out%d", out_count);
+            o->text = argv[i];
+        }
+        o->expr = 0;
+        o->values = 0;
+    }
+
+    out.path = binary_out;
+    out.base = 0;
+    out.size = 0;
+
+    if (binary_in) {
+        run_binary(binary_in, outs, out_count, block, &out);
+    } else {
+        FILE *in = csv_in ? fopen(csv_in, "r") : stdin;
+        if (!in) fail("can't open input", csv_in);
+        /* The row count isn't known up front, so CSV input streams to CSV. */
+        if (binary_out) fail("CSV input can only be written as CSV", 0);
+        run_csv(in, outs, out_count, block, &out);
+        if (in != stdin) fclose(in);
+    }
+
+    sink_close(&out, outs, out_count);
+    for (i = 0; i < out_count; ++i) te_free(outs[i].expr);
+    free(outs);
+
+    return 0;
+}
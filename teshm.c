@@ -0,0 +1,230 @@
+/*
+ * TESHM - Client library for the tesrv evaluation daemon
+ *
+ * See teshm.h for the layout of the shared segment.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "teshm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if !defined(__GNUC__)
+#error "teshm needs the GCC atomic builtins"
+#endif
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define CLAIM(p) __sync_bool_compare_and_swap((p), TESHM_FREE, TESHM_CLAIMED)
+
+
+struct teshm {
+    unsigned char *base;
+    size_t size;
+    const teshm_header *header;
+    size_t *used;           /* Bytes of each slot's arena handed out by teshm_buffer. */
+    int next;               /* Where teshm_claim starts looking. */
+};
+
+
+static teshm_request *request(const teshm *c, int slot) {
+    return (teshm_request*)(c->base + c->header->slots + (size_t)slot * c->header->slot_stride);
+}
+
+
+static unsigned char *arena(const teshm *c, int slot) {
+    return (unsigned char*)request(c, slot) + TESHM_ARENA;
+}
+
+
+teshm *teshm_open(const char *name) {
+    struct stat st;
+    const teshm_header *h;
+    teshm *c;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(teshm_header)) {
+        close(fd);
+        return 0;
+    }
+
+    c = calloc(1, sizeof(teshm));
+    if (!c) {
+        close(fd);
+        return 0;
+    }
+    c->size = st.st_size;
+    c->base = mmap(0, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c->base == MAP_FAILED) {
+        free(c);
+        return 0;
+    }
+
+    /* The daemon sets running last, once the rest of the header is written. */
+    h = c->header = (const teshm_header*)c->base;
+    if (memcmp(h->magic, TESHM_MAGIC, 8) != 0 || !LOAD(&h->running) ||
+            h->slots + (uint64_t)h->slot_count * h->slot_stride > c->size ||
+            !(c->used = calloc(h->slot_count ? h->slot_count : 1, sizeof(size_t)))) {
+        munmap(c->base, c->size);
+        free(c);
+        return 0;
+    }
+    c->next = getpid() % (h->slot_count ? h->slot_count : 1);
+    return c;
+}
+
+
+void teshm_close(teshm *c) {
+    unsigned i;
+    const uint32_t pid = getpid();
+    if (!c) return;
+    for (i = 0; i < c->header->slot_count; ++i) {
+        teshm_request *r = request(c, i);
+        if (r->owner == pid && LOAD(&r->state) != TESHM_FREE) teshm_release(c, i);
+    }
+    munmap(c->base, c->size);
+    free(c->used);
+    free(c);
+}
+
+
+static int find_name(const teshm *c, int first, int count, const char *name) {
+    const char *names = (const char*)c->base + c->header->names;
+    int i;
+    for (i = first; i < first + count; ++i) {
+        if (strncmp(names + i * TESHM_NAME_SIZE, name, TESHM_NAME_SIZE) == 0) return i - first;
+    }
+    return -1;
+}
+
+
+int teshm_variable(const teshm *c, const char *name) {
+    return find_name(c, 0, c->header->variable_count, name);
+}
+
+
+int teshm_formula(const teshm *c, const char *name) {
+    return find_name(c, c->header->variable_count, c->header->formula_count, name);
+}
+
+
+int teshm_slots(const teshm *c) {
+    return c->header->slot_count;
+}
+
+
+int teshm_claim(teshm *c) {
+    const int count = c->header->slot_count;
+    int i, v;
+    for (i = 0; i < count; ++i) {
+        const int slot = (c->next + i) % count;
+        teshm_request *r = request(c, slot);
+        if (LOAD(&r->state) == TESHM_FREE && CLAIM(&r->state)) {
+            r->owner = getpid();
+            r->formula = 0;
+            r->rows = 0;
+            r->output = 0;
+            for (v = 0; v < TESHM_MAX_VARIABLES; ++v) {
+                r->columns[v] = -1;
+                r->values[v] = 0;
+            }
+            c->used[slot] = 0;
+            c->next = (slot + 1) % count;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+
+double *teshm_buffer(teshm *c, int slot, size_t count) {
+    /* Buffers start on cache lines, so that rows of different buffers don't share one. */
+    const size_t start = (c->used[slot] + 63) & ~(size_t)63;
+    if (count > (c->header->slot_bytes - start) / sizeof(double) || start > c->header->slot_bytes) return 0;
+    c->used[slot] = start + count * sizeof(double);
+    return (double*)(arena(c, slot) + start);
+}
+
+
+void teshm_bind(teshm *c, int slot, int variable, const double *values) {
+    if (variable < 0 || variable >= TESHM_MAX_VARIABLES) return;
+    request(c, slot)->columns[variable] = (const unsigned char*)values - arena(c, slot);
+}
+
+
+void teshm_set(teshm *c, int slot, int variable, double value) {
+    teshm_request *r = request(c, slot);
+    if (variable < 0 || variable >= TESHM_MAX_VARIABLES) return;
+    r->columns[variable] = -1;
+    r->values[variable] = value;
+}
+
+
+int teshm_submit(teshm *c, int slot, int formula, size_t rows, double *out) {
+    teshm_request *r = request(c, slot);
+    /* The request only has 32 bits for it, and the daemon takes no more than this. */
+    if (rows > TESHM_MAX_ROWS) {
+        STORE(&r->state, TESHM_FAILED);
+        return -1;
+    }
+    r->formula = formula;
+    r->rows = (uint32_t)rows;
+    r->output = (unsigned char*)out - arena(c, slot);
+    STORE(&r->state, TESHM_SUBMITTED);
+    return 0;
+}
+
+
+int teshm_poll(teshm *c, int slot) {
+    const uint32_t state = LOAD(&request(c, slot)->state);
+    if (state == TESHM_SUBMITTED) return 0;
+    return state == TESHM_DONE ? 1 : -1;
+}
+
+
+/* Spins for short requests, then yields, then sleeps. */
+static void backoff(int *idle) {
+    if (++*idle < 256) return;
+    if (*idle < 1024) {
+        sched_yield();
+    } else {
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = 20000;
+        nanosleep(&ts, 0);
+    }
+}
+
+
+int teshm_wait(teshm *c, int slot) {
+    int idle = 0, state;
+    while ((state = teshm_poll(c, slot)) == 0) {
+        if (!LOAD(&c->header->running)) return -1;
+        backoff(&idle);
+    }
+    return state > 0 ? 0 : -1;
+}
+
+
+int teshm_run(teshm *c, int slot, int formula, size_t rows, double *out) {
+    if (teshm_submit(c, slot, formula, rows, out) != 0) return -1;
+    return teshm_wait(c, slot);
+}
+
+
+void teshm_release(teshm *c, int slot) {
+    teshm_request *r = request(c, slot);
+    c->used[slot] = 0;
+    r->owner = 0;
+    STORE(&r->state, TESHM_FREE);
+}
@@ -0,0 +1,133 @@
+/*
+ * TESHM - Client library for the tesrv evaluation daemon
+ *
+ * tesrv keeps a set of compiled formulas and evaluates them for processes on
+ * the same host. It talks to them through a POSIX shared-memory segment
+ * divided into slots. A client claims a slot, writes its input columns into
+ * the slot's arena and submits the request. The daemon evaluates straight out
+ * of the arena into it, and the client reads the results where they are. No
+ * data is copied on either side.
+ *
+ * The segment is in the host's byte order. It is laid out as follows, so
+ * that clients in other languages can map it as well:
+ *     offset  0  teshm_header, 64 bytes
+ *     names      variable names, then formula names, TESHM_NAME_SIZE bytes each,
+ *                zero padded
+ *     slots      slot_count slots, slot_stride bytes apart, each a
+ *                teshm_request followed by an arena of slot_bytes at
+ *                TESHM_ARENA
+ *
+ * The state word of a slot is the only field that two processes update, and
+ * it needs atomic loads and stores, plus compare-and-swaps where both sides
+ * may change it:
+ *     FREE -> CLAIMED           by a client, with a compare-and-swap
+ *     CLAIMED -> SUBMITTED      by the client, once the request is written
+ *     SUBMITTED -> DONE/FAILED  by the daemon, with a compare-and-swap, once
+ *                               the results are written
+ *     DONE/FAILED -> CLAIMED    by the client, to send another request
+ *     any -> FREE               by the client; the daemon also frees slots
+ *                               whose owner has exited
+ *     CLAIMED/DONE -> FAILED    by the client, for a request it won't send
+ * The client stores SUBMITTED with release semantics, and the daemon loads it
+ * with acquire semantics, and the same holds for DONE the other way around.
+ * A slot freed while its request runs may still have results written into its
+ * arena, but the daemon leaves the state alone unless it's still SUBMITTED.
+ */
+
+#ifndef __TESHM_H__
+#define __TESHM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define TESHM_MAGIC "TESHM001"
+#define TESHM_NAME_SIZE 32
+#define TESHM_MAX_VARIABLES 32
+#define TESHM_ARENA 576
+
+/* The most rows a request can ask for. */
+#define TESHM_MAX_ROWS 0x7FFFFFFF
+
+enum {TESHM_FREE = 0, TESHM_CLAIMED, TESHM_SUBMITTED, TESHM_DONE, TESHM_FAILED};
+
+typedef struct teshm_header {
+    char magic[8];
+    uint32_t running;           /* 1 while the daemon serves the segment. */
+    uint32_t pid;               /* Of the daemon. */
+    uint32_t slot_count;
+    uint32_t variable_count;
+    uint32_t formula_count;
+    uint32_t reserved;
+    uint64_t slot_bytes;        /* Size of each slot's arena. */
+    uint64_t names;             /* Offset of the name table. */
+    uint64_t slots;             /* Offset of the first slot. */
+    uint64_t slot_stride;
+} teshm_header;
+
+/* The start of each slot. Offsets are from the start of the slot's arena. */
+typedef struct teshm_request {
+    uint32_t state;
+    uint32_t owner;             /* Process id of the client that claimed the slot. */
+    uint32_t formula;
+    uint32_t rows;
+    uint64_t output;            /* Where the rows results go. */
+    int64_t columns[TESHM_MAX_VARIABLES];   /* Values of each variable, or -1. */
+    double values[TESHM_MAX_VARIABLES];     /* Variables without a column. */
+} teshm_request;
+
+
+typedef struct teshm teshm;
+
+/* Maps the segment of a running daemon, such as "/tesrv". Returns 0 if there is none. */
+teshm *teshm_open(const char *name);
+
+/* Unmaps the segment, freeing any slots still claimed. */
+void teshm_close(teshm *c);
+
+/* Returns the index of a formula or variable by name, or -1. */
+int teshm_formula(const teshm *c, const char *name);
+int teshm_variable(const teshm *c, const char *name);
+
+/* Returns the number of slots, which is how many requests can be in flight at once. */
+int teshm_slots(const teshm *c);
+
+/* Claims a free slot for the calling process. Returns its index, or -1 if all are taken. */
+int teshm_claim(teshm *c);
+
+/* Takes room for count doubles from the slot's arena. Returns 0 if it's full. */
+/* Buffers stay valid until the slot is released, and may be reused by any request. */
+double *teshm_buffer(teshm *c, int slot, size_t count);
+
+/* Gives a variable one value per row from a buffer of the slot, or the same value for all. */
+/* Variables start out at 0. */
+void teshm_bind(teshm *c, int slot, int variable, const double *values);
+void teshm_set(teshm *c, int slot, int variable, double value);
+
+/* Asks the daemon to evaluate formula for rows rows into out, a buffer of the slot. */
+/* Returns 0, or -1 and marks the request failed if rows is over TESHM_MAX_ROWS. */
+int teshm_submit(teshm *c, int slot, int formula, size_t rows, double *out);
+
+/* Returns 0 while the request is running, 1 once it's done, or -1 if the daemon refused it. */
+int teshm_poll(teshm *c, int slot);
+
+/* Waits for the request to finish. Returns 0, or -1 if the daemon refused it */
+/* or has stopped. */
+int teshm_wait(teshm *c, int slot);
+
+/* Submits and waits. */
+int teshm_run(teshm *c, int slot, int formula, size_t rows, double *out);
+
+/* Gives the slot back, along with its buffers. */
+void teshm_release(teshm *c, int slot);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__TESHM_H__*/
@@ -0,0 +1,129 @@
+/*
+ * Usage:
+ *     teshm_bench [path to tesrv]
+ *
+ * Starts tesrv on a private segment and measures round trips through it for
+ * several batch sizes, next to te_eval_array on the same data in process.
+ * The difference is what a request costs on top of the evaluation itself.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "tinyexpr.h"
+#include "teshm.h"
+
+
+#define SECONDS 0.5
+#define EXPRESSION "sqrt(x^2+y^2)"
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void fail(const char *message) {
+    fprintf(stderr, "teshm_bench: %s\n", message);
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const int batches[] = {1, 64, 1024, 16384, 65536};
+    const char *server = argc > 1 ? argv[1] : "./tesrv";
+    char name[64];
+    double x, y, *xs, *ys, *out, start;
+    te_variable vars[2];
+    te_column columns[2];
+    te_expr *local;
+    teshm *c = 0;
+    pid_t pid;
+    int b, i, f, slot, tries;
+
+    sprintf(name, "/teshm_bench.%d", (int)getpid());
+    pid = fork();
+    if (pid < 0) fail("can't fork");
+    if (pid == 0) {
+        execl(server, server, "-n", name, "-s", "2", "-b", "2048", "-v", "x,y",
+            "f=" EXPRESSION, "g=x*y+1", (char*)0);
+        perror(server);
+        _exit(1);
+    }
+
+    /* Give the daemon up to five seconds to come up. */
+    for (tries = 0; tries < 500 && !c; ++tries) {
+        struct timespec ts;
+        if ((c = teshm_open(name))) break;
+        if (waitpid(pid, 0, WNOHANG) == pid) fail("tesrv exited");
+        ts.tv_sec = 0;
+        ts.tv_nsec = 10000000;
+        nanosleep(&ts, 0);
+    }
+    if (!c) {
+        kill(pid, SIGTERM);
+        fail("tesrv didn't start");
+    }
+
+    f = teshm_formula(c, "f");
+    slot = teshm_claim(c);
+    xs = teshm_buffer(c, slot, batches[4]);
+    ys = teshm_buffer(c, slot, batches[4]);
+    out = teshm_buffer(c, slot, batches[4]);
+    if (f < 0 || slot < 0 || !out) fail("can't set up the request");
+    for (i = 0; i < batches[4]; ++i) {
+        xs[i] = i * 0.5;
+        ys[i] = 3.0 - i;
+    }
+    teshm_bind(c, slot, teshm_variable(c, "x"), xs);
+    teshm_bind(c, slot, teshm_variable(c, "y"), ys);
+
+    vars[0].name = "x"; vars[0].address = &x; vars[0].type = TE_VARIABLE; vars[0].context = 0;
+    vars[1].name = "y"; vars[1].address = &y; vars[1].type = TE_VARIABLE; vars[1].context = 0;
+    local = te_compile(EXPRESSION, vars, 2, 0);
+    columns[0].address = &x; columns[0].values = xs; columns[0].type = TE_DOUBLE; columns[0].stride = 0;
+    columns[1].address = &y; columns[1].values = ys; columns[1].type = TE_DOUBLE; columns[1].stride = 0;
+
+    /* The daemon's results should be the same as ours. */
+    if (teshm_run(c, slot, f, batches[4], out) != 0) fail("request failed");
+    for (i = 0; i < batches[4]; ++i) {
+        x = xs[i];
+        y = ys[i];
+        if (out[i] != te_eval(local)) fail("results differ");
+    }
+
+    printf("%8s %14s %12s %14s %12s\n", "rows", "requests/s", "Mrows/s", "local calls/s", "Mrows/s");
+    for (b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); ++b) {
+        const int rows = batches[b];
+        double remote, elapsed;
+        long n;
+
+        for (n = 0, start = now(); (elapsed = now() - start) < SECONDS; ++n) {
+            if (teshm_run(c, slot, f, rows, out) != 0) fail("request failed");
+        }
+        remote = n / elapsed;
+
+        for (n = 0, start = now(); (elapsed = now() - start) < SECONDS; ++n) {
+            te_eval_array(local, columns, 2, rows, out);
+        }
+
+        printf("%8d %14.0f %12.1f %14.0f %12.1f\n", rows,
+            remote, remote * rows * 1e-6, n / elapsed, n / elapsed * rows * 1e-6);
+    }
+
+    te_free(local);
+    teshm_close(c);
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+    return 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * TESRV - Serves TinyExpr formulas to local processes over shared memory
+ *
+ * Usage:
+ *     tesrv [-n /name] [-s slots] [-b kib] [-v var,var,...] expr...
+ *
+ * Each expr is either an expression or "name=expression" over the variables
+ * given with -v. The formulas are compiled once, and the daemon then serves
+ * evaluation requests through the shared-memory segment /name (/tesrv by
+ * default) until it gets SIGINT or SIGTERM, when it removes the segment.
+ *
+ * Clients use the library in teshm.c, or map the segment themselves as laid
+ * out in teshm.h. Each request asks for one formula over a number of rows,
+ * with each variable either bound to a column in the request's slot or set
+ * to a single value. The columns are read where the client wrote them, and
+ * the results are written where the client asked for them, so nothing is
+ * copied. The daemon checks every offset against the slot, so a client can't
+ * make it read or write outside its own slot.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "tinyexpr.h"
+#include "teshm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define DEFAULT_SLOTS 4
+#define DEFAULT_KIB 4096
+
+/* Sweeps without work before the daemon yields, and before it sleeps between sweeps. */
+#define SPIN_SWEEPS 4096
+#define YIELD_SWEEPS 16384
+#define SLEEP_NS 100000
+
+
+typedef struct formula {
+    char name[TESHM_NAME_SIZE];
+    const char *text;
+    te_expr *expr;
+} formula;
+
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+
+static void fail(const char *message, const char *detail) {
+    fprintf(stderr, "tesrv: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+
+static int is_name(const char *s) {
+    if (!(*s >= 'a' && *s <= 'z')) return 0;
+    for (++s; *s; ++s) {
+        if (!((*s >= 'a' && *s <= 'z') || (*s >= '0' && *s <= '9') || *s == '_')) return 0;
+    }
+    return 1;
+}
+
+
+/* Splits the comma separated list in place. Returns the number of names. */
+static int split_names(char *list, char **names) {
+    int count = 0;
+    char *p;
+    for (p = strtok(list, ","); p; p = strtok(0, ",")) {
+        if (count == TESHM_MAX_VARIABLES) fail("too many variables", 0);
+        if (!is_name(p) || strlen(p) >= TESHM_NAME_SIZE) fail("not a variable name", p);
+        names[count++] = p;
+    }
+    return count;
+}
+
+
+/* Whether the rows doubles at offset lie inside an arena of size bytes. */
+static int fits(int64_t offset, uint32_t rows, uint64_t size) {
+    return offset >= 0 && offset % sizeof(double) == 0 && (uint64_t)offset <= size &&
+        rows <= (size - (uint64_t)offset) / sizeof(double);
+}
+
+
+/* Evaluates the request in slot r. Returns the state to leave it in. */
+/* The request is read once, so the client can't change an offset after it's checked. */
+static uint32_t serve(teshm_request *r, uint64_t size, const formula *formulas, int formula_count,
+        double *bound, int variable_count) {
+    unsigned char *arena = (unsigned char*)r + TESHM_ARENA;
+    te_column columns[TESHM_MAX_VARIABLES];
+    const uint32_t which = r->formula, rows = r->rows;
+    const int64_t output = r->output;
+    int i, used = 0;
+
+    if (which >= (uint32_t)formula_count || rows > TESHM_MAX_ROWS || !fits(output, rows, size)) {
+        return TESHM_FAILED;
+    }
+
+    for (i = 0; i < variable_count; ++i) {
+        const int64_t offset = r->columns[i];
+        if (offset < 0) {
+            bound[i] = r->values[i];
+            continue;
+        }
+        if (!fits(offset, rows, size)) return TESHM_FAILED;
+        columns[used].address = &bound[i];
+        columns[used].values = arena + offset;
+        columns[used].type = TE_DOUBLE;
+        columns[used].stride = 0;
+        ++used;
+    }
+
+    te_eval_array(formulas[which].expr, columns, used, (int)rows, (double*)(arena + output));
+    return TESHM_DONE;
+}
+
+
+/* Frees slots whose owner has exited without giving them back. */
+static void reap(unsigned char *slots, unsigned long slot_count, unsigned long stride) {
+    unsigned long i;
+    for (i = 0; i < slot_count; ++i) {
+        teshm_request *r = (teshm_request*)(slots + i * stride);
+        const uint32_t state = LOAD(&r->state);
+        const uint32_t owner = r->owner;
+        if (state != TESHM_FREE && state != TESHM_SUBMITTED && owner && kill(owner, 0) != 0 && errno == ESRCH) {
+            r->owner = 0;
+            STORE(&r->state, TESHM_FREE);
+        }
+    }
+}
+
+
+/* Removes a segment left by a daemon that was killed, or that isn't ours at all. */
+/* A segment whose daemon is still running is left alone, and this fails. */
+static void claim_name(const char *name) {
+    struct stat st;
+    teshm_header *h;
+    int fd = shm_open(name, O_RDONLY, 0), alive;
+
+    if (fd < 0) return;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(teshm_header)) {
+        close(fd);
+        shm_unlink(name);
+        return;
+    }
+    h = mmap(0, sizeof(teshm_header), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) fail("can't map shared memory", name);
+
+    /* Only ESRCH means the process is gone; EPERM means it's someone else's. */
+    alive = memcmp(h->magic, TESHM_MAGIC, 8) == 0 && h->pid && (kill(h->pid, 0) == 0 || errno != ESRCH);
+    munmap(h, sizeof(teshm_header));
+    if (alive) fail("already running", name);
+    shm_unlink(name);
+}
+
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: tesrv [-n /name] [-s slots] [-b kib] [-v var,var,...] expr...\n"
+        "  expr is an expression or name=expression over the variables.\n"
+        "  Serves the formulas over the shared-memory segment /name, /tesrv by default,\n"
+        "  with slots request slots of kib KiB each.\n");
+    exit(2);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *name = "/tesrv";
+    unsigned long slot_count = DEFAULT_SLOTS, kib = DEFAULT_KIB;
+    char *variable_list = 0, *variable_names[TESHM_MAX_VARIABLES];
+    double bound[TESHM_MAX_VARIABLES];
+    te_variable vars[TESHM_MAX_VARIABLES];
+    formula *formulas;
+    int variable_count = 0, formula_count = 0, i, v, fd, idle = 0;
+    unsigned long names_size, stride, size, slot_bytes;
+    unsigned char *base, *slots;
+    teshm_header *h;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+        if (i + 1 >= argc) usage();
+        switch (argv[i][1]) {
+            case 'n': name = argv[++i]; break;
+            case 's': slot_count = strtoul(argv[++i], 0, 10); break;
+            case 'b': kib = strtoul(argv[++i], 0, 10); break;
+            case 'v': variable_list = argv[++i]; break;
+            default: usage();
+        }
+    }
+    if (i >= argc || slot_count == 0 || slot_count > 4096 || kib == 0) usage();
+
+    if (variable_list) variable_count = split_names(variable_list, variable_names);
+    for (v = 0; v < variable_count; ++v) {
+        bound[v] = 0;
+        vars[v].name = variable_names[v];
+        vars[v].address = &bound[v];
+        vars[v].type = TE_VARIABLE;
+        vars[v].context = 0;
+    }
+
+    formulas = calloc(argc - i, sizeof(formula));
+    if (!formulas) fail("out of memory", 0);
+    for (; i < argc; ++i, ++formula_count) {
+        const char *eq = strchr(argv[i], '=');
+        formula *f = &formulas[formula_count];
+        int err;
+        if (eq && eq - argv[i] < TESHM_NAME_SIZE) {
+            memcpy(f->name, argv[i], eq - argv[i]);
+            f->text = eq + 1;
+        } else {
+            sprintf(f->name, "out%d", formula_count);
+            f->text = argv[i];
+        }
+        f->expr = te_compile(f->text, vars, variable_count, &err);
+        if (!f->expr) {
+            fprintf(stderr, "tesrv: parse error in expression %d:\n\t%s\n\t%*s^\n", formula_count + 1, f->text, err - 1, "");
+            exit(1);
+        }
+    }
+
+    /* Header, names, then the slots, each on its own cache lines. */
+    names_size = ((variable_count + formula_count) * TESHM_NAME_SIZE + 63) & ~63UL;
+    slot_bytes = kib * 1024;
+    stride = (TESHM_ARENA + slot_bytes + 63) & ~63UL;
+    size = sizeof(teshm_header) + names_size + slot_count * stride;
+
+    claim_name(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, size) != 0) fail("can't create shared memory", name);
+    base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) fail("can't map shared memory", name);
+    close(fd);
+
+    h = (teshm_header*)base;
+    memcpy(h->magic, TESHM_MAGIC, 8);
+    h->pid = getpid();
+    h->slot_count = slot_count;
+    h->variable_count = variable_count;
+    h->formula_count = formula_count;
+    h->slot_bytes = slot_bytes;
+    h->names = sizeof(teshm_header);
+    h->slots = sizeof(teshm_header) + names_size;
+    h->slot_stride = stride;
+    for (i = 0; i < variable_count; ++i) {
+        strncpy((char*)base + sizeof(teshm_header) + i * TESHM_NAME_SIZE, variable_names[i], TESHM_NAME_SIZE);
+    }
+    for (i = 0; i < formula_count; ++i) {
+        strncpy((char*)base + sizeof(teshm_header) + (variable_count + i) * TESHM_NAME_SIZE, formulas[i].name, TESHM_NAME_SIZE);
+    }
+
+    /* Clients can write the header, so the daemon only ever uses its own copy of the layout. */
+    slots = base + sizeof(teshm_header) + names_size;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    STORE(&h->running, 1);
+
+    /* Sweep the slots in turn, spinning while requests keep coming and backing off when they don't. */
+    while (!stopping) {
+        int served = 0;
+        unsigned s;
+        for (s = 0; s < slot_count; ++s) {
+            teshm_request *r = (teshm_request*)(slots + s * stride);
+            uint32_t submitted = TESHM_SUBMITTED, result;
+            if (LOAD(&r->state) != TESHM_SUBMITTED) continue;
+            result = serve(r, slot_bytes, formulas, formula_count, bound, variable_count);
+            /* If the client released the slot meanwhile, someone else may own it now: drop the result. */
+            __atomic_compare_exchange_n(&r->state, &submitted, result, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            ++served;
+        }
+
+        if (served) {
+            idle = 0;
+        } else if (++idle >= YIELD_SWEEPS) {
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = SLEEP_NS;
+            nanosleep(&ts, 0);
+            if (idle % 1024 == 0) reap(slots, slot_count, stride);
+        } else if (idle >= SPIN_SWEEPS) {
+            sched_yield();
+        }
+    }
+
+    STORE(&h->running, 0);
+    shm_unlink(name);
+    munmap(base, size);
+    for (i = 0; i < formula_count; ++i) te_free(formulas[i].expr);
+    free(formulas);
+    return 0;
+}
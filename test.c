@@ -24,8 +24,15 @@
 
 #include "tinyexpr.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include "minctest.h"
 
+#ifdef TE_THREADS
+#include <pthread.h>
+#endif
+
 
 typedef struct {
     const char *expr;
@@ -672,8 +679,1998 @@ void test_combinatorics() {
 }
 
 
+
+void test_intrinsics() {
+    double x;
+    te_variable lookup[] = {
+        {"x", &x},
+        {"exp", sum1, TE_FUNCTION1},
+    };
+
+    test_equ cases[] = {
+        {"-x", "0-x"},
+        {"x%3", "x-3*floor(x/3)"},
+        {"abs(x-7)", "sqrt((x-7)^2)"},
+        {"ceil(x/2)", "-floor(-x/2)"},
+        {"log10(x)", "ln(x)/ln(10)"},
+        {"sin(x)^2+cos(x)^2", "1"},
+        {"tan(x)", "sin(x)/cos(x)"},
+        {"pow(x,3)", "x*x*x"},
+        {"(x,x*2)", "2*x"},
+    };
+
+    int i;
+    for (x = 1; x < 6; ++x) {
+        for (i = 0; i < sizeof(cases) / sizeof(test_equ); ++i) {
+            te_expr *ex1 = te_compile(cases[i].expr1, lookup, 1, 0);
+            te_expr *ex2 = te_compile(cases[i].expr2, lookup, 1, 0);
+            lok(ex1);
+            lok(ex2);
+            lfequal(te_eval(ex1), te_eval(ex2));
+            te_free(ex1);
+            te_free(ex2);
+        }
+    }
+
+    /* User functions shadowing builtins must not be computed inline. */
+    x = 3;
+    te_expr *ex = te_compile("exp x", lookup, 2, 0);
+    lok(ex);
+    lfequal(te_eval(ex), 6);
+    te_free(ex);
+}
+
+
+void test_tiered() {
+    const char *exprs[] = {
+        "x+5", "(x+5)*2", "x-y", "x/y", "y/(x+1)", "x*y-x/y+1", "-x", "x%3",
+        "x^2", "pow(x,y)", "sqrt(abs(x))", "exp(-x)", "ln(x+10)", "log10(x+10)",
+        "sin x + cos y", "tan(x/10)", "ceil(x/3)+floor(y/3)", "atan2(x,y)",
+        "(1/(x+1)+2/(x+2)+3/(x+3))", "x,y", "sum7(x,y,x,y,x,y,1)", "c2(x,y)",
+        "c0", "fac 4 + x",
+    };
+
+    double x, y, extra = 1;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"sum7", sum7, TE_FUNCTION7},
+        {"c0", clo0, TE_CLOSURE0, &extra},
+        {"c2", clo2, TE_CLOSURE2, &extra},
+    };
+    const int count = sizeof(lookup) / sizeof(te_variable);
+
+    int i, j;
+    for (i = 0; i < sizeof(exprs) / sizeof(const char*); ++i) {
+        int err;
+        te_tier_stats st;
+        te_expr *plain = te_compile(exprs[i], lookup, count, &err);
+        te_expr *tiered = te_compile_tiered(exprs[i], lookup, count, 5, &err);
+        lok(plain);
+        lok(tiered);
+        lok(!err);
+
+        for (j = 0; j < 10; ++j) {
+            x = j - 3.5; y = j * 0.7 + 0.2;
+            const double a = te_eval(plain);
+            const double b = te_eval(tiered);
+            lok(a == b || (a != a && b != b));
+
+            lok(te_get_tier_stats(tiered, &st));
+            lequal((int)st.evaluations, j + 1);
+            lequal(st.tier, j + 1 < 5 ? 1 : 2);
+        }
+
+        lequal((int)st.promoted_at, 5);
+        lequal((int)st.threshold, 5);
+        lok(st.program_length > 0);
+
+        te_free(plain);
+        te_free(tiered);
+    }
+
+    te_tier_stats st;
+    te_expr *n = te_compile("x+1", lookup, count, 0);
+    lok(!te_get_tier_stats(n, &st));
+    te_free(n);
+
+    /* Constants aren't worth tiering. */
+    n = te_compile_tiered("1+2", lookup, count, 5, 0);
+    lok(n);
+    lok(!te_get_tier_stats(n, &st));
+    lfequal(te_eval(n), 3);
+    te_free(n);
+
+    /* Threshold zero promotes on the first evaluation. */
+    x = 2;
+    n = te_compile_tiered("x*x", lookup, count, 0, 0);
+    lfequal(te_eval(n), 4);
+    lok(te_get_tier_stats(n, &st));
+    lequal(st.tier, 2);
+    te_free(n);
+
+    int err;
+    n = te_compile_tiered("x+", lookup, count, 5, &err);
+    lok(!n);
+    lequal(err, 2);
+}
+
+
+static int calls;
+
+double counted(void *context, double a) {
+    ++calls;
+    return a * *((double*)context);
+}
+
+void test_array() {
+    const char *exprs[] = {
+        "x+5", "(x+5)*2", "x-y", "x/y", "y/(x+1)", "x*y-x/y+1", "-x", "x%3",
+        "x^2", "pow(x,y)", "sqrt(abs(x))", "exp(-x)", "ln(x+10)", "log10(x+10)",
+        "sin x + cos y", "tan(x/10)", "ceil(x/3)+floor(y/3)", "atan2(x,y)",
+        "x*a+b", "a*x+b*y", "(a+b)*x", "x*(a+b)", "sqrt(a)*x", "x,a", "a,x", "a",
+        "sum7(x,y,a,b,x,y,1)", "c2(x,a)", "c0", "fac 4 + x", "p(a)+x", "p(x)",
+    };
+
+    double x, y, a = 2, b = -1.5, extra = 3;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y}, {"a", &a}, {"b", &b},
+        {"sum7", sum7, TE_FUNCTION7},
+        {"c0", clo0, TE_CLOSURE0, &extra},
+        {"c2", clo2, TE_CLOSURE2, &extra},
+        {"p", counted, TE_CLOSURE1 | TE_FLAG_PURE, &extra},
+    };
+    const int count = sizeof(lookup) / sizeof(te_variable);
+
+    enum {ROWS = 1000};
+    double xs[ROWS], ys[ROWS], out[ROWS];
+    te_column columns[] = {{&x, xs}, {&y, ys}, {&a, 0}};
+
+    int i, j;
+    for (j = 0; j < ROWS; ++j) {
+        xs[j] = j * 0.01 - 3.3;
+        ys[j] = j * -0.007 + 1.1;
+    }
+
+    for (i = 0; i < sizeof(exprs) / sizeof(const char*); ++i) {
+        te_expr *n = te_compile(exprs[i], lookup, count, 0);
+        lok(n);
+
+        te_eval_array(n, columns, 3, ROWS, out);
+
+        int bad = 0;
+        for (j = 0; j < ROWS; ++j) {
+            x = xs[j]; y = ys[j];
+            const double r = te_eval(n);
+            if (!(r == out[j] || (r != r && out[j] != out[j]) || fabs(r - out[j]) < 1e-12)) ++bad;
+        }
+        lequal(bad, 0);
+        if (bad) printf("FAILED: %s\n", exprs[i]);
+
+        te_free(n);
+    }
+
+    /* Pure subexpressions of uniform variables are computed once per call. */
+    te_expr *n = te_compile("p(a) + p(x)", lookup, count, 0);
+    calls = 0;
+    te_eval_array(n, columns, 3, ROWS, out);
+    lequal(calls, ROWS + 1);
+    lfequal(out[10], extra * a + extra * xs[10]);
+    te_free(n);
+
+    /* Impure ones run for every row. */
+    te_expr *m = te_compile("c2(a, 1) + x", lookup, count, 0);
+    te_eval_array(m, columns, 3, ROWS, out);
+    lfequal(out[10], extra + a + 1 + xs[10]);
+    te_free(m);
+}
+
+
+void test_store() {
+    double r, t, s, k;
+    te_variable lookup[] = {
+        {"r", &r}, {"t", &t}, {"s", &s}, {"k", &k},
+        {"c2", clo2, TE_CLOSURE2, 0},
+    };
+    const int count = sizeof(lookup) / sizeof(te_variable);
+
+    const char *exprs[] = {
+        "s*exp(-r*t)",
+        "k*exp(-r*t)",
+        "(s-k)*exp(-r*t)",
+        "exp(-r*t)",
+        "c2(exp(-r*t), s)",
+        "c2(exp(-r*t), s)",
+    };
+    enum {N = sizeof(exprs) / sizeof(const char*)};
+
+    te_store *st = te_store_new();
+    te_store_stats stats;
+    te_expr *n[N];
+    int i;
+
+    r = 0.05; t = 2; s = 100; k = 90;
+
+    for (i = 0; i < N; ++i) {
+        int err;
+        n[i] = te_store_compile(st, exprs[i], lookup, count, &err);
+        lok(n[i]);
+        lequal(err, 0);
+
+        te_expr *plain = te_compile(exprs[i], lookup, count, 0);
+        lfequal(te_eval(n[i]), te_eval(plain));
+        te_free(plain);
+    }
+
+    /* exp(-r*t) and everything under it exist once. */
+    lok(n[0]->parameters[1] == n[1]->parameters[1]);
+    lok(n[3] == n[1]->parameters[1]);
+    lok(n[4] != n[5]);
+    lok(n[4]->parameters[0] == n[3]);
+
+    te_store_get_stats(st, &stats);
+    /* r t neg mul exp s k mul mul sub mul */
+    lequal((int)stats.nodes, 11);
+    lok(stats.hits > 0);
+    lok(stats.bytes > 0);
+
+    /* Identical expressions compile to the same root. */
+    te_expr *again = te_store_compile(st, "s*exp(-r*t)", lookup, count, 0);
+    lok(again == n[0]);
+    te_free(again);
+    lfequal(te_eval(n[0]), s * exp(-r * t));
+
+    te_expr *bad = te_store_compile(st, "exp(-r*", lookup, count, 0);
+    lok(!bad);
+
+    for (i = 0; i < N - 1; ++i) {
+        te_free(n[i]);
+        lfequal(te_eval(n[N - 1]), clo2(0, exp(-r * t), s));
+    }
+
+    te_store_get_stats(st, &stats);
+    lequal((int)stats.nodes, 6);
+
+    /* Expressions may outlive their store. */
+    te_store_free(st);
+    lfequal(te_eval(n[N - 1]), clo2(0, exp(-r * t), s));
+    te_free(n[N - 1]);
+}
+
+
+void test_many() {
+    double x, y, extra = 0;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"sum7", sum7, TE_FUNCTION7 | TE_FLAG_PURE},
+        {"c1", clo1, TE_CLOSURE1, &extra},
+    };
+    const int count = sizeof(lookup) / sizeof(te_variable);
+
+    const char *exprs[] = {
+        "sqrt(x^2+y^2)",
+        "sqrt(x^2+y^2)*2",
+        "x^2+y^2",
+        "-x%3 + abs(y) - ceil(x) / floor(y+10)",
+        "exp(x/10)+ln(y+10)+log10(y+10)+sin(x)+cos(y)+tan(x/10)",
+        "sum7(x,y,x^2,y^2,1,2,3) + pow(x,2)",
+        "c1(x) + c1(x)",
+        "(x,y)",
+        "5",
+        "pi*2",
+        "x",
+    };
+    enum {N = sizeof(exprs) / sizeof(const char*)};
+
+    int errors[N], i;
+    double out[N];
+
+    te_program *p = te_compile_many(exprs, N, lookup, count, errors);
+    lok(p);
+    for (i = 0; i < N; ++i) lequal(errors[i], 0);
+
+    for (x = -3; x < 3; x += 0.7) {
+        for (y = -1; y < 2; y += 0.3) {
+            te_eval_many(p, out);
+            for (i = 0; i < N; ++i) {
+                te_expr *n = te_compile(exprs[i], lookup, count, 0);
+                const double r = te_eval(n);
+                lok(r == out[i] || (r != r && out[i] != out[i]));
+                te_free(n);
+            }
+        }
+    }
+
+    te_program_free(p);
+
+    /* x, 2, x^2, y, y^2, +, sqrt and *, against 15 nodes separately. */
+    p = te_compile_many(exprs, 2, lookup, count, 0);
+    lequal(te_program_steps(p), 8);
+    te_program_free(p);
+
+    const char *bad[] = {"x+1", "y*", "2"};
+    int bad_errors[3];
+    p = te_compile_many(bad, 3, lookup, count, bad_errors);
+    lok(!p);
+    lequal(bad_errors[0], 0);
+    lequal(bad_errors[1], 2);
+    lequal(bad_errors[2], 0);
+}
+
+
+int vector_calls, vector_rows;
+
+void vec_hypot(const double *const *args, int count, double *out) {
+    int i;
+    ++vector_calls;
+    vector_rows += count;
+    for (i = 0; i < count; ++i) out[i] = sqrt(args[0][i] * args[0][i] + args[1][i] * args[1][i]);
+}
+
+void vec_scale(void *context, const double *const *args, int count, double *out) {
+    int i;
+    ++vector_calls;
+    vector_rows += count;
+    for (i = 0; i < count; ++i) out[i] = args[0][i] * *((double*)context);
+}
+
+void test_vector() {
+    double x, y, a = 2, extra = 3;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y}, {"a", &a},
+        {"vh", vec_hypot, TE_VECFUNCTION2 | TE_FLAG_PURE},
+        {"vs", vec_scale, TE_VECCLOSURE1, &extra},
+    };
+    const int count = sizeof(lookup) / sizeof(te_variable);
+
+    const char *exprs[] = {
+        "vh(x, y)", "vh(x, y) + 1", "vs(x - y)", "vh(vs(x), a) * a", "vs(a) + x",
+    };
+
+    enum {ROWS = 1000};
+    double xs[ROWS], ys[ROWS], out[ROWS];
+    te_column columns[] = {{&x, xs}, {&y, ys}, {&a, 0}};
+
+    int i, j;
+    for (j = 0; j < ROWS; ++j) {
+        xs[j] = j * 0.01 - 3.3;
+        ys[j] = j * -0.007 + 1.1;
+    }
+
+    for (i = 0; i < sizeof(exprs) / sizeof(const char*); ++i) {
+        te_expr *n = te_compile(exprs[i], lookup, count, 0);
+        lok(n);
+
+        te_eval_array(n, columns, 3, ROWS, out);
+
+        int bad = 0;
+        for (j = 0; j < ROWS; ++j) {
+            x = xs[j]; y = ys[j];
+            if (fabs(te_eval(n) - out[j]) > 1e-12) ++bad;
+        }
+        lequal(bad, 0);
+        if (bad) printf("FAILED: %s\n", exprs[i]);
+
+        te_free(n);
+    }
+
+    /* Arrays are passed a block at a time. */
+    te_expr *n = te_compile("vh(x, y)", lookup, count, 0);
+    vector_calls = vector_rows = 0;
+    te_eval_array(n, columns, 3, ROWS, out);
+    lequal(vector_calls, (ROWS + 255) / 256);
+    lequal(vector_rows, ROWS);
+    lfequal(out[7], sqrt(xs[7] * xs[7] + ys[7] * ys[7]));
+
+    /* te_eval falls back to one row per call. */
+    x = 3; y = 4;
+    vector_calls = vector_rows = 0;
+    lfequal(te_eval(n), 5);
+    lequal(vector_calls, 1);
+    lequal(vector_rows, 1);
+    te_free(n);
+
+    /* Pure vector functions of constants are folded. */
+    n = te_compile("vh(3, 4)", lookup, count, 0);
+    vector_calls = 0;
+    lfequal(te_eval(n), 5);
+    lequal(vector_calls, 0);
+    te_free(n);
+
+    /* Impure ones still run for every block, even on uniform arguments. */
+    n = te_compile("vs(a) + x", lookup, count, 0);
+    vector_calls = 0;
+    te_eval_array(n, columns, 3, ROWS, out);
+    lequal(vector_calls, (ROWS + 255) / 256);
+    lfequal(out[9], a * extra + xs[9]);
+
+    /* Linearized programs use the scalar fallback too. */
+    const char *many[] = {"vh(x, y)", "vs(x) + vh(x, y)"};
+    double results[2];
+    te_program *p = te_compile_many(many, 2, lookup, count, 0);
+    lok(p);
+    x = 6; y = 8;
+    te_eval_many(p, results);
+    lfequal(results[0], 10);
+    lfequal(results[1], 18 + 10);
+    te_program_free(p);
+    te_free(n);
+}
+
+
+void test_reduce() {
+    double x, y, a = 0.5;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"a", &a}};
+
+    enum {ROWS = 1000};
+    double xs[ROWS], ys[ROWS], out[ROWS];
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+
+    int i, j;
+    for (j = 0; j < ROWS; ++j) {
+        xs[j] = j * 0.01 - 3.3;
+        ys[j] = sin(j * 0.1);
+    }
+
+    const char *exprs[] = {"x*y + a", "sqrt(x) - y", "x", "a"};
+    for (i = 0; i < sizeof(exprs) / sizeof(const char*); ++i) {
+        te_expr *n = te_compile(exprs[i], lookup, 3, 0);
+        te_reduction r, part, whole;
+        unsigned long count = 0;
+        long argmin = -1, argmax = -1;
+        double sum = 0;
+
+        te_eval_array(n, columns, 2, ROWS, out);
+        for (j = 0; j < ROWS; ++j) {
+            if (out[j] != out[j]) continue;
+            sum += out[j];
+            if (argmin < 0 || out[j] < out[argmin]) argmin = j;
+            if (argmax < 0 || out[j] > out[argmax]) argmax = j;
+            ++count;
+        }
+
+        te_reduce_init(&r, 0);
+        te_reduce(n, columns, 2, ROWS, &r);
+        lequal((int)r.rows, ROWS);
+        lequal((int)r.count, (int)count);
+        lok(fabs(te_reduction_sum(&r) - sum) < 1e-9);
+        lok(fabs(te_reduction_mean(&r) - sum / count) < 1e-12);
+        lequal((int)r.argmin, (int)argmin);
+        lequal((int)r.argmax, (int)argmax);
+        lfequal(r.min, out[argmin]);
+        lfequal(r.max, out[argmax]);
+
+        /* Partial reductions of slices merge into the same result. */
+        const int cuts[] = {0, 300, 301, 700, ROWS};
+        te_reduce_init(&whole, 0);
+        for (j = 0; j < 4; ++j) {
+            te_column slice[] = {{&x, xs + cuts[j]}, {&y, ys + cuts[j]}};
+            te_reduce_init(&part, 0);
+            te_reduce(n, slice, 2, cuts[j + 1] - cuts[j], &part);
+            te_reduce_merge(&whole, &part);
+        }
+        lequal((int)whole.rows, ROWS);
+        lequal((int)whole.count, (int)count);
+        lequal((int)whole.argmin, (int)argmin);
+        lequal((int)whole.argmax, (int)argmax);
+        lok(fabs(te_reduction_sum(&whole) - sum) < 1e-9);
+
+        te_free(n);
+    }
+
+    /* Compensated sums keep what plain sums round away. */
+    for (j = 0; j < ROWS; ++j) xs[j] = 1;
+    xs[0] = 1e16;
+    xs[ROWS - 1] = -1e16;
+
+    te_expr *n = te_compile("x", lookup, 3, 0);
+    te_reduction plain, exact;
+    te_reduce_init(&plain, 0);
+    te_reduce_init(&exact, TE_REDUCE_COMPENSATED);
+    te_reduce(n, columns, 2, ROWS, &plain);
+    te_reduce(n, columns, 2, ROWS, &exact);
+    lok(te_reduction_sum(&plain) != ROWS - 2);
+    lfequal(te_reduction_sum(&exact), ROWS - 2);
+    lequal((int)exact.argmax, 0);
+    lequal((int)exact.argmin, ROWS - 1);
+
+    /* Empty reductions. */
+    te_reduce_init(&plain, 0);
+    lok(te_reduction_mean(&plain) != te_reduction_mean(&plain));
+    lequal((int)plain.argmax, -1);
+    te_reduce_merge(&exact, &plain);
+    lfequal(te_reduction_sum(&exact), ROWS - 2);
+    te_free(n);
+
+    /* Histograms. */
+    for (j = 0; j < ROWS; ++j) xs[j] = j * 0.01 - 3.3;
+    n = te_compile("x", lookup, 3, 0);
+    unsigned long bins[10] = {0}, halves[10] = {0};
+    te_histogram(n, columns, 2, ROWS, -3, 7, 10, bins);
+    lequal((int)bins[0], 100);
+    lequal((int)bins[5], 100);
+    lequal((int)bins[9], 70);
+
+    te_column first[] = {{&x, xs}}, second[] = {{&x, xs + 500}};
+    te_histogram(n, first, 1, 500, -3, 7, 10, halves);
+    te_histogram(n, second, 1, ROWS - 500, -3, 7, 10, halves);
+    for (j = 0; j < 10; ++j) lequal((int)halves[j], (int)bins[j]);
+    te_free(n);
+}
+
+
+typedef struct record {
+    float f;
+    int32_t i;
+    int64_t l;
+    double d;
+} record;
+
+void test_typed() {
+    record rec = {1.5f, -7, 1LL << 40, 0.25};
+    double x = 2;
+    te_variable lookup[] = {
+        {"f", &rec.f, TE_FLOAT}, {"i", &rec.i, TE_INT32},
+        {"l", &rec.l, TE_INT64}, {"d", &rec.d}, {"x", &x},
+    };
+
+    /* Scalar evaluation reads the fields in place. */
+    const char *expr = "f*x + i - l/2^40 + d";
+    te_expr *n = te_compile(expr, lookup, 5, 0);
+    te_expr *t = te_compile_tiered(expr, lookup, 5, 1, 0);
+    te_program *p = te_compile_many(&expr, 1, lookup, 5, 0);
+    te_interval range = {0, 0};
+    double out[2];
+    int j;
+
+    lok(n && t && p);
+    for (j = 0; j < 5; ++j) {
+        const double r = rec.f * x + rec.i - rec.l / pow(2, 40) + rec.d;
+        lfequal(te_eval(n), r);
+        lfequal(te_eval(t), r);
+        te_eval_many(p, out);
+        lfequal(out[0], r);
+        range = te_eval_interval(n, 0, 0);
+        lfequal(range.lower, r);
+        rec.f *= -2; rec.i += 3; rec.l -= 1LL << 39; rec.d += 1;
+    }
+    te_free(n);
+    te_free(t);
+    te_program_free(p);
+
+    n = te_compile("i", lookup, 5, 0);
+    rec.i = INT32_MIN;
+    lfequal(te_eval(n), INT32_MIN);
+    te_free(n);
+
+    /* Columns can be fields of an array of structs. */
+    enum {ROWS = 700};
+    record recs[ROWS];
+    double f, i, l, d, xs[ROWS], results[ROWS];
+    te_variable plain[] = {{"f", &f}, {"i", &i}, {"l", &l}, {"d", &d}, {"x", &x}};
+    te_column columns[] = {
+        {&f, &recs[0].f, TE_FLOAT, sizeof(record)},
+        {&i, &recs[0].i, TE_INT32, sizeof(record)},
+        {&l, &recs[0].l, TE_INT64, sizeof(record)},
+        {&d, &recs[0].d, TE_DOUBLE, sizeof(record)},
+        {&x, xs},
+    };
+
+    for (j = 0; j < ROWS; ++j) {
+        recs[j].f = j * 0.5f;
+        recs[j].i = 300 - j;
+        recs[j].l = (int64_t)j << 33;
+        recs[j].d = j * -0.125;
+        xs[j] = j;
+    }
+
+    const char *exprs[] = {"f", "i*2 + f", "l / 2^33 - x", "x + d", "x - d*i", "d/(x+1)", "f/x", "sqrt(abs(i)) + l"};
+    for (j = 0; j < sizeof(exprs) / sizeof(const char*); ++j) {
+        int k, bad = 0;
+        n = te_compile(exprs[j], plain, 5, 0);
+        te_eval_array(n, columns, 5, ROWS, results);
+        for (k = 0; k < ROWS; ++k) {
+            f = recs[k].f; i = recs[k].i; l = (double)recs[k].l; d = recs[k].d; x = xs[k];
+            const double r = te_eval(n);
+            if (r != results[k] && !(r != r && results[k] != results[k])) ++bad;
+        }
+        lequal(bad, 0);
+        if (bad) printf("FAILED: %s\n", exprs[j]);
+        te_free(n);
+    }
+
+    /* Strided values don't need to be aligned. */
+    unsigned char bytes[1 + 9 * ROWS];
+    for (j = 0; j < ROWS; ++j) {
+        const double v = j * 1.25;
+        memcpy(bytes + 1 + 9 * j, &v, sizeof(v));
+    }
+    te_column unaligned[] = {{&x, bytes + 1, TE_DOUBLE, 9}};
+    n = te_compile("x*2", plain, 5, 0);
+    te_eval_array(n, unaligned, 1, ROWS, results);
+    lfequal(results[0], 0);
+    lfequal(results[ROWS - 1], (ROWS - 1) * 2.5);
+    te_free(n);
+}
+
+
+void test_select() {
+    double x, y, a = 3, extra = 2;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y}, {"a", &a},
+        {"c1", clo1, TE_CLOSURE1, &extra},
+    };
+
+    enum {ROWS = 1000};
+    double xs[ROWS], out[ROWS], compact[ROWS];
+    float ys[ROWS];
+    te_column columns[] = {{&x, xs}, {&y, ys, TE_FLOAT}};
+    int selection[ROWS], selected = 0;
+    unsigned char mask[(ROWS + 7) / 8] = {0};
+
+    int i, j;
+    for (j = 0; j < ROWS; ++j) {
+        xs[j] = j * 0.01 - 3.3;
+        ys[j] = (float)(j % 17) - 8;
+    }
+
+    /* Every third row, last one first, and the tail. */
+    selection[selected++] = ROWS - 1;
+    for (j = 0; j < ROWS - 1; ++j) {
+        if (j % 3 == 0 || j > 900) {
+            selection[selected++] = j;
+        }
+    }
+    for (j = 0; j < selected; ++j) mask[selection[j] / 8] |= 1 << (selection[j] % 8);
+
+    const char *exprs[] = {"x*y + x/y", "x - y", "y", "sqrt(x^2 + a)", "c1(x) + y*a"};
+    for (i = 0; i < sizeof(exprs) / sizeof(const char*); ++i) {
+        te_expr *n = te_compile(exprs[i], lookup, 4, 0);
+        int bad = 0, untouched = 0;
+
+        for (j = 0; j < ROWS; ++j) out[j] = -1000;
+        te_eval_selected(n, columns, 2, selection, selected, out, 0);
+        te_eval_selected(n, columns, 2, selection, selected, compact, TE_SELECT_COMPACT);
+
+        for (j = 0; j < selected; ++j) {
+            const int row = selection[j];
+            x = xs[row]; y = ys[row];
+            const double r = te_eval(n);
+            if (r != out[row] || r != compact[j]) ++bad;
+        }
+        for (j = 0; j < ROWS; ++j) if (out[j] == -1000) ++untouched;
+        lequal(bad, 0);
+        lequal(untouched, ROWS - selected);
+        if (bad) printf("FAILED: %s\n", exprs[i]);
+
+        /* Masks visit rows in order. */
+        lequal(te_eval_masked(n, columns, 2, mask, ROWS, compact, TE_SELECT_COMPACT), selected);
+        lfequal(compact[0], out[0]);
+        lfequal(compact[selected - 1], out[ROWS - 1]);
+        for (j = 0; j < ROWS; ++j) out[j] = -1000;
+        te_eval_masked(n, columns, 2, mask, ROWS, out, 0);
+        bad = 0;
+        for (j = 0; j < selected; ++j) if (out[selection[j]] == -1000) ++bad;
+        lequal(bad, 0);
+        lfequal(out[1], -1000);
+
+        te_free(n);
+    }
+
+    /* Functions only run for selected rows. */
+    te_expr *n = te_compile("p(x)", (te_variable[]){{"x", &x}, {"p", counted, TE_CLOSURE1, &extra}}, 2, 0);
+    calls = 0;
+    lequal(te_eval_masked(n, columns, 1, mask, ROWS, compact, TE_SELECT_COMPACT), selected);
+    lequal(calls, selected);
+
+    /* Empty selections and masks. */
+    memset(mask, 0, sizeof(mask));
+    calls = 0;
+    lequal(te_eval_masked(n, columns, 1, mask, ROWS, compact, 0), 0);
+    te_eval_selected(n, columns, 1, selection, 0, compact, 0);
+    lequal(calls, 0);
+    te_free(n);
+}
+
+
+double spin(double count) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < count; ++i) sum += sin(i * 0.001);
+    return sum;
+}
+
+void test_scheduler() {
+    enum {N = 400};
+    double x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"spin", spin, TE_FUNCTION1}};
+    te_expr *n[N];
+    double out[N];
+    int i, run, t;
+
+    for (i = 0; i < N; ++i) {
+        char expr[64];
+        if (i % 37 == 0) sprintf(expr, "spin(%d) + x", 2000 + i * 10);
+        else if (i % 3 == 0) sprintf(expr, "sqrt(x^2 + y^2) * %d", i);
+        else sprintf(expr, "x + %d", i);
+        n[i] = te_compile(expr, lookup, 3, 0);
+        lok(n[i]);
+    }
+
+    const int threads[] = {1, 3, 8};
+    for (t = 0; t < 3; ++t) {
+        te_scheduler *s = te_scheduler_new(threads[t]);
+        lok(s);
+        for (i = 0; i < N; ++i) lequal(te_scheduler_add(s, n[i], &out[i]), i);
+
+        for (run = 0; run < 20; ++run) {
+            int bad = 0;
+            x = run * 0.5 - 3; y = run;
+            for (i = 0; i < N; ++i) out[i] = -1e300;
+            te_scheduler_run(s);
+            for (i = 0; i < N; ++i) if (out[i] != te_eval(n[i])) ++bad;
+            lequal(bad, 0);
+        }
+
+        /* Heavy calls cost more than additions, whether estimated or measured. */
+        lok(te_scheduler_cost(s, 37 * 5) > te_scheduler_cost(s, 1));
+        lok(te_scheduler_cost(s, N) != te_scheduler_cost(s, N));
+        te_scheduler_free(s);
+    }
+
+    /* Nothing to do. */
+    te_scheduler *s = te_scheduler_new(4);
+    te_scheduler_run(s);
+    te_scheduler_free(s);
+    te_scheduler_free(0);
+
+    for (i = 0; i < N; ++i) te_free(n[i]);
+}
+
+
+/* Counts blocks, so tests can check that everything was given back. */
+typedef struct block_count {
+    long live;
+    long allocs;
+    unsigned long bytes;    /* Allocated in all, freed or not. */
+} block_count;
+
+void *count_alloc(void *context, size_t size) {
+    block_count *c = context;
+    ++c->live;
+    ++c->allocs;
+    c->bytes += size;
+    return malloc(size);
+}
+
+void count_free(void *context, void *block) {
+    block_count *c = context;
+    --c->live;
+    free(block);
+}
+
+/* The whole suite runs on this allocator; test_leaks checks it at the end. */
+block_count heap_count = {0, 0, 0};
+const te_allocator counted_heap = {count_alloc, count_free, &heap_count};
+
+
+void test_variadic() {
+    double x = 2, y = -3;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+    lfequal(te_interp("min(3, 1, 2)", 0), 1);
+    lfequal(te_interp("max(3, 1, 2)", 0), 3);
+    lfequal(te_interp("sum(1, 2, 3, 4)", 0), 10);
+    lfequal(te_interp("prod(1, 2, 3, 4)", 0), 24);
+    lfequal(te_interp("avg(1, 2, 3, 4)", 0), 2.5);
+    lfequal(te_interp("hypot(3, 4)", 0), 5);
+    lfequal(te_interp("hypot(-3)", 0), 3);
+    lfequal(te_interp("hypot(2, 3, 6)", 0), 7);
+    lfequal(te_interp("hypot(0, 0)", 0), 0);
+    lfequal(te_interp("min(5)", 0), 5);
+    lfequal(te_interp("max(1, 2) + min(3, 4) * 2", 0), 8);
+
+    /* No overflow on the way. */
+    lok(fabs(te_interp("hypot(1e200, 1e200)", 0) / (sqrt(2) * 1e200) - 1) < 1e-15);
+    lok(te_interp("hypot(1e-200, 1e-200)", 0) > 0);
+
+    /* NaN in, NaN out, wherever it is. Infinite hypot wins over NaN. */
+    lok(te_interp("min(0/0, 1)", 0) != te_interp("min(0/0, 1)", 0));
+    lok(te_interp("max(1, 0/0, 2)", 0) != te_interp("max(1, 0/0, 2)", 0));
+    lok(te_interp("sum(1, 0/0)", 0) != te_interp("sum(1, 0/0)", 0));
+    lok(te_interp("hypot(1/0, 0/0)", 0) > 1e308);
+    lok(te_interp("hypot(0/0, -1/0)", 0) > 1e308);
+
+    int err;
+    te_interp("min()", &err); lequal(err, 5);
+    te_interp("min 1", &err); lok(err);
+    te_interp("max(1, 2", &err); lok(err);
+    te_interp("sum(1,)", &err); lok(err);
+
+    /* Nested calls of the same builtin become one node. */
+    te_expr *n = te_compile("min(x, min(y, 3), min(1, min(x, y)))", lookup, 2, 0);
+    lok(n);
+    lequal(te_analyze(n).nodes, 7);
+    lfequal(te_eval(n), -3);
+    te_free(n);
+
+    n = te_compile("sum(x, sum(y, sum(x, y)), x) + max(x, max(y, 1))", lookup, 2, 0);
+    lequal(te_analyze(n).nodes, 11);
+    lfequal(te_eval(n), 0 + 2);
+    te_free(n);
+
+    /* But not avg, or a different builtin. */
+    lfequal(te_interp("avg(1, avg(2, 4))", 0), 2);
+    n = te_compile("max(x, min(y, 3))", lookup, 2, 0);
+    lequal(te_analyze(n).nodes, 5);
+    te_free(n);
+
+    /* Constant calls are folded. */
+    n = te_compile("max(1, 5, 3) + x", lookup, 2, 0);
+    lequal(te_analyze(n).nodes, 3);
+    lfequal(te_eval(n), 7);
+    te_free(n);
+
+    /* Long argument lists, up to 511. */
+    char buffer[4096];
+    int i, len = sprintf(buffer, "sum(x");
+    for (i = 1; i < 400; ++i) len += sprintf(buffer + len, ", %s", i % 2 ? "y" : "x");
+    strcpy(buffer + len, ")");
+    n = te_compile(buffer, lookup, 2, &err);
+    lok(n);
+    lequal(te_analyze(n).nodes, 401);
+    lfequal(te_eval(n), 200 * 2 + 200 * -3);
+    te_free(n);
+
+    len = sprintf(buffer, "max(1");
+    for (i = 1; i < 600; ++i) len += sprintf(buffer + len, ",%d", i);
+    strcpy(buffer + len, ")");
+    lok(!te_compile(buffer, lookup, 2, &err));
+    lok(err);
+
+    /* A lookup entry of the same name takes over. */
+    te_variable own[] = {{"min", &x}};
+    n = te_compile("min + 1", own, 1, 0);
+    lfequal(te_eval(n), 3);
+    te_free(n);
+
+    /* Arrays, programs and tiered expressions agree with te_eval. */
+    const char *exprs[] = {
+        "min(x, y, 1)", "max(x, y * 2, 0.5) - x", "sum(x, y, x * y, 1)", "prod(x, y, 0.5)",
+        "avg(x, y, 3)", "hypot(x, y, 1)", "sum(min(x, y), max(x, y), hypot(x, y))",
+        "min(x, 0/0, y)", "hypot(x * 1e300, y * 1e300)",
+    };
+    const int count = sizeof(exprs) / sizeof(const char*);
+    enum {ROWS = 300};
+    double xs[ROWS], ys[ROWS], out[ROWS], many[sizeof(exprs) / sizeof(const char*)];
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+    int j, bad = 0;
+    for (j = 0; j < ROWS; ++j) {
+        xs[j] = j * 0.37 - 50;
+        ys[j] = 30 - j * 0.21;
+    }
+
+    for (i = 0; i < count; ++i) {
+        n = te_compile(exprs[i], lookup, 2, 0);
+        te_expr *tiered = te_compile_tiered(exprs[i], lookup, 2, 1, 0);
+        lok(n && tiered);
+        te_eval_array(n, columns, 2, ROWS, out);
+        for (j = 0; j < ROWS; ++j) {
+            double r, t;
+            x = xs[j]; y = ys[j];
+            r = te_eval(n);
+            t = te_eval(tiered);
+            if (!(r == out[j] && r == t) && !(r != r && out[j] != out[j] && t != t)) ++bad;
+        }
+        te_free(n);
+        te_free(tiered);
+    }
+    lequal(bad, 0);
+
+    te_program *p = te_compile_many(exprs, count, lookup, 2, 0);
+    lok(p);
+    x = 1.5; y = -2.5;
+    te_eval_many(p, many);
+    for (i = 0; i < count; ++i) {
+        n = te_compile(exprs[i], lookup, 2, 0);
+        const double v = te_eval(n);
+        if (!(v == many[i]) && !(v != v && many[i] != many[i])) ++bad;
+        te_free(n);
+    }
+    lequal(bad, 0);
+    te_program_free(p);
+
+    /* Interval bounds. */
+    te_interval_binding ranges[] = {{&x, {-1, 2}}, {&y, {3, 4}}};
+    n = te_compile("min(x, y)", lookup, 2, 0);
+    te_interval r = te_eval_interval(n, ranges, 2);
+    lfequal(r.lower, -1); lfequal(r.upper, 2);
+    te_free(n);
+    n = te_compile("sum(x, y, 1)", lookup, 2, 0);
+    r = te_eval_interval(n, ranges, 2);
+    lok(r.lower <= 3 && r.lower > 2.99 && r.upper >= 7 && r.upper < 7.01);
+    te_free(n);
+    n = te_compile("hypot(x, y)", lookup, 2, 0);
+    r = te_eval_interval(n, ranges, 2);
+    lok(r.lower <= 3 && r.lower > 2.99 && r.upper >= sqrt(20) && r.upper < sqrt(20) + 0.01);
+    te_free(n);
+}
+
+
+void test_analyze() {
+    double x, y;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"c1", clo1, TE_CLOSURE1, 0},
+        {"sum7", sum7, TE_FUNCTION7},
+    };
+    const char *expr = "x + 2*y^2 + sin(x) + atan2(x, y) + c1(x) + sum7(x,x,x,x,x,x,x)";
+    block_count local = {0, 0, 0};
+    const te_allocator counting = {count_alloc, count_free, &local};
+
+    te_expr *n = te_compile_with(&counting, expr, lookup, 4, 0);
+    te_analysis a = te_analyze(n);
+    lequal(a.nodes, 26);
+    lequal(a.depth, 8);
+    lequal(a.variables, 2);
+    lequal(a.pow_calls, 1);
+    lequal(a.builtin_calls, 2);
+    lequal(a.function_calls, 1);
+    lequal(a.closure_calls, 1);
+    lequal((int)a.bytes, (int)local.bytes);
+
+    /* 15 loads, 6 arithmetic, pow, sin, atan2 and two calls. */
+    lfequal(a.cost, 15 + 6 + 80 + 50 + 40 + 10 + 10);
+
+    te_cost_table costs;
+    te_get_cost_table(&costs);
+    costs.pow = 1000;
+    costs.call = 0;
+    te_set_cost_table(&costs);
+    lfequal(te_analyze(n).cost, 15 + 6 + 1000 + 50 + 40);
+    te_set_cost_table(0);
+    te_get_cost_table(&costs);
+    lfequal(costs.pow, 80);
+    te_free(n);
+    lequal((int)local.live, 0);
+
+    /* Folded constants cost a load. */
+    n = te_compile("(1+2)*3", 0, 0, 0);
+    a = te_analyze(n);
+    lequal(a.nodes, 1);
+    lequal(a.depth, 1);
+    lequal(a.variables, 0);
+    lfequal(a.cost, 1);
+    te_free(n);
+
+    a = te_analyze(0);
+    lequal(a.nodes, 0);
+}
+
+
+
+int memo_calls = 0;
+
+double memo_curve(void *context, double t, double k) {
+    ++memo_calls;
+    return exp(-t * *(double*)context) * k;
+}
+
+double memo_square(double v) {
+    ++memo_calls;
+    return v * v;
+}
+
+void test_memo() {
+    double x = 2, y = 3, rate = 0.05;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"curve", memo_curve, TE_CLOSURE2 | TE_FLAG_PURE | TE_FLAG_MEMO, &rate},
+        {"sq", memo_square, TE_FUNCTION1 | TE_FLAG_PURE | TE_FLAG_MEMO},
+        {"sqi", memo_square, TE_FUNCTION1 | TE_FLAG_MEMO},
+    };
+    const int count = sizeof(lookup) / sizeof(te_variable);
+    unsigned long hits, misses, hits0, misses0;
+
+    te_memo_clear();
+    te_memo_counts(&hits0, &misses0);
+
+    /* The second call of each pair comes from the cache. */
+    te_expr *n = te_compile("curve(x, y) + curve(x, y) + sq(x) + sq(x)", lookup, count, 0);
+    lok(n);
+    memo_calls = 0;
+    lfequal(te_eval(n), 2 * exp(-2 * 0.05) * 3 + 8);
+    lequal(memo_calls, 2);
+    lfequal(te_eval(n), 2 * exp(-2 * 0.05) * 3 + 8);
+    lequal(memo_calls, 2);
+    te_memo_counts(&hits, &misses);
+    lequal((int)(hits - hits0), 6);
+    lequal((int)(misses - misses0), 2);
+
+    /* New arguments miss, old ones are still there. */
+    x = 4;
+    lfequal(te_eval(n), 2 * exp(-4 * 0.05) * 3 + 32);
+    lequal(memo_calls, 4);
+    x = 2;
+    lfequal(te_eval(n), 2 * exp(-2 * 0.05) * 3 + 8);
+    lequal(memo_calls, 4);
+
+    /* Clearing drops every result, as when the context changes. */
+    rate = 0.1;
+    te_memo_clear();
+    lfequal(te_eval(n), 2 * exp(-2 * 0.1) * 3 + 8);
+    lequal(memo_calls, 6);
+    te_free(n);
+
+    /* Over arrays, each distinct row is computed once. */
+    enum {ROWS = 1000};
+    double xs[ROWS], out[ROWS];
+    te_column columns[] = {{&x, xs}};
+    int j, bad = 0;
+    for (j = 0; j < ROWS; ++j) xs[j] = j % 10;
+    n = te_compile("sq(x) + 1", lookup, count, 0);
+    te_memo_clear();
+    memo_calls = 0;
+    te_eval_array(n, columns, 1, ROWS, out);
+    lequal(memo_calls, 10);
+    for (j = 0; j < ROWS; ++j) if (out[j] != xs[j] * xs[j] + 1) ++bad;
+    lequal(bad, 0);
+    te_free(n);
+
+    /* Impure functions are never cached, even with the flag. */
+    n = te_compile("sqi(x) + sqi(x)", lookup, count, 0);
+    memo_calls = 0;
+    lfequal(te_eval(n), 8);
+    lequal(memo_calls, 2);
+    te_free(n);
+
+    /* Nor is anything when memoization is off. */
+    te_set_memo_size(0);
+    n = te_compile("sq(x) + sq(x)", lookup, count, 0);
+    memo_calls = 0;
+    lfequal(te_eval(n), 8);
+    lequal(memo_calls, 2);
+
+    /* A tiny cache still gives right answers as entries evict each other. */
+    te_set_memo_size(1);
+    memo_calls = 0;
+    for (j = 0; j < 100; ++j) {
+        x = j % 37;
+        if (te_eval(n) != 2 * x * x) ++bad;
+    }
+    lequal(bad, 0);
+    lok(memo_calls >= 37 && memo_calls <= 100);
+    te_free(n);
+
+    te_set_memo_size(1024);
+    te_memo_clear();
+}
+
+
+#ifdef TE_PROFILE
+double profile_sum(const te_expr *n) {
+    const int arity = (n->type & (TE_FUNCTION0 | TE_CLOSURE0)) ? (n->type & 7) : 0;
+    double sum = n->profile.exclusive;
+    int i;
+    for (i = 0; i < arity; ++i) sum += profile_sum(n->parameters[i]);
+    return sum;
+}
+
+
+void test_profile() {
+    double x = 2, y = 3;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+    const char *expression = "x*2 + sin(y)";
+    te_expr *n, *left, *right;
+    int i, err;
+
+    n = te_compile(expression, lookup, 2, &err);
+    lok(n);
+    if (!n) return;
+
+    left = n->parameters[0];
+    right = n->parameters[1];
+    lequal(n->profile.start, 0);
+    lequal(n->profile.end, 12);
+    lequal(left->profile.start, 0);
+    lequal(left->profile.end, 3);
+    lequal(right->profile.start, 6);
+    lequal(right->profile.end, 12);
+    lequal(((te_expr*)right->parameters[0])->profile.start, 9);
+    lequal(((te_expr*)right->parameters[0])->profile.end, 12);
+
+    for (i = 0; i < 10; ++i) te_eval(n);
+
+    lequal((int)n->profile.calls, 10);
+    lequal((int)left->profile.calls, 10);
+    lequal((int)((te_expr*)left->parameters[0])->profile.calls, 10);
+    lequal((int)right->profile.calls, 10);
+    lok(n->profile.exclusive <= n->profile.inclusive);
+    lok(right->profile.inclusive <= n->profile.inclusive);
+    lfequal(profile_sum(n), n->profile.inclusive);
+
+    te_profile_reset(n);
+    lequal((int)n->profile.calls, 0);
+    lequal((int)right->profile.calls, 0);
+    lok(n->profile.inclusive == 0);
+    lequal(right->profile.start, 6);
+    te_free(n);
+
+    /* Folded subtrees keep the span they were parsed from. */
+    n = te_compile("x+(2*3)", lookup, 2, &err);
+    lok(n);
+    if (!n) return;
+    lequal(((te_expr*)n->parameters[1])->profile.start, 2);
+    lequal(((te_expr*)n->parameters[1])->profile.end, 7);
+    te_eval(n);
+    lequal((int)n->profile.calls, 1);
+    te_free(n);
+
+    n = te_compile("-x^2", lookup, 2, &err);
+    lok(n);
+    if (!n) return;
+    lequal(n->profile.start, 0);
+    lequal(n->profile.end, 4);
+    te_free(n);
+}
+#endif
+
+
+#ifdef TE_STATS
+unsigned long histogram_total(const unsigned long *histogram) {
+    unsigned long total = 0;
+    int i;
+    for (i = 0; i < TE_STATS_BUCKETS; ++i) total += histogram[i];
+    return total;
+}
+
+
+void test_stats() {
+    double a = 2, b = 3;
+    te_variable lookup[] = {{"a", &a}, {"b", &b}};
+    const char *many[] = {"a*b+1", "a*b+2"};
+    te_stats before, after;
+    te_store *st;
+    te_program *p;
+    te_expr *n, *m;
+    double out[2];
+    int i, err;
+
+    lok(te_stats_snapshot(&before));
+
+    n = te_compile("a*2+sin(b)+3*4", lookup, 2, &err);
+    lok(n);
+    for (i = 0; i < 5; ++i) te_eval(n);
+    te_free(n);
+    lok(!te_compile("1+", 0, 0, &err));
+    lfequal(te_interp("2*3", &err), 6);
+
+    te_stats_snapshot(&after);
+    lequal((int)(after.compiles - before.compiles), 3);
+    lequal((int)(after.compile_errors - before.compile_errors), 1);
+    lequal((int)(after.evals - before.evals), 6);
+    lequal((int)(after.frees - before.frees), 3);
+    lequal((int)(histogram_total(after.eval_ns) - histogram_total(before.eval_ns)), 6);
+    lequal((int)(histogram_total(after.compile_ns) - histogram_total(before.compile_ns)), 3);
+    lok(after.nodes_allocated > before.nodes_allocated);
+    lok(after.bytes_allocated > before.bytes_allocated);
+    lequal((int)after.nodes_live, (int)before.nodes_live);
+    lequal((int)after.bytes_held, (int)before.bytes_held);
+
+    /* Shared, tiered and multi-expression compiles give all their nodes back too. */
+    st = te_store_new();
+    n = te_store_compile(st, "a*b+1", lookup, 2, &err);
+    m = te_store_compile(st, "a*b+2", lookup, 2, &err);
+    te_free(n);
+    te_store_free(st);
+    te_free(m);
+
+    n = te_compile_tiered("a*b+sin(a)", lookup, 2, 3, &err);
+    for (i = 0; i < 5; ++i) te_eval(n);
+    te_free(n);
+
+    p = te_compile_many(many, 2, lookup, 2, 0);
+    te_eval_many(p, out);
+    te_program_free(p);
+
+    te_stats_snapshot(&after);
+    lequal((int)(after.compiles - before.compiles), 8);
+    lequal((int)(after.compiles - before.compiles), (int)(after.frees - before.frees));
+    lequal((int)after.nodes_live, (int)before.nodes_live);
+    lequal((int)after.bytes_held, (int)before.bytes_held);
+}
+#endif
+
+
+void test_graph() {
+    double price = 10, cost = 6, tax = 0.2;
+    float units = 3;
+    te_variable lookup[] = {{"price", &price}, {"cost", &cost}, {"tax", &tax}, {"units", &units, TE_FLOAT}};
+    te_graph *g = te_graph_new(lookup, 4);
+    const double *margin;
+    char name[16], expr[32];
+    int err, i;
+
+    lequal(te_graph_define(g, "margin", "price - cost", &err), 0);
+    lequal(err, 0);
+    lequal(te_graph_define(g, "ratio", "margin / price", &err), 0);
+    lequal(te_graph_define(g, "capped", "min(margin, 1)", &err), 0);
+    lequal(te_graph_define(g, "twice", "capped * 2", &err), 0);
+    lequal(te_graph_define(g, "total", "ratio * units", &err), 0);
+    lok(te_graph_value(g, "margin") != te_graph_value(g, "margin"));
+    lequal(te_graph_update(g), 5);
+    lfequal(te_graph_value(g, "margin"), 4);
+    lfequal(te_graph_value(g, "ratio"), 0.4);
+    lfequal(te_graph_value(g, "twice"), 2);
+    lfequal(te_graph_value(g, "total"), 1.2);
+    lequal(te_graph_update(g), 0);
+
+    /* Only what reads cost is computed again, and twice is cut off at capped. */
+    cost = 7;
+    lequal(te_graph_changed(g, &cost), 1);
+    lequal(te_graph_update(g), 4);
+    lfequal(te_graph_value(g, "ratio"), 0.3);
+    lfequal(te_graph_value(g, "twice"), 2);
+    lfequal(te_graph_value(g, "total"), 0.9);
+
+    units = 2;
+    lequal(te_graph_changed(g, &units), 1);
+    lequal(te_graph_update(g), 1);
+    lfequal(te_graph_value(g, "total"), 0.6);
+
+    lequal(te_graph_changed(g, &tax), 0);
+    lequal(te_graph_update(g), 0);
+
+    /* Cycles are refused and leave the formula as it was. */
+    lequal(te_graph_define(g, "margin", "ratio * price", &err), TE_GRAPH_CYCLE);
+    lequal(te_graph_define(g, "margin", "margin + 1", &err), TE_GRAPH_CYCLE);
+    lequal(te_graph_define(g, "loop", "loop + 1", &err), TE_GRAPH_CYCLE);
+    lok(!te_graph_address(g, "loop"));
+    lequal(te_graph_update(g), 0);
+    lfequal(te_graph_value(g, "margin"), 3);
+
+    lequal(te_graph_define(g, "bad", "1 +", &err), TE_GRAPH_SYNTAX);
+    lok(err > 0);
+    lequal(te_graph_define(g, "bad", "nothing + 1", &err), TE_GRAPH_SYNTAX);
+    lok(!te_graph_address(g, "bad"));
+    lequal(te_graph_define(g, "price", "1", &err), TE_GRAPH_NAME);
+    lequal(te_graph_define(g, "Big", "1", &err), TE_GRAPH_NAME);
+    lequal(te_graph_define(g, "", "1", &err), TE_GRAPH_NAME);
+    lequal(te_graph_define(g, "a-b", "1", &err), TE_GRAPH_NAME);
+
+    /* Redefining a formula recomputes it, and its dependents if it changed. */
+    margin = te_graph_address(g, "margin");
+    lequal(te_graph_define(g, "margin", "price - cost - tax", &err), 0);
+    lequal(te_graph_update(g), 4);
+    lok(margin == te_graph_address(g, "margin"));
+    lfequal(*margin, 2.8);
+    lfequal(te_graph_value(g, "total"), 0.56);
+
+    /* A formula moved to the end of a longer chain still comes after its sources. */
+    lequal(te_graph_define(g, "deep", "price + 1", &err), 0);
+    lequal(te_graph_define(g, "deeper", "deep * 3", &err), 0);
+    lequal(te_graph_define(g, "margin", "deeper - cost", &err), 0);
+    lequal(te_graph_update(g), 6);
+    lfequal(te_graph_value(g, "margin"), 26);
+    price = 20;
+    lequal(te_graph_changed(g, &price), 2);
+    lequal(te_graph_update(g), 6);
+    lfequal(te_graph_value(g, "margin"), 56);
+    lfequal(te_graph_value(g, "ratio"), 2.8);
+    lfequal(te_graph_value(g, "total"), 5.6);
+
+    /* Tax is read now, and margin no longer depends on price directly. */
+    lequal(te_graph_changed(g, &tax), 0);
+    lequal(te_graph_define(g, "margin", "deeper - tax", &err), 0);
+    lequal(te_graph_changed(g, &tax), 1);
+    lequal(te_graph_changed(g, &price), 2);
+    te_graph_update(g);
+    te_graph_free(g);
+
+    /* A long chain is computed in one pass, each link once. */
+    g = te_graph_new(lookup, 4);
+    lequal(te_graph_define(g, "f0", "price", &err), 0);
+    for (i = 1; i < 1000; ++i) {
+        sprintf(name, "f%d", i);
+        sprintf(expr, "f%d + 1", i - 1);
+        lequal(te_graph_define(g, name, expr, &err), 0);
+    }
+    lequal(te_graph_update(g), 1000);
+    lfequal(te_graph_value(g, "f999"), price + 999);
+    price = 1;
+    te_graph_changed(g, &price);
+    lequal(te_graph_update(g), 1000);
+    lfequal(te_graph_value(g, "f999"), 1000);
+    lequal(te_graph_define(g, "f0", "f999", &err), TE_GRAPH_CYCLE);
+    te_graph_free(g);
+    te_graph_free(0);
+}
+
+
+void test_limits() {
+    double x = 2;
+    te_variable lookup[] = {{"x", &x}};
+    te_limits limits = {0, 0, 0, 0};
+    int err, reason;
+    te_expr *n;
+
+    /* No limits. */
+    n = te_compile_limited("sin(x)^2 + (x, 3)", lookup, 1, &limits, &err, &reason);
+    lok(n);
+    lequal(err, 0);
+    lequal(reason, TE_ERROR_NONE);
+    lfequal(te_eval(n), pow(sin(2), 2) + 3);
+    te_free(n);
+
+    n = te_compile_limited("1+", lookup, 1, 0, &err, &reason);
+    lok(!n);
+    lequal(err, 2);
+    lequal(reason, TE_ERROR_SYNTAX);
+
+    limits.max_length = 10;
+    n = te_compile_limited("1 + 2 + 3", lookup, 1, &limits, &err, &reason);
+    lok(n);
+    te_free(n);
+    n = te_compile_limited("1 + 2 + 3 + 4", lookup, 1, &limits, &err, &reason);
+    lok(!n);
+    lequal(reason, TE_ERROR_LENGTH);
+    lok(err >= 10 && err <= 12);
+
+    limits.max_length = 0;
+    limits.max_nodes = 9;
+    n = te_compile_limited("x+x+x+x+x", lookup, 1, &limits, &err, &reason);
+    lok(n);
+    te_free(n);
+    n = te_compile_limited("x+x+x+x+x+x", lookup, 1, &limits, &err, &reason);
+    lok(!n);
+    lequal(reason, TE_ERROR_NODES);
+    lequal(err, 11);
+
+    limits.max_nodes = 0;
+    limits.max_depth = 4;
+    n = te_compile_limited("((x))", lookup, 1, &limits, &err, &reason);
+    lok(n);
+    te_free(n);
+    n = te_compile_limited("((((x))))", lookup, 1, &limits, &err, &reason);
+    lok(!n);
+    lequal(reason, TE_ERROR_DEPTH);
+    lequal(err, 5);
+    n = te_compile_limited("sin sin sin sin x", lookup, 1, &limits, &err, &reason);
+    lok(!n);
+    lequal(reason, TE_ERROR_DEPTH);
+
+    limits.max_depth = 0;
+    n = te_compile("x+1", lookup, 1, 0);
+    limits.max_bytes = te_analyze(n).bytes;
+    te_free(n);
+    n = te_compile_limited("x+1", lookup, 1, &limits, &err, &reason);
+    lok(n);
+    te_free(n);
+    --limits.max_bytes;
+    n = te_compile_limited("x+1", lookup, 1, &limits, &err, &reason);
+    lok(!n);
+    lequal(reason, TE_ERROR_BYTES);
+
+    /* Huge inputs fail without reading or allocating much. */
+    enum {HUGE = 1000000};
+    char *big = malloc(HUGE + 1);
+    int i;
+    for (i = 0; i < HUGE; i += 2) {big[i] = '1'; big[i + 1] = '+';}
+    big[HUGE - 1] = '1';
+    big[HUGE] = 0;
+
+    long allocs = heap_count.allocs;
+    limits.max_bytes = 0;
+    limits.max_length = 1000;
+    n = te_compile_limited(big, lookup, 1, &limits, &err, &reason);
+    lok(!n);
+    lequal(reason, TE_ERROR_LENGTH);
+    lok(heap_count.allocs - allocs < 1100);
+
+    for (i = 0; i < HUGE; ++i) big[i] = '(';
+    limits.max_length = 0;
+    limits.max_depth = 100;
+    allocs = heap_count.allocs;
+    n = te_compile_limited(big, lookup, 1, &limits, &err, &reason);
+    lok(!n);
+    lequal(reason, TE_ERROR_DEPTH);
+    lequal(err, 101);
+    lok(heap_count.allocs - allocs < 110);
+    free(big);
+}
+
+
+#ifdef TE_THREADS
+typedef struct handle_reader {
+    te_handle *h;
+    int reads, bad;
+} handle_reader;
+
+static void *read_handle(void *arg) {
+    handle_reader *r = arg;
+    double last = 0;
+    int i;
+    for (i = 0; i < r->reads; ++i) {
+        const double v = te_handle_eval(r->h);
+        /* Each swap adds one, so a reader never sees the value go down. */
+        if (v < last || v != (int)v) ++r->bad;
+        last = v;
+    }
+    te_handle_thread_done();
+    return 0;
+}
+
+typedef struct handle_writer {
+    te_handle *h;
+    te_expr **trees;
+    int count, failed;
+} handle_writer;
+
+static void *write_handle(void *arg) {
+    handle_writer *w = arg;
+    int i;
+    for (i = 0; i < w->count; ++i) {
+        if (te_handle_swap(w->h, w->trees[i]) < 0) ++w->failed;
+        if (i % 8 == 0) te_handle_reclaim(w->h);
+    }
+    te_handle_thread_done();
+    return 0;
+}
+
+/* The counting allocator isn't safe for threads that allocate at once. */
+static void *plain_alloc(void *context, size_t size) {
+    (void)context;
+    return malloc(size);
+}
+
+static void plain_free(void *context, void *block) {
+    (void)context;
+    free(block);
+}
+#endif
+
+void test_handle() {
+    double x = 1;
+    te_variable lookup[] = {{"x", &x}};
+    const long live = heap_count.live;
+    te_handle *h = te_handle_new(te_compile("x + 1", lookup, 1, 0));
+    const te_expr *held;
+
+    lfequal(te_handle_eval(h), 2);
+    lequal(te_handle_swap(h, te_compile("x * 10", lookup, 1, 0)), 0);
+    lfequal(te_handle_eval(h), 10);
+
+    /* An expression held by a reader outlives the swap, and is freed after. */
+    held = te_handle_acquire(h);
+    lequal(te_handle_swap(h, te_compile("x - 5", lookup, 1, 0)), 1);
+    lfequal(te_eval(held), 10);
+    lfequal(te_handle_eval(h), -4);
+    lequal(te_handle_reclaim(h), 1);
+    te_handle_release(h);
+    lequal(te_handle_reclaim(h), 0);
+
+    lequal(te_handle_swap(h, 0), 0);
+    lok(te_handle_eval(h) != te_handle_eval(h));
+    te_handle_thread_done();
+    lequal(te_handle_swap(h, te_compile("x", lookup, 1, 0)), 0);
+    lfequal(te_handle_eval(h), 1);
+    te_handle_free(h);
+    te_handle_free(0);
+
+    /* Every tree, and every record of one waiting to be freed, has gone back. */
+    lequal((int)(heap_count.live - live), 0);
+
+#ifdef TE_THREADS
+    {
+        handle_reader readers[4];
+        pthread_t threads[4];
+        char expr[32];
+        int i;
+
+        x = 0;
+        h = te_handle_new(te_compile("x", lookup, 1, 0));
+        for (i = 0; i < 4; ++i) {
+            readers[i].h = h;
+            readers[i].reads = 20000;
+            readers[i].bad = 0;
+            pthread_create(&threads[i], 0, read_handle, &readers[i]);
+        }
+        for (i = 1; i <= 2000; ++i) {
+            sprintf(expr, "x + %d", i);
+            lok(te_handle_swap(h, te_compile(expr, lookup, 1, 0)) >= 0);
+        }
+        for (i = 0; i < 4; ++i) {
+            pthread_join(threads[i], 0);
+            lequal(readers[i].bad, 0);
+        }
+        lequal(te_handle_reclaim(h), 0);
+        lfequal(te_handle_eval(h), 2000);
+        te_handle_free(h);
+    }
+
+    /* Writers on several threads take turns, and each old tree is freed once. */
+    {
+        const te_allocator plain = {plain_alloc, plain_free, 0};
+        handle_writer writers[3];
+        handle_reader readers[2];
+        pthread_t threads[5];
+        char expr[32];
+        int i, j;
+
+        te_set_allocator(&plain);
+        x = 0;
+        h = te_handle_new(te_compile("x", lookup, 1, 0));
+        for (i = 0; i < 3; ++i) {
+            writers[i].h = h;
+            writers[i].count = 1000;
+            writers[i].failed = 0;
+            writers[i].trees = malloc(sizeof(te_expr*) * writers[i].count);
+            for (j = 0; j < writers[i].count; ++j) {
+                sprintf(expr, "x + %d", j);
+                writers[i].trees[j] = te_compile(expr, lookup, 1, 0);
+            }
+        }
+        for (i = 0; i < 2; ++i) {
+            readers[i].h = h;
+            readers[i].reads = 20000;
+            readers[i].bad = 0;
+            pthread_create(&threads[3 + i], 0, read_handle, &readers[i]);
+        }
+        for (i = 0; i < 3; ++i) pthread_create(&threads[i], 0, write_handle, &writers[i]);
+        for (i = 0; i < 5; ++i) pthread_join(threads[i], 0);
+        for (i = 0; i < 3; ++i) {
+            lequal(writers[i].failed, 0);
+            free(writers[i].trees);
+        }
+        lequal(te_handle_reclaim(h), 0);
+        lfequal(te_handle_eval(h), 999);
+        te_handle_free(h);
+        te_set_allocator(&counted_heap);
+    }
+#endif
+}
+
+
+
+void test_approximate() {
+    double a = 7, y = 2;
+    te_variable lookup[] = {{"a", &a}, {"y", &y}};
+
+    const char *exprs[] = {"exp(-a*a/2)/(1+0.2316419*a)", "sin(a)*y", "1/a", "a^3-2*a"};
+    const double ranges[][2] = {{0, 5}, {-3, 3}, {0.5, 4}, {-1, 2}};
+    const double tolerances[] = {1e-4, 1e-8, 1e-12};
+
+    int i, j, k;
+    for (i = 0; i < sizeof(exprs) / sizeof(exprs[0]); ++i) {
+        te_expr *n = te_compile(exprs[i], lookup, 2, 0);
+        const double lower = ranges[i][0], upper = ranges[i][1];
+        lok(n);
+
+        for (j = 0; j < sizeof(tolerances) / sizeof(tolerances[0]); ++j) {
+            te_approximation *p = te_approximate(n, &a, lower, upper, tolerances[j]);
+            te_approximation_stats stats;
+            double worst = 0;
+            lok(p);
+            lfequal(a, 7);
+
+            te_approximation_get_stats(p, &stats);
+            lok(stats.segments >= 1);
+            lok(stats.degree >= 0 && stats.degree <= 8);
+            lok(stats.error <= tolerances[j]);
+
+            /* Points that weren't checked while building are close too. */
+            for (k = 0; k <= 1000; ++k) {
+                const double x = lower + (upper - lower) * k / 1000;
+                a = x;
+                const double d = fabs(te_approximation_eval(p, x) - te_eval(n));
+                if (d > worst) worst = d;
+            }
+            lok(worst <= 2 * tolerances[j]);
+
+            lok(te_approximation_eval(p, lower - 0.1) != te_approximation_eval(p, lower - 0.1));
+            lok(te_approximation_eval(p, upper + 0.1) != te_approximation_eval(p, upper + 0.1));
+            lok(te_approximation_eval(p, te_interp("0/0", 0)) != te_approximation_eval(p, te_interp("0/0", 0)));
+            te_approximation_free(p);
+            a = 7;
+        }
+        te_free(n);
+    }
+
+    /* A polynomial is found exactly, on one piece. */
+    te_expr *n = te_compile("a^3-2*a", lookup, 2, 0);
+    te_approximation *p = te_approximate(n, &a, -1, 2, 1e-12);
+    te_approximation_stats stats;
+    te_approximation_get_stats(p, &stats);
+    lequal(stats.segments, 1);
+    lequal(stats.degree, 3);
+    lfequal(te_approximation_eval(p, 1.5), 1.5*1.5*1.5 - 3);
+    te_approximation_free(p);
+    te_free(n);
+
+    /* Other variables keep the value they had. */
+    n = te_compile("sin(a)*y", lookup, 2, 0);
+    y = 3;
+    p = te_approximate(n, &a, 0, 1, 1e-10);
+    y = 100;
+    lok(fabs(te_approximation_eval(p, 0.5) - 3 * sin(0.5)) < 1e-10);
+    te_approximation_free(p);
+    te_free(n);
+
+    /* Poles, domain errors and a tolerance out of reach give nothing. */
+    n = te_compile("1/a", lookup, 2, 0);
+    lok(!te_approximate(n, &a, -1, 1, 1e-6));
+    te_free(n);
+    n = te_compile("sqrt(a)", lookup, 2, 0);
+    lok(!te_approximate(n, &a, -1, 1, 1e-6));
+    lok(!te_approximate(n, &a, 0, 1, 1e-12));
+    lok(!te_approximate(n, &a, 1, 0, 1e-6));
+    lok(!te_approximate(n, &a, 0, 1, 0));
+    lok(!te_approximate(n, 0, 0, 1, 1e-6));
+    lfequal(a, 7);
+    te_free(n);
+    lok(!te_approximate(0, &a, 0, 1, 1e-6));
+    te_approximation_free(0);
+}
+
+
+void test_series() {
+    double x = 0, alpha = 0.25;
+    te_variable lookup[] = {{"x", &x}, {"alpha", &alpha}};
+    const double samples[] = {3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 8, 9, 7, 9};
+    const int count = sizeof(samples) / sizeof(samples[0]);
+    double out[15];
+    int i, j, err;
+
+    te_expr *prev = te_compile("prev(x)", lookup, 2, 0);
+    te_expr *delta = te_compile("delta x", lookup, 2, 0);
+    te_expr *ema = te_compile("ema(x, alpha)", lookup, 2, 0);
+    te_expr *sma = te_compile("sma(x, 2*2)", lookup, 2, 0);
+    lok(prev && delta && ema && sma);
+
+    /* Each evaluation is one step, checked against the same sums done here. */
+    for (j = 0; j < 2; ++j) {
+        double average = 0;
+        for (i = 0; i < count; ++i) {
+            double window = 0;
+            int k, n = 0;
+            x = samples[i];
+            for (k = i; k >= 0 && k > i - 4; --k, ++n) window += samples[k];
+            average = i ? average + alpha * (x - average) : x;
+
+            if (i) {
+                lfequal(te_eval(prev), samples[i - 1]);
+                lfequal(te_eval(delta), samples[i] - samples[i - 1]);
+            } else {
+                const double p = te_eval(prev), d = te_eval(delta);
+                lok(p != p);
+                lok(d != d);
+            }
+            lfequal(te_eval(ema), average);
+            lfequal(te_eval(sma), window / n);
+        }
+        te_reset(prev);
+        te_reset(delta);
+        te_reset(ema);
+        te_reset(sma);
+    }
+
+    /* Stateful calls aren't folded, even with constant arguments. */
+    te_expr *n = te_compile("prev(2*3) + 1", lookup, 2, 0);
+    const double first = te_eval(n);
+    lok(first != first);
+    lfequal(te_eval(n), 7);
+    te_free(n);
+
+    /* Every call has its own state. */
+    n = te_compile("delta(x) - delta(x)", lookup, 2, 0);
+    for (i = 0; i < 5; ++i) {
+        x = i * i;
+        if (i) lfequal(te_eval(n), 0);
+        else te_eval(n);
+    }
+    te_free(n);
+
+    /* Array evaluation takes the rows as steps in order. */
+    te_column column = {&x, samples};
+    te_free(sma);
+    sma = te_compile("sma(x, 4) + ema(x, alpha) * 0", lookup, 2, 0);
+    te_eval_array(sma, &column, 1, count, out);
+    te_reset(sma);
+    for (i = 0; i < count; ++i) {
+        x = samples[i];
+        lfequal(out[i], te_eval(sma));
+    }
+
+    /* A NaN or infinity counts only while it's in the window of sma. */
+    const double nan = te_interp("0/0", 0), inf = te_interp("1/0", 0);
+    const double odd[] = {1, nan, 3, 5, 7, 9, 11, inf, 2, -inf, 4, 6, 8, 10};
+    te_free(sma);
+    sma = te_compile("sma(x, 4)", lookup, 2, 0);
+    for (i = 0; i < sizeof(odd) / sizeof(odd[0]); ++i) {
+        x = odd[i];
+        const double got = te_eval(sma);
+        if (i >= 1 && i <= 4) lok(got != got);
+        if (i == 5) lfequal(got, (3 + 5 + 7 + 9) / 4.0);
+        if (i == 6) lfequal(got, (5 + 7 + 9 + 11) / 4.0);
+        if (i == 7 || i == 8) lok(got == inf);
+        if (i >= 9 && i <= 10) lok(got != got);
+        if (i == 11) lok(got == -inf);
+        if (i == 13) lfequal(got, (4 + 6 + 8 + 10) / 4.0);
+    }
+
+    /* A tiered expression keeps its state when it switches to a program. */
+    n = te_compile_tiered("prev(x)", lookup, 2, 3, 0);
+    for (i = 0; i < count; ++i) {
+        x = samples[i];
+        if (i) lfequal(te_eval(n), samples[i - 1]);
+        else te_eval(n);
+    }
+    te_free(n);
+
+    /* The window of sma has to be a whole number known when compiling. */
+    const char *bad[] = {"sma(x, alpha)", "sma(x, 0)", "sma(x, 2.5)", "sma(x, 1e9)", "sma(x)", "ema(x)"};
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        lok(!te_compile(bad[i], lookup, 2, &err));
+        lok(err > 0);
+    }
+
+    /* Long windows count against the byte limit. */
+    te_limits limits = {0, 0, 0, 4096};
+    int reason;
+    n = te_compile_limited("sma(x, 100)", lookup, 2, &limits, &err, &reason);
+    lok(n);
+    te_free(n);
+    lok(!te_compile_limited("sma(x, 1000)", lookup, 2, &limits, &err, &reason));
+    lequal(reason, TE_ERROR_BYTES);
+
+    te_reset(0);
+    te_free(prev);
+    te_free(delta);
+    te_free(ema);
+    te_free(sma);
+}
+
+/* Counts blocks like count_alloc, but fails once left runs out. */
+typedef struct budget {
+    block_count count;
+    long left;
+} budget;
+
+void *budget_alloc(void *context, size_t size) {
+    budget *b = context;
+    if (b->left <= 0) return 0;
+    --b->left;
+    return count_alloc(&b->count, size);
+}
+
+void budget_free(void *context, void *block) {
+    count_free(&((budget*)context)->count, block);
+}
+
+
+void test_allocator() {
+    double a = 2, b = 3;
+    te_variable lookup[] = {{"a", &a}, {"b", &b}, {"c0", clo0, TE_CLOSURE0, 0}, {"c2", clo2, TE_CLOSURE2, 0}};
+    const char *good[] = {"a+(2*3)", "sin(a)*b", "c0+c2(a,b)", "-a^2", "1,2,3", "pi", "ema(a,0.5)+sma(b,4)"};
+    const char *bad[] = {"1+", "sin(", "(1", "a b", "1)", "c2(a)", "pow(1,2,3)", "nope", "", "1+(2*(3", "sma(a,b)"};
+    block_count local = {0, 0, 0};
+    const te_allocator mine = {count_alloc, count_free, &local};
+    long heap_allocs;
+    unsigned i;
+    int j, err;
+
+    /* Nodes of te_compile_with come from its allocator only. */
+    for (i = 0; i < sizeof(good) / sizeof(good[0]); ++i) {
+        te_expr *m = te_compile(good[i], lookup, 4, 0);
+        te_expr *n;
+        heap_allocs = heap_count.allocs;
+        n = te_compile_with(&mine, good[i], lookup, 4, &err);
+        lok(n);
+        lequal(err, 0);
+        lequal((int)(heap_count.allocs - heap_allocs), 0);
+        lfequal(te_eval(n), te_eval(m));
+        te_free(n);
+        te_free(m);
+        lequal((int)local.live, 0);
+    }
+    lok(local.allocs > 0);
+
+    /* Failed compiles free what they parsed. */
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        lok(!te_compile_with(&mine, bad[i], lookup, 4, &err));
+        lok(err > 0);
+        lequal((int)local.live, 0);
+    }
+
+    /* Running out of memory anywhere fails the compile and frees what it had. */
+    const char *hungry[] = {"max(a, b, 1) - -a^b^2", "c0+c2(a,b)*sin(a)", "ema(a,0.5)+sma(b,4), (1,2)"};
+    for (i = 0; i < sizeof(hungry) / sizeof(hungry[0]); ++i) {
+        budget tight = {{0, 0, 0}, 0};
+        const te_allocator scarce = {budget_alloc, budget_free, &tight};
+        te_expr *m = te_compile(hungry[i], lookup, 4, 0);
+        te_expr *n;
+        int reason;
+        for (j = 0; !(n = te_compile_with(&scarce, hungry[i], lookup, 4, &err)); ++j) {
+            lok(err > 0);
+            lequal((int)tight.count.live, 0);
+            tight.left = j + 1;
+        }
+        lok(j > 2);
+        lfequal(te_eval(n), te_eval(m));
+        te_free(n);
+        lequal((int)tight.count.live, 0);
+
+        /* The same goes for the global allocator, and the reason says why. */
+        tight.left = j / 2;
+        te_set_allocator(&scarce);
+        n = te_compile_limited(hungry[i], lookup, 4, 0, &err, &reason);
+        te_set_allocator(&counted_heap);
+        lok(!n);
+        lequal(reason, TE_ERROR_MEMORY);
+        lequal((int)tight.count.live, 0);
+        te_free(m);
+    }
+
+    /* And for te_compile_many, which allocates its program around the expressions. */
+    budget tight = {{0, 0, 0}, 0};
+    const te_allocator scarce = {budget_alloc, budget_free, &tight};
+    te_program *p;
+    int errors[3];
+    te_set_allocator(&scarce);
+    for (j = 0; !(p = te_compile_many(hungry, 3, lookup, 4, errors)); ++j) {
+        lequal((int)tight.count.live, 0);
+        tight.left = j + 1;
+    }
+    te_program_free(p);
+    te_set_allocator(&counted_heap);
+    lok(j > 5);
+    lequal((int)tight.count.live, 0);
+
+    /* A program too big for the stack evaluates without allocating. */
+    char texts[120][32];
+    const char *many[120];
+    double results[120];
+    for (j = 0; j < 120; ++j) {
+        sprintf(texts[j], "a*%d + b/%d", j + 1, j + 1);
+        many[j] = texts[j];
+    }
+    p = te_compile_many(many, 120, lookup, 4, 0);
+    lok(te_program_steps(p) > 256);
+    heap_allocs = heap_count.allocs;
+    for (j = 0; j < 10; ++j) te_eval_many(p, results);
+    lequal((int)(heap_count.allocs - heap_allocs), 0);
+    lfequal(results[119], a*120 + b/120);
+    te_program_free(p);
+
+    /* With pools, compiling and freeing the same expression stops using the allocator. */
+    te_set_node_pool(64);
+    te_free(te_compile("a*b+sin(a)", lookup, 4, 0));
+    heap_allocs = heap_count.allocs;
+    for (j = 0; j < 100; ++j) {
+        te_expr *n = te_compile("a*b+sin(a)", lookup, 4, 0);
+        lfequal(te_eval(n), a*b+sin(a));
+        te_free(n);
+    }
+    lequal((int)(heap_count.allocs - heap_allocs), 0);
+    te_set_node_pool(0);
+}
+
+
+void test_leaks() {
+    te_pool_drain();
+    lequal((int)heap_count.live, 0);
+}
+
+
+double iv_clo(void *context, double a) {
+    return *((double*)context) * a * a;
+}
+
+te_interval iv_clo_range(void *context, const te_interval *args) {
+    const double k = *((double*)context);
+    const double m = fabs(args[0].lower) > fabs(args[0].upper) ? fabs(args[0].lower) : fabs(args[0].upper);
+    te_interval r;
+    r.lower = args[0].lower <= 0 && args[0].upper >= 0 ? 0 : k * args[0].lower * args[0].lower;
+    if (args[0].lower > 0) r.lower = k * args[0].lower * args[0].lower;
+    if (args[0].upper < 0) r.lower = k * args[0].upper * args[0].upper;
+    r.upper = k * m * m;
+    return r;
+}
+
+void test_interval() {
+    const char *exprs[] = {
+        "x+y", "x-y", "x*y", "x/y", "-x", "x%y", "x^y", "x^2", "x^3", "y^x",
+        "abs x", "acos x", "asin x", "atan x", "atan2(x,y)", "ceil x", "cos x",
+        "cosh x", "exp x", "fac x", "floor x", "ln x", "log x", "log10 x",
+        "ncr(x,y)", "npr(x,y)", "sin x", "sinh x", "sqrt x", "tan x", "tanh x",
+        "e*x+pi", "sin(x*y)/(1+x^2)", "x,y", "cl x", "sum2(x,y)",
+    };
+
+    const double boxes[][4] = {
+        {-3, 2, 0.5, 4},
+        {0.1, 0.9, -0.7, -0.2},
+        {-0.5, 0.5, -2, 2},
+        {2, 9, 1, 3},
+        {-10, -4, 2, 2},
+    };
+
+    double x, y, k = 3;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"cl", iv_clo, TE_CLOSURE1 | TE_FLAG_PURE, &k},
+        {"sum2", sum2, TE_FUNCTION2 | TE_FLAG_PURE},
+    };
+
+    int i, j, si, sj;
+    for (i = 0; i < sizeof(exprs) / sizeof(const char*); ++i) {
+        int err;
+        te_expr *n = te_compile(exprs[i], lookup, sizeof(lookup)/sizeof(te_variable), &err);
+        lok(n);
+
+        for (j = 0; j < sizeof(boxes) / sizeof(boxes[0]); ++j) {
+            te_interval_binding b[3] = {{&x}, {&y}, {iv_clo, {0, 0}, iv_clo_range}};
+            b[0].range.lower = boxes[j][0]; b[0].range.upper = boxes[j][1];
+            b[1].range.lower = boxes[j][2]; b[1].range.upper = boxes[j][3];
+
+            const te_interval r = te_eval_interval(n, b, 3);
+            lok(r.lower <= r.upper || r.lower != r.lower);
+
+            /* Every sample must fall within the bounds. */
+            for (si = 0; si <= 16; ++si) {
+                for (sj = 0; sj <= 16; ++sj) {
+                    x = boxes[j][0] + (boxes[j][1] - boxes[j][0]) * si / 16;
+                    y = boxes[j][2] + (boxes[j][3] - boxes[j][2]) * sj / 16;
+                    const double v = te_eval(n);
+                    if (v != v) continue;
+                    if (!(v >= r.lower && v <= r.upper)) {
+                        printf("FAILED: %s at %g,%g: %g not in [%g, %g]\n", exprs[i], x, y, v, r.lower, r.upper);
+                    }
+                    lok(v >= r.lower && v <= r.upper);
+                }
+            }
+        }
+
+        te_free(n);
+    }
+
+    te_expr *n;
+    te_interval r;
+    te_interval_binding b[] = {{&x, {-2, 3}}};
+
+    n = te_compile("x^2", lookup, 2, 0);
+    r = te_eval_interval(n, b, 1);
+    lfequal(r.lower, 0);
+    lfequal(r.upper, 9);
+    te_free(n);
+
+    n = te_compile("1/x", lookup, 2, 0);
+    r = te_eval_interval(n, b, 1);
+    lok(r.lower == -r.upper && r.upper == r.upper + 1);
+    te_free(n);
+
+    n = te_compile("sin x", lookup, 2, 0);
+    r = te_eval_interval(n, b, 1);
+    lfequal(r.lower, -1);
+    lfequal(r.upper, 1);
+    te_free(n);
+
+    n = te_compile("sqrt(x-5)", lookup, 2, 0);
+    r = te_eval_interval(n, b, 1);
+    lok(r.lower != r.lower);
+    te_free(n);
+
+    x = 4;
+    n = te_compile("sqrt x", lookup, 2, 0);
+    r = te_eval_interval(n, 0, 0);
+    lfequal(r.lower, 2);
+    lfequal(r.upper, 2);
+    te_free(n);
+}
+
+
 int main(int argc, char *argv[])
 {
+    te_set_allocator(&counted_heap);
+
     lrun("Results", test_results);
     lrun("Syntax", test_syntax);
     lrun("NaNs", test_nans);
@@ -685,6 +2682,33 @@ int main(int argc, char *argv[])
     lrun("Optimize", test_optimize);
     lrun("Pow", test_pow);
     lrun("Combinatorics", test_combinatorics);
+    lrun("Intrinsics", test_intrinsics);
+    lrun("Interval", test_interval);
+    lrun("Tiered", test_tiered);
+    lrun("Array", test_array);
+    lrun("Store", test_store);
+    lrun("Many", test_many);
+    lrun("Vector", test_vector);
+    lrun("Reduce", test_reduce);
+    lrun("Typed", test_typed);
+    lrun("Select", test_select);
+    lrun("Scheduler", test_scheduler);
+    lrun("Analyze", test_analyze);
+    lrun("Memo", test_memo);
+    lrun("Variadic", test_variadic);
+    lrun("Graph", test_graph);
+    lrun("Handle", test_handle);
+    lrun("Approximate", test_approximate);
+    lrun("Series", test_series);
+    lrun("Limits", test_limits);
+#ifdef TE_PROFILE
+    lrun("Profile", test_profile);
+#endif
+#ifdef TE_STATS
+    lrun("Stats", test_stats);
+#endif
+    lrun("Allocator", test_allocator);
+    lrun("Leaks", test_leaks);
     lresults();
 
     return lfails != 0;
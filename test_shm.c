@@ -0,0 +1,241 @@
+/*
+ * Tests tesrv through teshm, and through the segment mapped directly as a
+ * client in another language would. Requests whose offsets or row counts
+ * reach outside their slot have to be refused, whatever the client has
+ * written into the header.
+ *
+ * Usage:
+ *     test_shm [path to tesrv]
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "teshm.h"
+#include "minctest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static const char *server;
+static char name[64];
+static teshm *client;
+static unsigned char *base;
+static size_t size;
+static int slot, formula;
+static double *xs, *out;
+
+
+static void pause_ms(int ms) {
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = ms * 1000000L;
+    nanosleep(&ts, 0);
+}
+
+
+/* Starts tesrv on the segment, returning its process id. */
+static pid_t start(const char *segment) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+        execl(server, server, "-n", segment, "-s", "2", "-b", "64", "-v", "x", "f=2*x+1", (char*)0);
+        perror(server);
+        _exit(1);
+    }
+    return pid;
+}
+
+
+/* Waits up to five seconds for the daemon on the segment to come up. */
+static teshm *wait_for(const char *segment) {
+    teshm *c = 0;
+    int tries;
+    for (tries = 0; tries < 500 && !(c = teshm_open(segment)); ++tries) pause_ms(10);
+    return c;
+}
+
+
+static teshm_request *slot_request(void) {
+    const teshm_header *h = (const teshm_header*)base;
+    return (teshm_request*)(base + h->slots + slot * h->slot_stride);
+}
+
+
+/* Submits a request written field by field, and returns the state the daemon left it in. */
+/* Gives up after five seconds, leaving it SUBMITTED. */
+static uint32_t submit_to(teshm_request *r, uint32_t which, uint32_t rows, uint64_t output, int64_t column) {
+    int i;
+    r->formula = which;
+    r->rows = rows;
+    r->output = output;
+    r->columns[0] = column;
+    __atomic_store_n(&r->state, TESHM_SUBMITTED, __ATOMIC_RELEASE);
+    for (i = 0; i < 5000 && __atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == TESHM_SUBMITTED; ++i) pause_ms(1);
+    return __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+}
+
+
+static uint32_t submit_raw(uint32_t which, uint32_t rows, uint64_t output, int64_t column) {
+    return submit_to(slot_request(), which, rows, output, column);
+}
+
+
+void test_valid() {
+    int i, bad = 0;
+    for (i = 0; i < 100; ++i) xs[i] = i;
+    teshm_bind(client, slot, teshm_variable(client, "x"), xs);
+    lequal(teshm_run(client, slot, formula, 100, out), 0);
+    for (i = 0; i < 100; ++i) if (out[i] != 2 * i + 1) ++bad;
+    lequal(bad, 0);
+    lequal(teshm_formula(client, "nope"), -1);
+
+    /* Row counts that don't fit a request are refused by the client. */
+    lequal(teshm_submit(client, slot, formula, (size_t)TESHM_MAX_ROWS + 1, out), -1);
+    lequal(teshm_poll(client, slot), -1);
+    lequal(teshm_run(client, slot, formula, (size_t)-1, out), -1);
+    lequal(teshm_run(client, slot, formula, 100, out), 0);
+    lequal(teshm_variable(client, "y"), -1);
+}
+
+
+void test_refused() {
+    const teshm_header *h = (const teshm_header*)base;
+    const uint64_t bytes = h->slot_bytes;
+    /* Offsets of the buffers, as teshm wrote them for the last request. */
+    const int64_t column = slot_request()->columns[0];
+    const uint64_t output = slot_request()->output;
+
+    lequal(submit_raw(formula, 10, output, column), TESHM_DONE);
+
+    lequal(submit_raw(1, 10, output, column), TESHM_FAILED);
+    lequal(submit_raw(formula, 10, bytes, column), TESHM_FAILED);
+    lequal(submit_raw(formula, 10, bytes - 8, column), TESHM_FAILED);
+    lequal(submit_raw(formula, 10, output + 4, column), TESHM_FAILED);
+    lequal(submit_raw(formula, 10, (uint64_t)1 << 63, column), TESHM_FAILED);
+    lequal(submit_raw(formula, 10, (uint64_t)-8, column), TESHM_FAILED);
+    lequal(submit_raw(formula, bytes / 8 + 1, 0, -1), TESHM_FAILED);
+    lequal(submit_raw(formula, 0xFFFFFFFF, output, column), TESHM_FAILED);
+    lequal(submit_raw(formula, 10, output, bytes), TESHM_FAILED);
+    lequal(submit_raw(formula, 10, output, column + 3), TESHM_FAILED);
+    lequal(submit_raw(formula, 10, output, INT64_MAX - 7), TESHM_FAILED);
+
+    /* The whole arena is fine. */
+    lequal(submit_raw(formula, bytes / 8, 0, 0), TESHM_DONE);
+}
+
+
+void test_header() {
+    teshm_header *h = (teshm_header*)base;
+    const teshm_header saved = *h;
+    teshm_request *r = slot_request();
+    const uint64_t output = r->output;
+
+    /* A client rewriting the layout changes nothing for the daemon. */
+    h->slot_bytes = (uint64_t)1 << 40;
+    h->slot_stride = 0;
+    h->slots = 0;
+    h->slot_count = 1000000;
+    lequal(submit_to(r, formula, 10, saved.slot_bytes + 4096, -1), TESHM_FAILED);
+    *h = saved;
+
+    /* And the daemon is still serving. */
+    lequal(submit_raw(formula, 10, output, -1), TESHM_DONE);
+    lequal(teshm_run(client, slot, formula, 10, out), 0);
+}
+
+
+void test_names() {
+    char stale[80];
+    teshm_header h;
+    teshm *c;
+    pid_t pid, dead;
+    int status, fd, tries;
+
+    /* A second daemon on a segment that's being served gives up. */
+    pid = start(name);
+    for (tries = 0; tries < 500 && waitpid(pid, &status, WNOHANG) == 0; ++tries) pause_ms(10);
+    if (tries == 500) {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
+    lok(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    lequal(teshm_run(client, slot, formula, 10, out), 0);
+
+    /* One left by a daemon that has died is replaced. */
+    dead = fork();
+    if (dead == 0) _exit(0);
+    waitpid(dead, 0, 0);
+    sprintf(stale, "%s.stale", name);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TESHM_MAGIC, 8);
+    h.pid = dead;
+    fd = shm_open(stale, O_RDWR | O_CREAT | O_EXCL, 0600);
+    lok(fd >= 0 && write(fd, &h, sizeof(h)) == sizeof(h));
+    close(fd);
+
+    pid = start(stale);
+    c = wait_for(stale);
+    lok(c);
+    if (c) {
+        const int s = teshm_claim(c);
+        double *o = teshm_buffer(c, s, 10);
+        teshm_set(c, s, teshm_variable(c, "x"), 3);
+        lequal(teshm_run(c, s, teshm_formula(c, "f"), 10, o), 0);
+        lfequal(o[9], 7);
+        teshm_close(c);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+    shm_unlink(stale);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct stat st;
+    pid_t pid;
+    int fd;
+
+    server = argc > 1 ? argv[1] : "./tesrv";
+    sprintf(name, "/test_shm.%d", (int)getpid());
+    pid = start(name);
+    if (pid < 0) return 1;
+
+    client = wait_for(name);
+    if (!client) {
+        kill(pid, SIGTERM);
+        printf("tesrv didn't start\n");
+        return 1;
+    }
+
+    fd = shm_open(name, O_RDWR, 0);
+    fstat(fd, &st);
+    size = st.st_size;
+    base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    formula = teshm_formula(client, "f");
+    slot = teshm_claim(client);
+    xs = teshm_buffer(client, slot, 100);
+    out = teshm_buffer(client, slot, 100);
+
+    lrun("Valid", test_valid);
+    lrun("Refused", test_refused);
+    lrun("Header", test_header);
+    lrun("Names", test_names);
+
+    munmap(base, size);
+    teshm_close(client);
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+
+    lresults();
+    return lfails != 0;
+}
@@ -34,12 +34,35 @@ For log = base 10 log do nothing
 For log = natural log uncomment the next line. */
 /* #define TE_NAT_LOG */
 
+/* Profiling
+To have te_eval count calls and cycles for every node, define TE_PROFILE
+for every file that includes tinyexpr.h. See te_profile_report. */
+
+/* Statistics
+To collect library-wide counters and latency histograms, define TE_STATS.
+See te_stats_snapshot. */
+
+/* Threads
+For te_scheduler to evaluate on a pool of POSIX threads, define TE_THREADS
+and link with -pthread. Without it schedulers run on the calling thread. */
+
+#if (defined(TE_STATS) || defined(TE_THREADS)) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "tinyexpr.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <float.h>
+#include <time.h>
+#include <stdint.h>
+
+#ifdef TE_THREADS
+#include <pthread.h>
+#endif
 
 #ifndef NAN
 #define NAN (0.0/0.0)
@@ -61,59 +84,586 @@ enum {
 enum {TE_CONSTANT = 1};
 
 
+/* Set on the root of an expression from te_compile_tiered(), */
+/* on nodes shared through a te_store, */
+/* on nodes from te_compile_with(), which carry their allocator in front of them, */
+/* and on calls of the time-series builtins, whose context is state the node owns. */
+enum {TE_FLAG_TIERED = 1 << 15, TE_FLAG_SHARED = 1 << 14, TE_FLAG_OWNED = 1 << 13, TE_FLAG_STATEFUL = 1 << 12};
+
+
+/* Built-in operators and common functions carry an opcode in the high bits of
+ * their type, so te_eval() can compute them inline instead of calling through
+ * n->function. The function pointer is still set for everything else. */
+enum {
+    OP_NONE = 0,
+    OP_CONSTANT, OP_VARIABLE, OP_LOAD,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_POW, OP_NEG, OP_COMMA,
+    OP_ABS, OP_CEIL, OP_FLOOR, OP_SQRT, OP_EXP, OP_LN, OP_LOG10,
+    OP_SIN, OP_COS, OP_TAN,
+
+    /* Variadic builtins. Their nodes can have up to NARY_MAX arguments. */
+    OP_MIN, OP_MAX, OP_SUM, OP_PROD, OP_AVG, OP_HYPOT,
+
+    /* Only used in linearized programs. */
+    OP_CALL, OP_ADD_C, OP_ADD_V, OP_SUB_C, OP_SUB_V,
+    OP_MUL_C, OP_MUL_V, OP_DIV_C, OP_DIV_V, OP_GATHER
+};
+
+
 typedef struct state {
     const char *start;
     const char *next;
     int type;
     union {double value; const double *bound; const void *function;};
     void *context;
+    int op;
+    int element;
 
     const te_variable *lookup;
     int lookup_len;
+    const te_allocator *owner;  /* Where nodes come from, or 0 for the global allocator. */
+
+    /* Resource use so far and its limits, see te_compile_limited. */
+    int nodes, depth;
+    unsigned long bytes;
+    te_limits limits;
+    int fail;                   /* The limit that was hit, or 0. */
+
+#ifdef TE_PROFILE
+    const char *token;      /* Start of the current token. */
+    const char *last;       /* End of the token before it. */
+#endif
 } state;
 
 
 #define TYPE_MASK(TYPE) ((TYPE)&0x0000001F)
+/* The opcode takes the top bits of a type so that reading it needs no mask. */
+#define OP_SHIFT 25
+#define OP(CODE) ((CODE) << OP_SHIFT)
+#define OPCODE(TYPE) ((TYPE) >> OP_SHIFT)
+
+/* Nodes keep their number of arguments below the opcode, which new_expr */
+/* fills in from the declared arity, or the count of a variadic builtin. */
+#define ARITY_SHIFT 16
+#define NARY_MAX 511
+#define NARY(COUNT) ((COUNT) << ARITY_SHIFT)
+#define IS_NARY(OPCODE) ((OPCODE) >= OP_MIN && (OPCODE) <= OP_HYPOT)
 
 #define IS_PURE(TYPE) (((TYPE) & TE_FLAG_PURE) != 0)
+#define IS_MEMO(TYPE) (((TYPE) & (TE_FLAG_MEMO | TE_FLAG_PURE | TE_FLAG_VECTOR)) == (TE_FLAG_MEMO | TE_FLAG_PURE))
 #define IS_FUNCTION(TYPE) (((TYPE) & TE_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TE_CLOSURE0) != 0)
-#define ARITY(TYPE) ( ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
-#define NEW_EXPR(type, ...) new_expr((type), (const te_expr*[]){__VA_ARGS__})
-
-static te_expr *new_expr(const int type, const te_expr *parameters[]) {
-    const int arity = ARITY(type);
-    const int psize = sizeof(void*) * arity;
-    const int size = (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
-    te_expr *ret = malloc(size);
-    memset(ret, 0, size);
-    if (arity && parameters) {
-        memcpy(ret->parameters, parameters, psize);
-    }
-    ret->type = type;
+#define ARITY(TYPE) (((TYPE) >> ARITY_SHIFT) & NARY_MAX)
+#define DECLARED_ARITY(TYPE) ( ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
+#define ELEMENT(TYPE) ((TYPE) & TE_INT64)
+#define NEW_EXPR(type, ...) new_node(s, (type), (const te_expr*[]){__VA_ARGS__})
+
+#if defined(__GNUC__)
+#define TE_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define TE_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define TE_THREAD_LOCAL _Thread_local
+#endif
+
+
+#if defined(TE_STATS) || defined(TE_THREADS)
+/* Nanoseconds from a monotonic clock. */
+static unsigned long clock_ns(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#else
+    return (unsigned long)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+#endif
+}
+#endif
+
+
+#ifdef TE_STATS
+/* Each thread counts into its own block, found through a thread-local pointer.
+ * Blocks are pushed onto a global list with compare-and-swap, and are never
+ * freed, so te_stats_snapshot can walk the list without locking. */
+typedef struct stats_block {
+    te_stats counts;
+    struct stats_block *next;
+} stats_block;
+
+#if defined(__GNUC__)
+#define STATS_THREAD_LOCAL TE_THREAD_LOCAL
+#define TE_LOAD(head) __atomic_load_n((head), __ATOMIC_ACQUIRE)
+#define TE_PUSH(head, old, b) __sync_bool_compare_and_swap((head), (old), (b))
+/* Only the owning thread writes a counter, so a relaxed store is enough. */
+#define TE_BUMP(p, amount) __atomic_store_n((p), *(p) + (amount), __ATOMIC_RELAXED)
+#define TE_READ(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+/* Without atomics every thread shares one block. */
+#define STATS_THREAD_LOCAL
+#define TE_LOAD(head) (*(head))
+#define TE_PUSH(head, old, b) (*(head) = (b), 1)
+#define TE_BUMP(p, amount) (*(p) += (amount))
+#define TE_READ(p) (*(p))
+#endif
+
+static stats_block *stats_blocks = 0;
+static STATS_THREAD_LOCAL stats_block *stats_mine = 0;
+static stats_block stats_fallback;
+
+static te_stats *stats_local(void) {
+    stats_block *b = stats_mine;
+    if (!b) {
+        b = calloc(1, sizeof(stats_block));
+        if (!b) return &stats_fallback.counts;
+        do {
+            b->next = TE_LOAD(&stats_blocks);
+        } while (!TE_PUSH(&stats_blocks, b->next, b));
+        stats_mine = b;
+    }
+    return &b->counts;
+}
+
+static void stats_latency(unsigned long *histogram, unsigned long start) {
+    unsigned long ns = clock_ns() - start;
+    int bucket = 0;
+    while (ns > 1 && bucket < TE_STATS_BUCKETS - 1) {
+        ns >>= 1;
+        ++bucket;
+    }
+    TE_BUMP(&histogram[bucket], 1);
+}
+
+#define STAT_ADD(FIELD, AMOUNT) TE_BUMP(&stats_local()->FIELD, (AMOUNT))
+#else
+#define STAT_ADD(FIELD, AMOUNT) ((void)0)
+#endif
+
+#define STAT_NODE_ALLOC(SIZE) (STAT_ADD(nodes_allocated, 1), STAT_ADD(bytes_allocated, (SIZE)))
+#define STAT_NODE_FREE(SIZE) (STAT_ADD(nodes_freed, 1), STAT_ADD(bytes_freed, (SIZE)))
+
+
+int te_stats_snapshot(te_stats *stats) {
+#ifdef TE_STATS
+    const int fields = sizeof(te_stats) / sizeof(unsigned long);
+    const stats_block *b;
+    int i;
+
+    memset(stats, 0, sizeof(te_stats));
+    for (b = &stats_fallback; b; b = (b == &stats_fallback) ? TE_LOAD(&stats_blocks) : b->next) {
+        const unsigned long *from = (const unsigned long*)&b->counts;
+        unsigned long *to = (unsigned long*)stats;
+        for (i = 0; i < fields; ++i) to[i] += TE_READ(&from[i]);
+    }
+    stats->nodes_live = stats->nodes_allocated - stats->nodes_freed;
+    stats->bytes_held = stats->bytes_allocated - stats->bytes_freed;
+    return 1;
+#else
+    memset(stats, 0, sizeof(te_stats));
+    return 0;
+#endif
+}
+
+
+/* Memory.
+ * Everything goes through the allocator set with te_set_allocator(), except
+ * the nodes of te_compile_with(), which remember their own allocator in a
+ * header. Freed nodes may be kept in per-thread pools, one free list for
+ * each node size, and handed out again by the next compile on that thread. */
+
+static void *default_alloc(void *context, size_t size) {(void)context; return malloc(size);}
+static void default_free(void *context, void *block) {(void)context; free(block);}
+
+static const te_allocator default_allocator = {default_alloc, default_free, 0};
+static const te_allocator *heap = &default_allocator;
+
+static void *mem_alloc(size_t size) {
+    return heap->alloc(heap->context, size);
+}
+
+static void *mem_calloc(size_t count, size_t size) {
+    void *p = mem_alloc(count * size);
+    if (p) memset(p, 0, count * size);
+    return p;
+}
+
+static void mem_free(void *p) {
+    if (p) heap->free(heap->context, p);
+}
+
+
+/* Sits in front of nodes from te_compile_with(). Its size keeps the node aligned. */
+typedef union te_owner {
+    const te_allocator *allocator;
+    double align;
+} te_owner;
+
+#define OWNER(n) ((te_owner*)((char*)(n) - sizeof(te_owner)))
+
+
+static int node_size(const int type) {
+    const int psize = sizeof(void*) * ARITY(type);
+    return (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
+}
+
+
+/* One size class per number of pointer slots, up to a closure of arity 7. */
+/* Larger variadic nodes aren't pooled. */
+#define POOL_CLASSES 9
+#define POOL_CLASS(size) (((size) - (int)(sizeof(te_expr) - sizeof(void*))) / (int)sizeof(void*))
+
+typedef struct pool_node {
+    struct pool_node *next;
+} pool_node;
+
+typedef struct node_pool {
+    pool_node *free[POOL_CLASSES];
+    int count[POOL_CLASSES];
+} node_pool;
+
+static int pool_limit = 0;
+
+#ifdef TE_THREAD_LOCAL
+static TE_THREAD_LOCAL node_pool pool;
+#endif
+
+static void *pool_alloc(int size) {
+#ifdef TE_THREAD_LOCAL
+    const int c = POOL_CLASS(size);
+    pool_node *p = c < POOL_CLASSES ? pool.free[c] : 0;
+    if (p) {
+        pool.free[c] = p->next;
+        --pool.count[c];
+        return p;
+    }
+#endif
+    return mem_alloc(size);
+}
+
+static void pool_free(void *n, int size) {
+#ifdef TE_THREAD_LOCAL
+    const int c = POOL_CLASS(size);
+    if (c < POOL_CLASSES && pool.count[c] < pool_limit) {
+        pool_node *p = n;
+        p->next = pool.free[c];
+        pool.free[c] = p;
+        ++pool.count[c];
+        return;
+    }
+#else
+    (void)size;
+#endif
+    mem_free(n);
+}
+
+
+void te_pool_drain(void) {
+#ifdef TE_THREAD_LOCAL
+    int c;
+    for (c = 0; c < POOL_CLASSES; ++c) {
+        while (pool.free[c]) {
+            pool_node *p = pool.free[c];
+            pool.free[c] = p->next;
+            mem_free(p);
+        }
+        pool.count[c] = 0;
+    }
+#endif
+}
+
+
+void te_set_node_pool(int max_nodes) {
+    pool_limit = max_nodes > 0 ? max_nodes : 0;
+    if (!pool_limit) te_pool_drain();
+}
+
+
+/* Memoization.
+ * Each thread keeps its own table of results, so lookups take no locks. The
+ * table is split into sets of MEMO_WAYS entries, so that a few keys hashing
+ * to the same set don't keep evicting each other; a new result goes to the
+ * front of its set and the oldest falls out. te_memo_clear() bumps a global
+ * epoch, and a thread whose table is from an older epoch empties it before
+ * its next lookup. */
+
+typedef struct memo_entry {
+    const void *function;
+    void *context;
+    double args[7];
+    double result;
+} memo_entry;
+
+typedef struct memo_table {
+    unsigned long epoch;
+    int size;
+    int shift;              /* Turns a hash into a set: 64 - log2(size / MEMO_WAYS). */
+    memo_entry entries[1];
+} memo_table;
+
+#define MEMO_MIX ((uint64_t)0x9E3779B97F4A7C15)
+#define MEMO_WAYS 4
+
+#if defined(__GNUC__)
+#define MEMO_EPOCH() __atomic_load_n(&memo_epoch, __ATOMIC_ACQUIRE)
+#define MEMO_BUMP() __atomic_add_fetch(&memo_epoch, 1, __ATOMIC_RELEASE)
+#else
+#define MEMO_EPOCH() (memo_epoch)
+#define MEMO_BUMP() (++memo_epoch)
+#endif
+
+static int memo_size = 1024;
+static unsigned long memo_epoch = 0;
+
+#ifdef TE_THREAD_LOCAL
+static TE_THREAD_LOCAL memo_table *memo = 0;
+static TE_THREAD_LOCAL unsigned long memo_hit_count = 0, memo_miss_count = 0;
+
+/* The calling thread's table, emptied or replaced if it's out of date. */
+static memo_table *memo_current(void) {
+    const unsigned long epoch = MEMO_EPOCH();
+    memo_table *t = memo;
+    if (t && t->size == memo_size) {
+        if (t->epoch != epoch) {
+            memset(t->entries, 0, sizeof(memo_entry) * t->size);
+            t->epoch = epoch;
+        }
+        return t;
+    }
+    mem_free(t);
+    memo = 0;
+    if (!memo_size) return 0;
+
+    t = mem_calloc(1, sizeof(memo_table) + sizeof(memo_entry) * (memo_size - 1));
+    if (!t) return 0;
+    t->epoch = epoch;
+    t->size = memo_size;
+    for (t->shift = 64; (1 << (64 - t->shift)) < memo_size / MEMO_WAYS; --t->shift);
+    memo = t;
+    return t;
+}
+#endif
+
+
+static uint64_t memo_hash(const void *function, const void *context, const double *a, int arity) {
+    uint64_t h = (uint64_t)(uintptr_t)function * MEMO_MIX ^ (uint64_t)(uintptr_t)context;
+    int i;
+    for (i = 0; i < arity; ++i) {
+        uint64_t bits;
+        memcpy(&bits, &a[i], sizeof(bits));
+        h = (h ^ bits) * MEMO_MIX;
+    }
+    return (h ^ (h >> 32)) * MEMO_MIX;
+}
+
+
+void te_set_memo_size(int entries) {
+    int size = 16;
+    while (size < entries && size < (1 << 24)) size <<= 1;
+    memo_size = entries > 0 ? size : 0;
+    if (!memo_size) te_memo_clear();
+}
+
+
+void te_memo_clear(void) {
+    MEMO_BUMP();
+#ifdef TE_THREAD_LOCAL
+    mem_free(memo);
+    memo = 0;
+#endif
+}
+
+
+void te_memo_counts(unsigned long *hits, unsigned long *misses) {
+#ifdef TE_THREAD_LOCAL
+    *hits = memo_hit_count;
+    *misses = memo_miss_count;
+#else
+    *hits = *misses = 0;
+#endif
+}
+
+
+void te_set_allocator(const te_allocator *allocator) {
+    te_pool_drain();
+    te_memo_clear();
+    heap = allocator ? allocator : &default_allocator;
+}
+
+
+/* Allocates a node of size bytes, from owner if it's set. */
+static te_expr *alloc_node(const te_allocator *owner, int size) {
+    if (owner) {
+        te_owner *h = owner->alloc(owner->context, sizeof(te_owner) + size);
+        if (!h) return 0;
+        h->allocator = owner;
+        return (te_expr*)(h + 1);
+    }
+    return pool_alloc(size);
+}
+
+/* Gives back the memory of a node of size bytes, without touching its children. */
+static void release_node(te_expr *n, int size) {
+    if (n->type & TE_FLAG_OWNED) {
+        const te_allocator *a = OWNER(n)->allocator;
+        a->free(a->context, OWNER(n));
+    } else {
+        pool_free(n, size);
+    }
+}
+
+
+/* Allocates a node of the given size; the type must already carry its arity. */
+/* The header is cleared with a fixed-size memset and the slots one at a time, */
+/* as a variable-size memset of a small node is slower than either. */
+static te_expr *make_node(const te_allocator *owner, const int type, const int size, const te_expr *parameters[]) {
+    const int header = sizeof(te_expr) - sizeof(void*);
+    const int slots = (size - header) / (int)sizeof(void*);
+    const int copied = parameters ? ARITY(type) : 0;
+    int i;
+    te_expr *ret = alloc_node(owner, size);
+    if (!ret) return 0;
+    STAT_NODE_ALLOC(size);
+    memset(ret, 0, header);
+    for (i = 0; i < copied; ++i) ret->parameters[i] = (void*)parameters[i];
+    for (; i < slots; ++i) ret->parameters[i] = 0;
+    ret->type = type | (owner ? TE_FLAG_OWNED : 0);
     ret->bound = 0;
     return ret;
 }
 
 
+static te_expr *new_expr(const te_allocator *owner, int type, const te_expr *parameters[]) {
+    type |= NARY(DECLARED_ARITY(type));
+    return make_node(owner, type, node_size(type), parameters);
+}
+
+
+/* Fails the parse for want of memory. */
+static void out_of_memory(state *s) {
+    if (!s->fail) s->fail = TE_ERROR_MEMORY;
+    s->limits.max_length = -1;
+    s->type = TOK_ERROR;
+}
+
+
+static void free_node(te_expr *n);
+
+/* Allocates a node for the parser, failing the parse once it goes over its limits. */
+/* The node is still allocated, so a limit may be overshot by a node or two. */
+/* If it can't be allocated, the parameters are freed and 0 is returned. */
+static te_expr *new_node(state *s, const int type, const te_expr *parameters[]) {
+    const int full = type | NARY(DECLARED_ARITY(type));
+    const int size = node_size(full);
+    te_expr *ret;
+    s->bytes += size;
+    if (++s->nodes > s->limits.max_nodes || s->bytes > s->limits.max_bytes) {
+        if (!s->fail) s->fail = s->nodes > s->limits.max_nodes ? TE_ERROR_NODES : TE_ERROR_BYTES;
+        s->limits.max_length = -1;
+        s->type = TOK_ERROR;
+    }
+    ret = make_node(s->owner, full, size, parameters);
+    if (!ret) {
+        int i;
+        if (parameters) for (i = 0; i < ARITY(full); ++i) free_node((te_expr*)parameters[i]);
+        out_of_memory(s);
+    }
+    return ret;
+}
+
+
 void te_free_parameters(te_expr *n) {
+    int i;
     if (!n) return;
     switch (TYPE_MASK(n->type)) {
-        case TE_FUNCTION7: case TE_CLOSURE7: te_free(n->parameters[6]);
-        case TE_FUNCTION6: case TE_CLOSURE6: te_free(n->parameters[5]);
-        case TE_FUNCTION5: case TE_CLOSURE5: te_free(n->parameters[4]);
-        case TE_FUNCTION4: case TE_CLOSURE4: te_free(n->parameters[3]);
-        case TE_FUNCTION3: case TE_CLOSURE3: te_free(n->parameters[2]);
-        case TE_FUNCTION2: case TE_CLOSURE2: te_free(n->parameters[1]);
-        case TE_FUNCTION1: case TE_CLOSURE1: te_free(n->parameters[0]);
+        case TE_FUNCTION0: /* Variadic builtins; other functions of no arguments have none to free. */
+            for (i = ARITY(n->type) - 1; i >= 0; --i) free_node(n->parameters[i]);
+            break;
+        case TE_FUNCTION7: case TE_CLOSURE7: free_node(n->parameters[6]);
+        case TE_FUNCTION6: case TE_CLOSURE6: free_node(n->parameters[5]);
+        case TE_FUNCTION5: case TE_CLOSURE5: free_node(n->parameters[4]);
+        case TE_FUNCTION4: case TE_CLOSURE4: free_node(n->parameters[3]);
+        case TE_FUNCTION3: case TE_CLOSURE3: free_node(n->parameters[2]);
+        case TE_FUNCTION2: case TE_CLOSURE2: free_node(n->parameters[1]);
+        case TE_FUNCTION1: case TE_CLOSURE1: free_node(n->parameters[0]);
     }
 }
 
 
-void te_free(te_expr *n) {
+/* Evaluation state kept in front of the root node of a tiered expression. */
+/* Its size is a multiple of the pointer size, which keeps the node aligned. */
+typedef struct te_tier {
+    unsigned long evaluations;
+    unsigned long threshold;
+    unsigned long promoted_at;
+    struct te_code *program;
+} te_tier;
+
+#define TIER(n) ((te_tier*)((char*)(n) - sizeof(te_tier)))
+
+
+/* State of a call of prev, delta, ema or sma. One te_eval is one step. */
+typedef struct series {
+    const te_allocator *owner;  /* Where the state came from, or 0 for the global allocator. */
+    unsigned long steps;        /* Since the last reset; sma stops counting at its window. */
+    double last;                /* The previous sample, or the average so far of ema. */
+    double sum;                 /* Of the finite samples in the window of sma. */
+    int window, next;           /* Length of the window of sma, and where the next sample goes. */
+    int nans, infs, minus_infs; /* Samples in the window of sma left out of the sum. */
+    double values[1];           /* The window of sma. */
+} series;
+
+/* The longest window of sma, which takes 8 bytes per sample. */
+#define SERIES_MAX_WINDOW (1 << 20)
+
+static void series_free(void *context) {
+    series *st = context;
+    if (!st) return;
+    if (st->owner) st->owner->free(st->owner->context, st);
+    else mem_free(st);
+}
+
+static void series_clear(series *st) {
+    int i;
+    st->steps = 0;
+    st->last = st->sum = 0;
+    st->next = 0;
+    st->nans = st->infs = st->minus_infs = 0;
+    for (i = 0; i < st->window; ++i) st->values[i] = 0;
+}
+
+
+static void release_shared(te_expr *n);
+
+static void free_node(te_expr *n) {
     if (!n) return;
+    if (n->type & TE_FLAG_SHARED) {
+        release_shared(n);
+        return;
+    }
     te_free_parameters(n);
-    free(n);
+    if (n->type & TE_FLAG_STATEFUL) series_free(n->parameters[ARITY(n->type)]);
+    STAT_NODE_FREE(node_size(n->type));
+    if (n->type & TE_FLAG_TIERED) {
+        mem_free(TIER(n)->program);
+        mem_free(TIER(n));
+    } else {
+        release_node(n, node_size(n->type));
+    }
+}
+
+void te_free(te_expr *n) {
+    if (!n) return;
+    STAT_ADD(frees, 1);
+    free_node(n);
+}
+
+
+void te_reset(te_expr *n) {
+    const int arity = n ? ARITY(n->type) : 0;
+    int i;
+    /* Shared nodes are pure, and so is everything under them. */
+    if (!n || (n->type & TE_FLAG_SHARED)) return;
+    if (n->type & TE_FLAG_STATEFUL) series_clear(n->parameters[arity]);
+    for (i = 0; i < arity; ++i) te_reset(n->parameters[i]);
 }
 
 
@@ -149,35 +699,151 @@ static double ncr(double n, double r) {
 }
 static double npr(double n, double r) {return ncr(n, r) * fac(r);}
 
+
+/* One step of a running hypot: the result is scale * sqrt(ssq). Scaling by the */
+/* largest magnitude so far keeps the squares from overflowing. */
+static void hypot_step(double *scale, double *ssq, double v) {
+    const double a = fabs(v);
+    if (a > *scale) {
+        const double t = *scale / a;
+        *ssq = 1 + *ssq * t * t;
+        *scale = a;
+    } else if (a > 0 && a < INFINITY) {
+        const double t = a / *scale;
+        *ssq += t * t;
+    } else if (a != a) {
+        *ssq = a;
+    }
+}
+
+static double hypot_result(double scale, double ssq) {
+    return scale == INFINITY ? scale : scale * sqrt(ssq);
+}
+
+/* The loops of the variadic builtins, for count arguments read with ARG(i). */
+/* r starts as the first argument. Any NaN argument makes the result NaN. */
+#define NARY_LOOPS(ARG) \
+    case OP_MIN: for (i = 1; i < count; ++i) {const double v = ARG(i); if (v < r || v != v) r = v;} return r; \
+    case OP_MAX: for (i = 1; i < count; ++i) {const double v = ARG(i); if (v > r || v != v) r = v;} return r; \
+    case OP_SUM: for (i = 1; i < count; ++i) r += ARG(i); return r; \
+    case OP_PROD: for (i = 1; i < count; ++i) r *= ARG(i); return r; \
+    case OP_AVG: for (i = 1; i < count; ++i) r += ARG(i); return r / count; \
+    case OP_HYPOT: \
+        hypot_step(&scale, &ssq, r); \
+        for (i = 1; i < count; ++i) hypot_step(&scale, &ssq, ARG(i)); \
+        return hypot_result(scale, ssq);
+
+/* Computes the variadic builtin op over a[0] .. a[count-1]. */
+static double nary_values(int op, const double *a, int count) {
+    double r = a[0], scale = 0, ssq = 0;
+    int i;
+#define ARG(i) a[i]
+    switch (op) {
+        NARY_LOOPS(ARG)
+        default: return NAN;
+    }
+#undef ARG
+}
+
+static double minimum(const double *a, int count) {return nary_values(OP_MIN, a, count);}
+static double maximum(const double *a, int count) {return nary_values(OP_MAX, a, count);}
+static double sum(const double *a, int count) {return nary_values(OP_SUM, a, count);}
+static double product(const double *a, int count) {return nary_values(OP_PROD, a, count);}
+static double average(const double *a, int count) {return nary_values(OP_AVG, a, count);}
+static double hypotenuse(const double *a, int count) {return nary_values(OP_HYPOT, a, count);}
+
+/* The time-series builtins. The first step of prev and delta has no previous */
+/* sample, so it gives NaN. sma averages the samples so far until its window fills. */
+static double series_prev(void *context, double x) {
+    series *st = context;
+    const double r = st->steps++ ? st->last : NAN;
+    st->last = x;
+    return r;
+}
+
+static double series_delta(void *context, double x) {
+    series *st = context;
+    const double r = st->steps++ ? x - st->last : NAN;
+    st->last = x;
+    return r;
+}
+
+static double series_ema(void *context, double x, double alpha) {
+    series *st = context;
+    st->last = st->steps++ ? st->last + alpha * (x - st->last) : x;
+    return st->last;
+}
+
+/* Counts a sample of sma entering (by 1) or leaving (by -1) the window, and */
+/* returns whether it's finite and belongs in the sum. */
+static int series_count(series *st, double x, int by) {
+    if (x != x) st->nans += by;
+    else if (x - x == 0) return 1;
+    else if (x > 0) st->infs += by;
+    else st->minus_infs += by;
+    return 0;
+}
+
+static double series_sma(void *context, double x, double window) {
+    series *st = context;
+    (void)window;
+    if (st->steps < (unsigned long)st->window) ++st->steps;
+    else if (series_count(st, st->values[st->next], -1)) st->sum -= st->values[st->next];
+    st->values[st->next] = x;
+    if (series_count(st, x, 1)) st->sum += x;
+    if (++st->next == st->window) {
+        /* Summing the full window afresh once per pass keeps rounding errors from staying. */
+        int i;
+        st->sum = 0;
+        for (i = 0; i < st->window; ++i) if (st->values[i] - st->values[i] == 0) st->sum += st->values[i];
+        st->next = 0;
+    }
+    /* NaNs and infinities stay out of the sum, so the mean recovers as soon as they leave. */
+    if (st->nans || (st->infs && st->minus_infs)) return NAN;
+    if (st->infs) return INFINITY;
+    if (st->minus_infs) return -INFINITY;
+    return st->sum / st->steps;
+}
+
 static const te_variable functions[] = {
     /* must be in alphabetical order */
-    {"abs", fabs,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"abs", fabs,     TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_ABS), 0},
     {"acos", acos,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"asin", asin,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"atan", atan,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"atan2", atan2,  TE_FUNCTION2 | TE_FLAG_PURE, 0},
-    {"ceil", ceil,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"cos", cos,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"avg", average,  TE_FUNCTION0 | TE_FLAG_PURE | OP(OP_AVG), 0},
+    {"ceil", ceil,    TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_CEIL), 0},
+    {"cos", cos,      TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_COS), 0},
     {"cosh", cosh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"delta", series_delta, TE_CLOSURE1 | TE_FLAG_STATEFUL, 0},
     {"e", e,          TE_FUNCTION0 | TE_FLAG_PURE, 0},
-    {"exp", exp,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"ema", series_ema, TE_CLOSURE2 | TE_FLAG_STATEFUL, 0},
+    {"exp", exp,      TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_EXP), 0},
     {"fac", fac,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"floor", floor,  TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"ln", log,       TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"floor", floor,  TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_FLOOR), 0},
+    {"hypot", hypotenuse, TE_FUNCTION0 | TE_FLAG_PURE | OP(OP_HYPOT), 0},
+    {"ln", log,       TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_LN), 0},
 #ifdef TE_NAT_LOG
-    {"log", log,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"log", log,      TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_LN), 0},
 #else
-    {"log", log10,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"log", log10,    TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_LOG10), 0},
 #endif
-    {"log10", log10,  TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"log10", log10,  TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_LOG10), 0},
+    {"max", maximum,  TE_FUNCTION0 | TE_FLAG_PURE | OP(OP_MAX), 0},
+    {"min", minimum,  TE_FUNCTION0 | TE_FLAG_PURE | OP(OP_MIN), 0},
     {"ncr", ncr,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
     {"npr", npr,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
     {"pi", pi,        TE_FUNCTION0 | TE_FLAG_PURE, 0},
-    {"pow", pow,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
-    {"sin", sin,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"pow", pow,      TE_FUNCTION2 | TE_FLAG_PURE | OP(OP_POW), 0},
+    {"prev", series_prev, TE_CLOSURE1 | TE_FLAG_STATEFUL, 0},
+    {"prod", product, TE_FUNCTION0 | TE_FLAG_PURE | OP(OP_PROD), 0},
+    {"sin", sin,      TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_SIN), 0},
     {"sinh", sinh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"sqrt", sqrt,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"tan", tan,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"sma", series_sma, TE_CLOSURE2 | TE_FLAG_STATEFUL, 0},
+    {"sqrt", sqrt,    TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_SQRT), 0},
+    {"sum", sum,      TE_FUNCTION0 | TE_FLAG_PURE | OP(OP_SUM), 0},
+    {"tan", tan,      TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_TAN), 0},
     {"tanh", tanh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {0, 0, 0, 0}
 };
@@ -228,8 +894,22 @@ static double comma(double a, double b) {(void)a; return b;}
 
 void next_token(state *s) {
     s->type = TOK_NULL;
+#ifdef TE_PROFILE
+    s->last = s->next;
+#endif
 
     do {
+#ifdef TE_PROFILE
+        s->token = s->next;
+#endif
+
+        /* Hitting any limit drops max_length, so no more tokens are read. */
+        if (s->next - s->start > s->limits.max_length) {
+            if (!s->fail) s->fail = TE_ERROR_LENGTH;
+            s->limits.max_length = -1;
+            s->type = TOK_ERROR;
+            return;
+        }
 
         if (!*s->next){
             s->type = TOK_END;
@@ -258,6 +938,7 @@ void next_token(state *s) {
                         case TE_VARIABLE:
                             s->type = TOK_VARIABLE;
                             s->bound = var->address;
+                            s->element = ELEMENT(var->type);
                             break;
 
                         case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
@@ -275,12 +956,12 @@ void next_token(state *s) {
             } else {
                 /* Look for an operator or special character. */
                 switch (s->next++[0]) {
-                    case '+': s->type = TOK_INFIX; s->function = add; break;
-                    case '-': s->type = TOK_INFIX; s->function = sub; break;
-                    case '*': s->type = TOK_INFIX; s->function = mul; break;
-                    case '/': s->type = TOK_INFIX; s->function = divide; break;
-                    case '^': s->type = TOK_INFIX; s->function = pow; break;
-                    case '%': s->type = TOK_INFIX; s->function = fmod; break;
+                    case '+': s->type = TOK_INFIX; s->function = add; s->op = OP_ADD; break;
+                    case '-': s->type = TOK_INFIX; s->function = sub; s->op = OP_SUB; break;
+                    case '*': s->type = TOK_INFIX; s->function = mul; s->op = OP_MUL; break;
+                    case '/': s->type = TOK_INFIX; s->function = divide; s->op = OP_DIV; break;
+                    case '^': s->type = TOK_INFIX; s->function = pow; s->op = OP_POW; break;
+                    case '%': s->type = TOK_INFIX; s->function = fmod; s->op = OP_MOD; break;
                     case '(': s->type = TOK_OPEN; break;
                     case ')': s->type = TOK_CLOSE; break;
                     case ',': s->type = TOK_SEP; break;
@@ -293,31 +974,177 @@ void next_token(state *s) {
 }
 
 
+/* Records that n was parsed from the text between from and the last token read. */
+/* Spans are only kept in profiling builds. */
+static te_expr *span(te_expr *n, const state *s, const char *from) {
+#ifdef TE_PROFILE
+    if (!n) return 0;
+    n->profile.start = from - s->start;
+    n->profile.end = s->last - s->start;
+#else
+    (void)s; (void)from;
+#endif
+    return n;
+}
+
+#ifdef TE_PROFILE
+#define TOKEN_START(s) ((s)->token)
+#define NODE_START(s, n) ((s)->start + (n)->profile.start)
+#else
+#define TOKEN_START(s) ((s)->next)
+#define NODE_START(s, n) ((s)->next)
+#endif
+
+
 static te_expr *list(state *s);
 static te_expr *expr(state *s);
 static te_expr *power(state *s);
+static te_expr *optimize(te_expr *n, const te_allocator *owner);
+
+/* Parses the arguments of a variadic builtin into one node. Arguments that are */
+/* calls of the same builtin have their arguments spliced in, except for avg, */
+/* whose result would change. */
+static te_expr *variadic(state *s) {
+    const int type = s->type;
+    const void *function = s->function;
+    te_expr *local[16], **args = local, *ret;
+    int count = 0, capacity = 16, i;
+
+    next_token(s);
+    if (s->type != TOK_OPEN) {
+        s->type = TOK_ERROR;
+    } else {
+        do {
+            te_expr *arg;
+            int add;
+            next_token(s);
+            arg = expr(s);
+            add = (arg && arg->function == function && OPCODE(arg->type) == OPCODE(type)
+                    && OPCODE(type) != OP_AVG) ? ARITY(arg->type) : 1;
+
+            if (count + add > NARY_MAX) {
+                free_node(arg);
+                s->type = TOK_ERROR;
+                break;
+            }
+            if (count + add > capacity) {
+                te_expr **grown;
+                while (capacity < count + add) capacity *= 2;
+                grown = mem_alloc(sizeof(te_expr*) * capacity);
+                if (!grown) {
+                    free_node(arg);
+                    out_of_memory(s);
+                    break;
+                }
+                memcpy(grown, args, sizeof(te_expr*) * count);
+                if (args != local) mem_free(args);
+                args = grown;
+            }
+
+            if (add == 1) {
+                args[count++] = arg;
+            } else {
+                /* Only the nested node itself goes: its arguments are now ours. */
+                for (i = 0; i < add; ++i) args[count++] = arg->parameters[i];
+                STAT_NODE_FREE(node_size(arg->type));
+                release_node(arg, node_size(arg->type));
+            }
+        } while (s->type == TOK_SEP);
+
+        if (s->type == TOK_CLOSE) next_token(s);
+        else s->type = TOK_ERROR;
+    }
+
+    if (count) {
+        ret = new_node(s, type | NARY(count), (const te_expr**)args);
+        if (ret) ret->function = function;
+    } else {
+        ret = new_node(s, 0, 0);
+        if (ret) ret->value = NAN;
+        s->type = TOK_ERROR;
+    }
+    if (args != local) mem_free(args);
+    return ret;
+}
+
+/* Gives a call of a time-series builtin its state. The window of sma sizes the */
+/* state, so it's folded here and has to come out a whole number. */
+static void series_attach(state *s, te_expr *n) {
+    const int arity = ARITY(n->type);
+    int window = 1;
+    size_t size;
+    series *st;
+
+    /* The arguments may be missing nodes, and the parse has failed anyway. */
+    if (s->type == TOK_ERROR) return;
+
+    if (n->function == series_sma) {
+        te_expr *w = n->parameters[1] ? (n->parameters[1] = optimize(n->parameters[1], s->owner)) : 0;
+        if (!w || TYPE_MASK(w->type) != TE_CONSTANT || !(w->value >= 1 && w->value <= SERIES_MAX_WINDOW)
+                || w->value != floor(w->value)) {
+            s->type = TOK_ERROR;
+            return;
+        }
+        window = (int)w->value;
+    }
+
+    size = sizeof(series) + sizeof(double) * (window - 1);
+    s->bytes += size;
+    if (s->bytes > s->limits.max_bytes) {
+        if (!s->fail) s->fail = TE_ERROR_BYTES;
+        s->limits.max_length = -1;
+        s->type = TOK_ERROR;
+        return;
+    }
+
+    st = s->owner ? s->owner->alloc(s->owner->context, size) : mem_alloc(size);
+    if (!st) {
+        out_of_memory(s);
+        return;
+    }
+    st->owner = s->owner;
+    st->window = window;
+    series_clear(st);
+    n->parameters[arity] = st;
+}
 
 static te_expr *base(state *s) {
     /* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> | <function-X> "(" <expr> {"," <expr>} ")" | "(" <list> ")" */
+    const char *from = TOKEN_START(s);
     te_expr *ret;
     int arity;
 
+    /* Every level of parentheses or function calls comes through here. */
+    if (++s->depth > s->limits.max_depth) {
+        if (!s->fail) s->fail = TE_ERROR_DEPTH;
+        s->limits.max_length = -1;
+        s->type = TOK_ERROR;
+    }
+
     switch (TYPE_MASK(s->type)) {
         case TOK_NUMBER:
-            ret = new_expr(TE_CONSTANT, 0);
+            ret = new_node(s, TE_CONSTANT | OP(OP_CONSTANT), 0);
+            if (!ret) break;
             ret->value = s->value;
             next_token(s);
             break;
 
         case TOK_VARIABLE:
-            ret = new_expr(TE_VARIABLE, 0);
+            /* Variables that aren't doubles are converted by OP_LOAD. */
+            ret = new_node(s, s->element ? TE_VARIABLE | s->element | OP(OP_LOAD) : TE_VARIABLE | OP(OP_VARIABLE), 0);
+            if (!ret) break;
             ret->bound = s->bound;
             next_token(s);
             break;
 
         case TE_FUNCTION0:
         case TE_CLOSURE0:
-            ret = new_expr(s->type, 0);
+            if (IS_NARY(OPCODE(s->type))) {
+                ret = variadic(s);
+                break;
+            }
+            ret = new_node(s, s->type, 0);
+            if (!ret) break;
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[0] = s->context;
             next_token(s);
@@ -333,20 +1160,23 @@ static te_expr *base(state *s) {
 
         case TE_FUNCTION1:
         case TE_CLOSURE1:
-            ret = new_expr(s->type, 0);
+            ret = new_node(s, s->type, 0);
+            if (!ret) break;
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[1] = s->context;
             next_token(s);
             ret->parameters[0] = power(s);
+            if (ret->type & TE_FLAG_STATEFUL) series_attach(s, ret);
             break;
 
         case TE_FUNCTION2: case TE_FUNCTION3: case TE_FUNCTION4:
         case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
         case TE_CLOSURE2: case TE_CLOSURE3: case TE_CLOSURE4:
         case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
-            arity = ARITY(s->type);
+            arity = DECLARED_ARITY(s->type);
 
-            ret = new_expr(s->type, 0);
+            ret = new_node(s, s->type, 0);
+            if (!ret) break;
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[arity] = s->context;
             next_token(s);
@@ -369,6 +1199,7 @@ static te_expr *base(state *s) {
                 }
             }
 
+            if (ret->type & TE_FLAG_STATEFUL) series_attach(s, ret);
             break;
 
         case TOK_OPEN:
@@ -382,21 +1213,23 @@ static te_expr *base(state *s) {
             break;
 
         default:
-            ret = new_expr(0, 0);
+            ret = new_node(s, 0, 0);
             s->type = TOK_ERROR;
-            ret->value = NAN;
+            if (ret) ret->value = NAN;
             break;
     }
 
-    return ret;
+    --s->depth;
+    return span(ret, s, from);
 }
 
 
 static te_expr *power(state *s) {
     /* <power>     =    {("-" | "+")} <base> */
+    const char *from = TOKEN_START(s);
     int sign = 1;
-    while (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
-        if (s->function == sub) sign = -sign;
+    while (s->type == TOK_INFIX && (s->op == OP_ADD || s->op == OP_SUB)) {
+        if (s->op == OP_SUB) sign = -sign;
         next_token(s);
     }
 
@@ -405,8 +1238,9 @@ static te_expr *power(state *s) {
     if (sign == 1) {
         ret = base(s);
     } else {
-        ret = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE, base(s));
-        ret->function = negate;
+        ret = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_NEG), base(s));
+        if (ret) ret->function = negate;
+        span(ret, s, from);
     }
 
     return ret;
@@ -415,38 +1249,49 @@ static te_expr *power(state *s) {
 #ifdef TE_POW_FROM_RIGHT
 static te_expr *factor(state *s) {
     /* <factor>    =    <power> {"^" <power>} */
+    const char *from = TOKEN_START(s);
     te_expr *ret = power(s);
 
     int neg = 0;
     te_expr *insertion = 0;
 
-    if (ret->type == (TE_FUNCTION1 | TE_FLAG_PURE) && ret->function == negate) {
+    if (ret && OPCODE(ret->type) == OP_NEG) {
         te_expr *se = ret->parameters[0];
-        free(ret);
+        STAT_NODE_FREE(node_size(ret->type));
+        release_node(ret, node_size(ret->type));
         ret = se;
         neg = 1;
     }
 
-    while (s->type == TOK_INFIX && (s->function == pow)) {
+    while (s->type == TOK_INFIX && s->op == OP_POW) {
         te_fun2 t = s->function;
         next_token(s);
 
         if (insertion) {
             /* Make exponentiation go right-to-left. */
-            te_expr *insert = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, insertion->parameters[1], power(s));
+            const char *left = NODE_START(s, (te_expr*)insertion->parameters[1]);
+            te_expr *insert = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE | OP(OP_POW), insertion->parameters[1], power(s));
+            if (!insert) {
+                /* Its left side went with it. */
+                insertion->parameters[1] = 0;
+                break;
+            }
             insert->function = t;
+            span(insert, s, left);
             insertion->parameters[1] = insert;
             insertion = insert;
         } else {
-            ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, power(s));
+            ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE | OP(OP_POW), ret, power(s));
+            if (!ret) break;
             ret->function = t;
-            insertion = ret;
+            insertion = span(ret, s, from);
         }
     }
 
     if (neg) {
-        ret = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE, ret);
-        ret->function = negate;
+        ret = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE | OP(OP_NEG), ret);
+        if (ret) ret->function = negate;
+        span(ret, s, from);
     }
 
     return ret;
@@ -454,13 +1299,16 @@ static te_expr *factor(state *s) {
 #else
 static te_expr *factor(state *s) {
     /* <factor>    =    <power> {"^" <power>} */
+    const char *from = TOKEN_START(s);
     te_expr *ret = power(s);
 
-    while (s->type == TOK_INFIX && (s->function == pow)) {
+    while (s->type == TOK_INFIX && s->op == OP_POW) {
         te_fun2 t = s->function;
         next_token(s);
-        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, power(s));
+        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE | OP(OP_POW), ret, power(s));
+        if (!ret) break;
         ret->function = t;
+        span(ret, s, from);
     }
 
     return ret;
@@ -471,13 +1319,17 @@ static te_expr *factor(state *s) {
 
 static te_expr *term(state *s) {
     /* <term>      =    <factor> {("*" | "/" | "%") <factor>} */
+    const char *from = TOKEN_START(s);
     te_expr *ret = factor(s);
 
-    while (s->type == TOK_INFIX && (s->function == mul || s->function == divide || s->function == fmod)) {
+    while (s->type == TOK_INFIX && (s->op == OP_MUL || s->op == OP_DIV || s->op == OP_MOD)) {
         te_fun2 t = s->function;
+        const int op = s->op;
         next_token(s);
-        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, factor(s));
+        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE | OP(op), ret, factor(s));
+        if (!ret) break;
         ret->function = t;
+        span(ret, s, from);
     }
 
     return ret;
@@ -486,13 +1338,17 @@ static te_expr *term(state *s) {
 
 static te_expr *expr(state *s) {
     /* <expr>      =    <term> {("+" | "-") <term>} */
+    const char *from = TOKEN_START(s);
     te_expr *ret = term(s);
 
-    while (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
+    while (s->type == TOK_INFIX && (s->op == OP_ADD || s->op == OP_SUB)) {
         te_fun2 t = s->function;
+        const int op = s->op;
         next_token(s);
-        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, term(s));
+        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE | OP(op), ret, term(s));
+        if (!ret) break;
         ret->function = t;
+        span(ret, s, from);
     }
 
     return ret;
@@ -501,12 +1357,15 @@ static te_expr *expr(state *s) {
 
 static te_expr *list(state *s) {
     /* <list>      =    <expr> {"," <expr>} */
+    const char *from = TOKEN_START(s);
     te_expr *ret = expr(s);
 
     while (s->type == TOK_SEP) {
         next_token(s);
-        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, expr(s));
+        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE | OP(OP_COMMA), ret, expr(s));
+        if (!ret) break;
         ret->function = comma;
+        span(ret, s, from);
     }
 
     return ret;
@@ -514,13 +1373,153 @@ static te_expr *list(state *s) {
 
 
 #define TE_FUN(...) ((double(*)(__VA_ARGS__))n->function)
-#define M(e) te_eval(n->parameters[e])
 
+static double eval(const te_expr *n);
 
-double te_eval(const te_expr *n) {
-    if (!n) return NAN;
+#ifdef TE_PROFILE
+/* Every node goes through eval_profiled, so operands are counted too. */
+static double eval_profiled(const te_expr *n);
+#define M(e) eval_profiled(n->parameters[e])
+#else
+#define M(e) eval_operand(n->parameters[e])
+#endif
 
-    switch(TYPE_MASK(n->type)) {
+
+/* Calls a vector function of node n on rows of arguments. */
+static void call_vector(const te_expr *n, const double *const *args, int count, double *out) {
+    if (IS_CLOSURE(n->type)) {
+        ((te_vecclosure)n->function)(n->parameters[ARITY(n->type)], args, count, out);
+    } else {
+        ((te_vecfun)n->function)(args, count, out);
+    }
+}
+
+
+/* Calls the function of node n with the arguments in a, bypassing the memo cache. */
+static double call_direct(const te_expr *n, const double *a) {
+    if (n->type & TE_FLAG_VECTOR) {
+        const double *args[7];
+        double ret;
+        int i;
+        for (i = 0; i < ARITY(n->type); ++i) args[i] = a + i;
+        call_vector(n, args, 1, &ret);
+        return ret;
+    }
+    if (IS_CLOSURE(n->type)) {
+        void *c = n->parameters[ARITY(n->type)];
+        switch(ARITY(n->type)) {
+            case 0: return TE_FUN(void*)(c);
+            case 1: return TE_FUN(void*, double)(c, a[0]);
+            case 2: return TE_FUN(void*, double, double)(c, a[0], a[1]);
+            case 3: return TE_FUN(void*, double, double, double)(c, a[0], a[1], a[2]);
+            case 4: return TE_FUN(void*, double, double, double, double)(c, a[0], a[1], a[2], a[3]);
+            case 5: return TE_FUN(void*, double, double, double, double, double)(c, a[0], a[1], a[2], a[3], a[4]);
+            case 6: return TE_FUN(void*, double, double, double, double, double, double)(c, a[0], a[1], a[2], a[3], a[4], a[5]);
+            case 7: return TE_FUN(void*, double, double, double, double, double, double, double)(c, a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+            default: return NAN;
+        }
+    }
+    switch(ARITY(n->type)) {
+        case 0: return TE_FUN(void)();
+        case 1: return TE_FUN(double)(a[0]);
+        case 2: return TE_FUN(double, double)(a[0], a[1]);
+        case 3: return TE_FUN(double, double, double)(a[0], a[1], a[2]);
+        case 4: return TE_FUN(double, double, double, double)(a[0], a[1], a[2], a[3]);
+        case 5: return TE_FUN(double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4]);
+        case 6: return TE_FUN(double, double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4], a[5]);
+        case 7: return TE_FUN(double, double, double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        default: return NAN;
+    }
+}
+
+
+/* Calls a TE_FLAG_MEMO function through the calling thread's cache. */
+static double call_memoized(const te_expr *n, const double *a) {
+#ifdef TE_THREAD_LOCAL
+    const int arity = ARITY(n->type);
+    void *c = IS_CLOSURE(n->type) ? n->parameters[arity] : 0;
+    memo_table *t = memo_current();
+    memo_entry *set, *e;
+    unsigned long epoch;
+    double r;
+    int i;
+
+    if (!t) return call_direct(n, a);
+    set = &t->entries[(memo_hash(n->function, c, a, arity) >> t->shift) * MEMO_WAYS];
+    for (e = set; e < set + MEMO_WAYS; ++e) {
+        if (e->function == n->function && e->context == c && !memcmp(e->args, a, sizeof(double) * arity)) {
+            ++memo_hit_count;
+            STAT_ADD(memo_hits, 1);
+            return e->result;
+        }
+    }
+    ++memo_miss_count;
+    STAT_ADD(memo_misses, 1);
+
+    epoch = t->epoch;
+    r = call_direct(n, a);
+    /* The function may have cleared or resized the cache while it ran. */
+    if (memo == t && t->epoch == epoch && MEMO_EPOCH() == epoch) {
+        memmove(set + 1, set, sizeof(memo_entry) * (MEMO_WAYS - 1));
+        e = set;
+        e->function = n->function;
+        e->context = c;
+        for (i = 0; i < arity; ++i) e->args[i] = a[i];
+        e->result = r;
+    }
+    return r;
+#else
+    return call_direct(n, a);
+#endif
+}
+
+
+/* Calls the function of node n with the arguments in a. */
+static double call_function(const te_expr *n, const double *a) {
+    if (IS_MEMO(n->type)) return call_memoized(n, a);
+    return call_direct(n, a);
+}
+
+
+/* Reads a value of the given element type, which may be unaligned. */
+static double convert(const void *p, int element) {
+    switch (element) {
+        case TE_FLOAT: {float v; memcpy(&v, p, sizeof(v)); return v;}
+        case TE_INT32: {int32_t v; memcpy(&v, p, sizeof(v)); return v;}
+        case TE_INT64: {int64_t v; memcpy(&v, p, sizeof(v)); return (double)v;}
+        default: {double v; memcpy(&v, p, sizeof(v)); return v;}
+    }
+}
+
+
+/* Reads a variable that isn't a double. */
+static double load(const te_expr *n) {
+    return convert(n->address, ELEMENT(n->type));
+}
+
+
+#ifndef TE_PROFILE
+/* Operands that are constants or variables are read directly, saving a call. */
+static double eval_operand(const te_expr *n) {
+    switch(OPCODE(n->type)) {
+        case OP_CONSTANT: return n->value;
+        case OP_VARIABLE: return *n->bound;
+        default: return eval(n);
+    }
+}
+#endif
+
+
+/* User functions, closures and builtins without an opcode. */
+static double eval_function(const te_expr *n) {
+    if (n->type & (TE_FLAG_VECTOR | TE_FLAG_MEMO)) {
+        double a[7];
+        int i;
+        for (i = 0; i < ARITY(n->type); ++i) a[i] = M(i);
+        return call_function(n, a);
+    }
+
+    switch(TYPE_MASK(n->type)) {
         case TE_CONSTANT: return n->value;
         case TE_VARIABLE: return *n->bound;
 
@@ -557,13 +1556,113 @@ double te_eval(const te_expr *n) {
 
 }
 
+
+/* Variadic builtins, reading their arguments one at a time. */
+static double eval_nary(const te_expr *n) {
+    const int count = ARITY(n->type);
+    double r = M(0), scale = 0, ssq = 0;
+    int i;
+    switch (OPCODE(n->type)) {
+        NARY_LOOPS(M)
+        default: return NAN;
+    }
+}
+
+
+static double eval(const te_expr *n) {
+    switch(OPCODE(n->type)) {
+        case OP_CONSTANT: return n->value;
+        case OP_VARIABLE: return *n->bound;
+        case OP_LOAD: return load(n);
+        case OP_ADD: return M(0) + M(1);
+        case OP_SUB: return M(0) - M(1);
+        case OP_MUL: return M(0) * M(1);
+        case OP_DIV: return M(0) / M(1);
+        case OP_MOD: return fmod(M(0), M(1));
+        case OP_POW: return pow(M(0), M(1));
+        case OP_NEG: return -M(0);
+        case OP_COMMA: M(0); return M(1);
+        case OP_ABS: return fabs(M(0));
+        case OP_CEIL: return ceil(M(0));
+        case OP_FLOOR: return floor(M(0));
+        case OP_SQRT: return sqrt(M(0));
+        case OP_EXP: return exp(M(0));
+        case OP_LN: return log(M(0));
+        case OP_LOG10: return log10(M(0));
+        case OP_SIN: return sin(M(0));
+        case OP_COS: return cos(M(0));
+        case OP_TAN: return tan(M(0));
+        case OP_MIN: case OP_MAX: case OP_SUM: case OP_PROD: case OP_AVG: case OP_HYPOT: return eval_nary(n);
+        default: return eval_function(n);
+    }
+}
+
 #undef TE_FUN
 #undef M
 
-static void optimize(te_expr *n) {
+
+#ifdef TE_PROFILE
+/* Cycles spent in the children of the node being evaluated. */
+/* This makes profiling builds unsafe to evaluate from several threads. */
+static double profile_children = 0;
+
+static double profile_clock(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return (double)__builtin_ia32_rdtsc();
+#else
+    return (double)clock();
+#endif
+}
+
+static double eval_profiled(const te_expr *n) {
+    te_profile *p = (te_profile*)&n->profile;
+    const double outer = profile_children;
+    double start, elapsed, ret;
+
+    profile_children = 0;
+    start = profile_clock();
+    ret = eval(n);
+    elapsed = profile_clock() - start;
+
+    ++p->calls;
+    p->inclusive += elapsed;
+    p->exclusive += elapsed - profile_children;
+    profile_children = outer + elapsed;
+    return ret;
+}
+#endif
+
+
+static double eval_tiered(const te_expr *n);
+
+static double eval_root(const te_expr *n) {
+    if (!n) return NAN;
+    if (n->type & TE_FLAG_TIERED) return eval_tiered(n);
+#ifdef TE_PROFILE
+    return eval_profiled(n);
+#else
+    return eval(n);
+#endif
+}
+
+double te_eval(const te_expr *n) {
+#ifdef TE_STATS
+    const unsigned long start = clock_ns();
+    const double ret = eval_root(n);
+    te_stats *stats = stats_local();
+    TE_BUMP(&stats->evals, 1);
+    stats_latency(stats->eval_ns, start);
+    return ret;
+#else
+    return eval_root(n);
+#endif
+}
+
+/* Returns the node to use in place of n, which may have been freed. */
+static te_expr *optimize(te_expr *n, const te_allocator *owner) {
     /* Evaluates as much as possible. */
-    if (n->type == TE_CONSTANT) return;
-    if (n->type == TE_VARIABLE) return;
+    if (TYPE_MASK(n->type) == TE_CONSTANT) return n;
+    if (TYPE_MASK(n->type) == TE_VARIABLE) return n;
 
     /* Only optimize out functions flagged as pure. */
     if (IS_PURE(n->type)) {
@@ -571,26 +1670,44 @@ static void optimize(te_expr *n) {
         int known = 1;
         int i;
         for (i = 0; i < arity; ++i) {
-            optimize(n->parameters[i]);
-            if (((te_expr*)(n->parameters[i]))->type != TE_CONSTANT) {
+            n->parameters[i] = optimize(n->parameters[i], owner);
+            if (TYPE_MASK(((te_expr*)(n->parameters[i]))->type) != TE_CONSTANT) {
                 known = 0;
             }
         }
         if (known) {
-            const double value = te_eval(n);
-            te_free_parameters(n);
-            n->type = TE_CONSTANT;
-            n->value = value;
+            /* Replaced by a new node, so every node is freed at the size it was allocated with. */
+            te_expr *ret = new_expr(owner, TE_CONSTANT | OP(OP_CONSTANT), 0);
+            if (!ret) return n; /* Left unfolded, which gives the same results. */
+            ret->value = eval(n);
+#ifdef TE_PROFILE
+            ret->profile.start = n->profile.start;
+            ret->profile.end = n->profile.end;
+#endif
+            free_node(n);
+            return ret;
         }
     }
+
+    return n;
 }
 
 
-te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
+static te_expr *compile(const te_allocator *owner, const char *expression, const te_variable *variables, int var_count,
+        const te_limits *limits, int *error, int *reason) {
     state s;
     s.start = s.next = expression;
     s.lookup = variables;
     s.lookup_len = var_count;
+    s.owner = owner;
+
+    /* Unset limits are checked against values that can't be reached. */
+    s.nodes = s.depth = s.fail = 0;
+    s.bytes = 0;
+    s.limits.max_length = limits && limits->max_length > 0 ? limits->max_length : INT_MAX;
+    s.limits.max_nodes = limits && limits->max_nodes > 0 ? limits->max_nodes : INT_MAX;
+    s.limits.max_depth = limits && limits->max_depth > 0 ? limits->max_depth : INT_MAX;
+    s.limits.max_bytes = limits && limits->max_bytes > 0 ? limits->max_bytes : ULONG_MAX;
 
     next_token(&s);
     te_expr *root = list(&s);
@@ -601,15 +1718,49 @@ te_expr *te_compile(const char *expression, const te_variable *variables, int va
             *error = (s.next - s.start);
             if (*error == 0) *error = 1;
         }
+        if (reason) *reason = s.fail ? s.fail : TE_ERROR_SYNTAX;
         return 0;
     } else {
-        optimize(root);
+        root = optimize(root, owner);
         if (error) *error = 0;
+        if (reason) *reason = TE_ERROR_NONE;
         return root;
     }
 }
 
 
+static te_expr *compile_counted(const te_allocator *owner, const char *expression, const te_variable *variables, int var_count,
+        const te_limits *limits, int *error, int *reason) {
+#ifdef TE_STATS
+    const unsigned long start = clock_ns();
+    te_expr *root = compile(owner, expression, variables, var_count, limits, error, reason);
+    te_stats *stats = stats_local();
+    TE_BUMP(&stats->compiles, 1);
+    if (!root) TE_BUMP(&stats->compile_errors, 1);
+    stats_latency(stats->compile_ns, start);
+    return root;
+#else
+    return compile(owner, expression, variables, var_count, limits, error, reason);
+#endif
+}
+
+
+te_expr *te_compile_with(const te_allocator *allocator, const char *expression, const te_variable *variables, int var_count, int *error) {
+    return compile_counted(allocator, expression, variables, var_count, 0, error, 0);
+}
+
+
+te_expr *te_compile_limited(const char *expression, const te_variable *variables, int var_count,
+        const te_limits *limits, int *error, int *reason) {
+    return compile_counted(0, expression, variables, var_count, limits, error, reason);
+}
+
+
+te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
+    return te_compile_with(0, expression, variables, var_count, error);
+}
+
+
 double te_interp(const char *expression, int *error) {
     te_expr *n = te_compile(expression, 0, 0, error);
     double ret;
@@ -622,32 +1773,2865 @@ double te_interp(const char *expression, int *error) {
     return ret;
 }
 
-static void pn (const te_expr *n, int depth) {
-    int i, arity;
-    printf("%*s", depth, "");
+/* Linearized programs.
+ * A tree is flattened into postfix instructions run on a small value stack.
+ * Binary operators whose right operand is a constant or variable are fused
+ * into a single instruction. */
 
-    switch(TYPE_MASK(n->type)) {
-    case TE_CONSTANT: printf("%f\n", n->value); break;
-    case TE_VARIABLE: printf("bound %p\n", n->bound); break;
+#define TE_PROGRAM_STACK 64
 
-    case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
-    case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
-    case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
-    case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
-         arity = ARITY(n->type);
-         printf("f%d", arity);
-         for(i = 0; i < arity; i++) {
-             printf(" %p", n->parameters[i]);
-         }
-         printf("\n");
-         for(i = 0; i < arity; i++) {
-             pn(n->parameters[i], depth + 1);
-         }
-         break;
+typedef struct te_instr {
+    int op;
+    union {double value; const double *bound; const te_expr *node; const te_column *column;};
+} te_instr;
+
+typedef struct te_code {
+    int length;
+    te_instr code[1];
+} te_code;
+
+
+static int count_nodes(const te_expr *n) {
+    int i, count = 1;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        count += count_nodes(n->parameters[i]);
     }
+    return count;
 }
 
 
-void te_print(const te_expr *n) {
-    pn(n, 0);
+static int fused_op(int op, const te_expr *right) {
+    const int leaf = OPCODE(right->type);
+    if (leaf != OP_CONSTANT && leaf != OP_VARIABLE) return OP_NONE;
+    switch (op) {
+        case OP_ADD: return leaf == OP_CONSTANT ? OP_ADD_C : OP_ADD_V;
+        case OP_SUB: return leaf == OP_CONSTANT ? OP_SUB_C : OP_SUB_V;
+        case OP_MUL: return leaf == OP_CONSTANT ? OP_MUL_C : OP_MUL_V;
+        case OP_DIV: return leaf == OP_CONSTANT ? OP_DIV_C : OP_DIV_V;
+        default: return OP_NONE;
+    }
+}
+
+
+/* Appends the instructions for n, tracking the stack depth. Returns 0 if the stack would overflow. */
+static int emit(te_code *p, const te_expr *n, int depth) {
+    const int arity = ARITY(n->type);
+    const int op = OPCODE(n->type);
+    te_instr *in;
+    int i, fused;
+
+    if (depth >= TE_PROGRAM_STACK) return 0;
+
+    if (arity == 2 && (fused = fused_op(op, n->parameters[1]))) {
+        const te_expr *right = n->parameters[1];
+        if (!emit(p, n->parameters[0], depth)) return 0;
+        in = &p->code[p->length++];
+        in->op = fused;
+        if (fused == OP_ADD_C || fused == OP_SUB_C || fused == OP_MUL_C || fused == OP_DIV_C) {
+            in->value = right->value;
+        } else {
+            in->bound = right->bound;
+        }
+        return 1;
+    }
+
+    for (i = 0; i < arity; ++i) {
+        if (!emit(p, n->parameters[i], depth + i)) return 0;
+    }
+
+    in = &p->code[p->length++];
+    switch (op) {
+        case OP_CONSTANT: in->op = op; in->value = n->value; break;
+        case OP_VARIABLE: in->op = op; in->bound = n->bound; break;
+        case OP_LOAD: in->op = op; in->node = n; break;
+        case OP_NONE: in->op = OP_CALL; in->node = n; break;
+        default: in->op = op; in->node = n; break;
+    }
+    return 1;
+}
+
+
+static te_code *linearize(const te_expr *n) {
+    const int count = count_nodes(n);
+    te_code *p = mem_alloc(sizeof(te_code) + sizeof(te_instr) * (count - 1));
+    if (!p) return 0;
+    p->length = 0;
+    if (!emit(p, n, 0)) {
+        mem_free(p);
+        return 0;
+    }
+    return p;
+}
+
+
+static double run_program(const te_code *p) {
+    double stack[TE_PROGRAM_STACK + 1];
+    double *sp = stack;
+    const te_instr *in = p->code, *end = p->code + p->length;
+
+    for (; in < end; ++in) {
+        switch (in->op) {
+            case OP_CONSTANT: *++sp = in->value; break;
+            case OP_VARIABLE: *++sp = *in->bound; break;
+            case OP_LOAD: *++sp = load(in->node); break;
+
+            case OP_ADD: sp[-1] += sp[0]; --sp; break;
+            case OP_SUB: sp[-1] -= sp[0]; --sp; break;
+            case OP_MUL: sp[-1] *= sp[0]; --sp; break;
+            case OP_DIV: sp[-1] /= sp[0]; --sp; break;
+            case OP_MOD: sp[-1] = fmod(sp[-1], sp[0]); --sp; break;
+            case OP_POW: sp[-1] = pow(sp[-1], sp[0]); --sp; break;
+            case OP_COMMA: sp[-1] = sp[0]; --sp; break;
+
+            case OP_ADD_C: *sp += in->value; break;
+            case OP_ADD_V: *sp += *in->bound; break;
+            case OP_SUB_C: *sp -= in->value; break;
+            case OP_SUB_V: *sp -= *in->bound; break;
+            case OP_MUL_C: *sp *= in->value; break;
+            case OP_MUL_V: *sp *= *in->bound; break;
+            case OP_DIV_C: *sp /= in->value; break;
+            case OP_DIV_V: *sp /= *in->bound; break;
+
+            case OP_NEG: *sp = -*sp; break;
+            case OP_ABS: *sp = fabs(*sp); break;
+            case OP_CEIL: *sp = ceil(*sp); break;
+            case OP_FLOOR: *sp = floor(*sp); break;
+            case OP_SQRT: *sp = sqrt(*sp); break;
+            case OP_EXP: *sp = exp(*sp); break;
+            case OP_LN: *sp = log(*sp); break;
+            case OP_LOG10: *sp = log10(*sp); break;
+            case OP_SIN: *sp = sin(*sp); break;
+            case OP_COS: *sp = cos(*sp); break;
+            case OP_TAN: *sp = tan(*sp); break;
+
+            case OP_CALL: {
+                const int arity = ARITY(in->node->type);
+                sp -= arity;
+                sp[1] = call_function(in->node, sp + 1);
+                ++sp;
+                break;
+            }
+
+            case OP_MIN: case OP_MAX: case OP_SUM: case OP_PROD: case OP_AVG: case OP_HYPOT: {
+                const int count = ARITY(in->node->type);
+                sp -= count - 1;
+                *sp = nary_values(in->op, sp, count);
+                break;
+            }
+
+            default: return NAN;
+        }
+    }
+
+    return *sp;
+}
+
+
+/* Array evaluation.
+ * The tree is flattened into a program whose instructions work on blocks of
+ * rows. Subtrees that depend only on uniform variables are evaluated once while
+ * building the program and enter it as constants. In these programs the bound
+ * of a variable instruction is its column of values. */
+
+#define TE_BLOCK 256
+
+static const te_column *find_column(const te_expr *n, const te_column *columns, int column_count) {
+    int i;
+    for (i = 0; i < column_count; ++i) {
+        if (columns[i].address == n->address) return columns[i].values ? &columns[i] : 0;
+    }
+    return 0;
+}
+
+
+/* Packed columns of doubles are read by the variable instructions directly, */
+/* anything else is converted with OP_GATHER. */
+static int is_packed(const te_column *c) {
+    return ELEMENT(c->type) == TE_DOUBLE && (c->stride == 0 || c->stride == sizeof(double));
+}
+
+
+static const te_column *packed_column(const te_expr *n, const te_column *columns, int column_count) {
+    const te_column *c;
+    if (OPCODE(n->type) != OP_VARIABLE && OPCODE(n->type) != OP_LOAD) return 0;
+    c = find_column(n, columns, column_count);
+    return c && is_packed(c) ? c : 0;
+}
+
+
+#define GATHER(T) \
+    if (rows) for (i = 0; i < len; ++i) {T v; memcpy(&v, base + stride * rows[i], sizeof(v)); out[i] = (double)v;} \
+    else for (i = 0; i < len; ++i) {T v; memcpy(&v, base + stride * (offset + i), sizeof(v)); out[i] = (double)v;}
+
+/* Converts rows [offset, offset+len) of a typed or strided column to doubles, */
+/* or the rows listed in rows if it isn't 0. */
+static void gather(const te_column *c, int offset, const int *rows, int len, double *out) {
+    const int element = ELEMENT(c->type);
+    const size_t size = element == TE_FLOAT ? sizeof(float) : element == TE_INT32 ? sizeof(int32_t) : 8;
+    const size_t stride = c->stride ? (size_t)c->stride : size;
+    const char *base = (const char*)c->values;
+    int i;
+
+    switch (element) {
+        case TE_FLOAT: GATHER(float); break;
+        case TE_INT32: GATHER(int32_t); break;
+        case TE_INT64: GATHER(int64_t); break;
+        default: GATHER(double); break;
+    }
+}
+
+#undef GATHER
+
+
+/* Whether n gives the same value for every row. */
+static int is_uniform(const te_expr *n, const te_column *columns, int column_count) {
+    int i;
+    switch (OPCODE(n->type)) {
+        case OP_CONSTANT: return 1;
+        case OP_VARIABLE: case OP_LOAD: return find_column(n, columns, column_count) == 0;
+        default:
+            if (!IS_PURE(n->type)) return 0;
+            for (i = 0; i < ARITY(n->type); ++i) {
+                if (!is_uniform(n->parameters[i], columns, column_count)) return 0;
+            }
+            return 1;
+    }
+}
+
+
+typedef struct array_plan {
+    te_code *program;
+    double *stack;
+    const te_column *columns;
+    int column_count;
+    int selected;   /* Rows are picked by a selection, so columns can't be fused into operators. */
+    int depth, max_depth;
+} array_plan;
+
+
+static void emit_array(array_plan *p, const te_expr *n) {
+    const int arity = ARITY(n->type);
+    const int op = OPCODE(n->type);
+    te_instr *in;
+    int i;
+
+    if (p->depth + 1 > p->max_depth) p->max_depth = p->depth + 1;
+
+    if (is_uniform(n, p->columns, p->column_count)) {
+        in = &p->program->code[p->program->length++];
+        in->op = OP_CONSTANT;
+        in->value = eval(n);
+        p->depth += 1;
+        return;
+    }
+
+    if (op == OP_VARIABLE || op == OP_LOAD) {
+        const te_column *c = find_column(n, p->columns, p->column_count);
+        in = &p->program->code[p->program->length++];
+        if (is_packed(c)) {
+            in->op = OP_VARIABLE;
+            in->bound = c->values;
+        } else {
+            in->op = OP_GATHER;
+            in->column = c;
+        }
+        p->depth += 1;
+        return;
+    }
+
+    if (arity == 2 && (op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_DIV)) {
+        const te_expr *right = n->parameters[1];
+        const int uniform = is_uniform(right, p->columns, p->column_count);
+        if (uniform || (!p->selected && packed_column(right, p->columns, p->column_count))) {
+            emit_array(p, n->parameters[0]);
+            in = &p->program->code[p->program->length++];
+            if (uniform) {
+                in->op = op == OP_ADD ? OP_ADD_C : op == OP_SUB ? OP_SUB_C : op == OP_MUL ? OP_MUL_C : OP_DIV_C;
+                in->value = eval(right);
+            } else {
+                in->op = op == OP_ADD ? OP_ADD_V : op == OP_SUB ? OP_SUB_V : op == OP_MUL ? OP_MUL_V : OP_DIV_V;
+                in->bound = find_column(right, p->columns, p->column_count)->values;
+            }
+            return;
+        }
+    }
+
+    for (i = 0; i < arity; ++i) {
+        emit_array(p, n->parameters[i]);
+    }
+
+    in = &p->program->code[p->program->length++];
+    in->op = op == OP_NONE ? OP_CALL : op;
+    in->node = n;
+    p->depth += 1 - arity;
+}
+
+
+#define LOOP(STATEMENT) for (i = 0; i < len; ++i) {STATEMENT;}
+#define PUSH(TOP) ((TOP) ? (TOP) + TE_BLOCK : stack)
+
+/* Computes a variadic builtin for len rows of the count blocks starting at a, */
+/* leaving the results in the first. Arguments are taken in the same order as */
+/* eval_nary, so the results are the same. */
+static void nary_rows(int op, double *a, int count, int len) {
+    double scale[TE_BLOCK], ssq[TE_BLOCK];
+    const double *b;
+    int i, k;
+
+    if (op == OP_HYPOT) {
+        LOOP(scale[i] = ssq[i] = 0);
+        for (k = 0; k < count; ++k) {
+            b = a + k * TE_BLOCK;
+            LOOP(hypot_step(&scale[i], &ssq[i], b[i]));
+        }
+        LOOP(a[i] = hypot_result(scale[i], ssq[i]));
+        return;
+    }
+
+    for (k = 1; k < count; ++k) {
+        b = a + k * TE_BLOCK;
+        switch (op) {
+            case OP_MIN: LOOP(if (b[i] < a[i] || b[i] != b[i]) a[i] = b[i]); break;
+            case OP_MAX: LOOP(if (b[i] > a[i] || b[i] != b[i]) a[i] = b[i]); break;
+            case OP_PROD: LOOP(a[i] *= b[i]); break;
+            default: LOOP(a[i] += b[i]); break;
+        }
+    }
+    if (op == OP_AVG) LOOP(a[i] /= count);
+}
+
+/* Runs rows [offset, offset+len) of an array program, or the len rows listed in rows if it */
+/* isn't 0, leaving the result at the bottom of the stack. */
+static void run_array(const te_code *p, int offset, const int *rows, int len, double *stack) {
+    const te_instr *in = p->code, *end = p->code + p->length;
+    double *top = 0, *a;
+    int i;
+
+    for (; in < end; ++in) {
+        switch (in->op) {
+            case OP_CONSTANT: top = PUSH(top); LOOP(top[i] = in->value); break;
+            case OP_VARIABLE:
+                top = PUSH(top);
+                if (rows) LOOP(top[i] = in->bound[rows[i]])
+                else memcpy(top, in->bound + offset, sizeof(double) * len);
+                break;
+            case OP_GATHER: top = PUSH(top); gather(in->column, offset, rows, len, top); break;
+
+            case OP_ADD: a = top - TE_BLOCK; LOOP(a[i] += top[i]); top = a; break;
+            case OP_SUB: a = top - TE_BLOCK; LOOP(a[i] -= top[i]); top = a; break;
+            case OP_MUL: a = top - TE_BLOCK; LOOP(a[i] *= top[i]); top = a; break;
+            case OP_DIV: a = top - TE_BLOCK; LOOP(a[i] /= top[i]); top = a; break;
+            case OP_MOD: a = top - TE_BLOCK; LOOP(a[i] = fmod(a[i], top[i])); top = a; break;
+            case OP_POW: a = top - TE_BLOCK; LOOP(a[i] = pow(a[i], top[i])); top = a; break;
+            case OP_COMMA: a = top - TE_BLOCK; memcpy(a, top, sizeof(double) * len); top = a; break;
+
+            case OP_ADD_C: LOOP(top[i] += in->value); break;
+            case OP_ADD_V: LOOP(top[i] += in->bound[offset + i]); break;
+            case OP_SUB_C: LOOP(top[i] -= in->value); break;
+            case OP_SUB_V: LOOP(top[i] -= in->bound[offset + i]); break;
+            case OP_MUL_C: LOOP(top[i] *= in->value); break;
+            case OP_MUL_V: LOOP(top[i] *= in->bound[offset + i]); break;
+            case OP_DIV_C: LOOP(top[i] /= in->value); break;
+            case OP_DIV_V: LOOP(top[i] /= in->bound[offset + i]); break;
+
+            case OP_NEG: LOOP(top[i] = -top[i]); break;
+            case OP_ABS: LOOP(top[i] = fabs(top[i])); break;
+            case OP_CEIL: LOOP(top[i] = ceil(top[i])); break;
+            case OP_FLOOR: LOOP(top[i] = floor(top[i])); break;
+            case OP_SQRT: LOOP(top[i] = sqrt(top[i])); break;
+            case OP_EXP: LOOP(top[i] = exp(top[i])); break;
+            case OP_LN: LOOP(top[i] = log(top[i])); break;
+            case OP_LOG10: LOOP(top[i] = log10(top[i])); break;
+            case OP_SIN: LOOP(top[i] = sin(top[i])); break;
+            case OP_COS: LOOP(top[i] = cos(top[i])); break;
+            case OP_TAN: LOOP(top[i] = tan(top[i])); break;
+
+            case OP_MIN: case OP_MAX: case OP_SUM: case OP_PROD: case OP_AVG: case OP_HYPOT: {
+                const int count = ARITY(in->node->type);
+                a = top - TE_BLOCK * (count - 1);
+                nary_rows(in->op, a, count, len);
+                top = a;
+                break;
+            }
+
+            case OP_CALL: {
+                const int arity = ARITY(in->node->type);
+                double args[7];
+                int k;
+                if (arity == 0) top = PUSH(top);
+                a = top - TE_BLOCK * (arity ? arity - 1 : 0);
+                if (in->node->type & TE_FLAG_VECTOR) {
+                    /* One call for the whole block. */
+                    const double *columns[7];
+                    double out[TE_BLOCK];
+                    for (k = 0; k < arity; ++k) columns[k] = a + k * TE_BLOCK;
+                    call_vector(in->node, columns, len, out);
+                    memcpy(a, out, sizeof(double) * len);
+                    top = a;
+                    break;
+                }
+                for (i = 0; i < len; ++i) {
+                    for (k = 0; k < arity; ++k) args[k] = a[k * TE_BLOCK + i];
+                    a[i] = call_function(in->node, args);
+                }
+                top = a;
+                break;
+            }
+        }
+    }
+}
+
+#undef LOOP
+#undef PUSH
+
+
+/* Prepares n for evaluation by blocks. Returns 0 if out of memory. */
+static int plan_array(array_plan *p, const te_expr *n, const te_column *columns, int column_count, int selected) {
+    p->program = n ? mem_alloc(sizeof(te_code) + sizeof(te_instr) * (count_nodes(n) - 1)) : 0;
+    if (!p->program) return 0;
+
+    p->program->length = 0;
+    p->columns = columns;
+    p->column_count = column_count;
+    p->selected = selected;
+    p->depth = p->max_depth = 0;
+    emit_array(p, n);
+
+    p->stack = mem_alloc(sizeof(double) * TE_BLOCK * p->max_depth);
+    if (!p->stack) {
+        mem_free(p->program);
+        return 0;
+    }
+    return 1;
+}
+
+
+static void free_plan(array_plan *p) {
+    mem_free(p->stack);
+    mem_free(p->program);
+}
+
+
+void te_eval_array(const te_expr *n, const te_column *columns, int column_count, int count, double *out) {
+    array_plan p;
+    int offset;
+
+    if (count <= 0) return;
+
+    if (!plan_array(&p, n, columns, column_count, 0)) {
+        for (offset = 0; offset < count; ++offset) out[offset] = NAN;
+        return;
+    }
+
+    for (offset = 0; offset < count; offset += TE_BLOCK) {
+        const int len = count - offset < TE_BLOCK ? count - offset : TE_BLOCK;
+        run_array(p.program, offset, 0, len, p.stack);
+        memcpy(out + offset, p.stack, sizeof(double) * len);
+    }
+
+    free_plan(&p);
+}
+
+
+/* Selections.
+ * Only the selected rows are loaded into the block stack, so rows that aren't
+ * selected cost nothing beyond finding them in a mask. */
+
+/* Evaluates the len rows listed in rows and stores their results. */
+/* If p is 0 the expression couldn't be planned and the results are NaN. */
+static void store_rows(const array_plan *p, const int *rows, int len, double *out, int flags) {
+    int i;
+    if (p) run_array(p->program, 0, rows, len, p->stack);
+    if (flags & TE_SELECT_COMPACT) {
+        if (p) memcpy(out, p->stack, sizeof(double) * len);
+        else for (i = 0; i < len; ++i) out[i] = NAN;
+    } else {
+        for (i = 0; i < len; ++i) out[rows[i]] = p ? p->stack[i] : NAN;
+    }
+}
+
+
+void te_eval_selected(const te_expr *n, const te_column *columns, int column_count,
+        const int *selection, int count, double *out, int flags) {
+    array_plan p;
+    const int planned = count > 0 && plan_array(&p, n, columns, column_count, 1);
+    int offset;
+
+    for (offset = 0; offset < count; offset += TE_BLOCK) {
+        const int len = count - offset < TE_BLOCK ? count - offset : TE_BLOCK;
+        store_rows(planned ? &p : 0, selection + offset, len,
+                flags & TE_SELECT_COMPACT ? out + offset : out, flags);
+    }
+
+    if (planned) free_plan(&p);
+}
+
+
+int te_eval_masked(const te_expr *n, const te_column *columns, int column_count,
+        const unsigned char *mask, int count, double *out, int flags) {
+    array_plan p;
+    const int planned = count > 0 && plan_array(&p, n, columns, column_count, 1);
+    int rows[TE_BLOCK];
+    int len = 0, done = 0, row, bit;
+
+    for (row = 0; row < count; row += 8) {
+        const unsigned char byte = mask[row / 8];
+        if (!byte) continue;
+        for (bit = 0; bit < 8 && row + bit < count; ++bit) {
+            if (!(byte & (1 << bit))) continue;
+            rows[len++] = row + bit;
+            if (len == TE_BLOCK) {
+                store_rows(planned ? &p : 0, rows, len, flags & TE_SELECT_COMPACT ? out + done : out, flags);
+                done += len;
+                len = 0;
+            }
+        }
+    }
+
+    if (len) {
+        store_rows(planned ? &p : 0, rows, len, flags & TE_SELECT_COMPACT ? out + done : out, flags);
+        done += len;
+    }
+
+    if (planned) free_plan(&p);
+    return done;
+}
+
+
+/* Reductions.
+ * Each block is reduced while it's still on the array stack, so the
+ * values of the expression are never written out. */
+
+void te_reduce_init(te_reduction *r, int flags) {
+    r->flags = flags;
+    r->rows = r->count = 0;
+    r->sum = r->compensation = 0;
+    r->min = r->max = NAN;
+    r->argmin = r->argmax = -1;
+}
+
+
+/* Adds v to the sum, keeping the lost low-order bits with Neumaier's method. */
+static void add_compensated(te_reduction *r, double v) {
+    const double t = r->sum + v;
+    if (fabs(r->sum) >= fabs(v)) r->compensation += (r->sum - t) + v;
+    else r->compensation += (v - t) + r->sum;
+    r->sum = t;
+}
+
+
+static void reduce_block(te_reduction *r, const double *v, int len) {
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        if (v[i] != v[i]) continue;
+        if (r->count == 0 || v[i] < r->min) {r->min = v[i]; r->argmin = (long)r->rows + i;}
+        if (r->count == 0 || v[i] > r->max) {r->max = v[i]; r->argmax = (long)r->rows + i;}
+        ++r->count;
+    }
+
+    if (r->flags & TE_REDUCE_COMPENSATED) {
+        for (i = 0; i < len; ++i) if (v[i] == v[i]) add_compensated(r, v[i]);
+    } else {
+        double sum = 0;
+        for (i = 0; i < len; ++i) if (v[i] == v[i]) sum += v[i];
+        r->sum += sum;
+    }
+
+    r->rows += len;
+}
+
+
+void te_reduce(const te_expr *n, const te_column *columns, int column_count, int count, te_reduction *r) {
+    array_plan p;
+    int offset;
+
+    if (count <= 0) return;
+
+    if (!plan_array(&p, n, columns, column_count, 0)) {
+        /* Every row is NaN. */
+        r->rows += count;
+        return;
+    }
+
+    for (offset = 0; offset < count; offset += TE_BLOCK) {
+        const int len = count - offset < TE_BLOCK ? count - offset : TE_BLOCK;
+        run_array(p.program, offset, 0, len, p.stack);
+        reduce_block(r, p.stack, len);
+    }
+
+    free_plan(&p);
+}
+
+
+void te_reduce_merge(te_reduction *into, const te_reduction *from) {
+    if (from->count) {
+        if (!into->count || from->min < into->min) {
+            into->min = from->min;
+            into->argmin = (long)into->rows + from->argmin;
+        }
+        if (!into->count || from->max > into->max) {
+            into->max = from->max;
+            into->argmax = (long)into->rows + from->argmax;
+        }
+    }
+
+    if (into->flags & TE_REDUCE_COMPENSATED) {
+        add_compensated(into, from->sum);
+        into->compensation += from->compensation;
+    } else {
+        into->sum += from->sum + from->compensation;
+    }
+
+    into->count += from->count;
+    into->rows += from->rows;
+}
+
+
+double te_reduction_sum(const te_reduction *r) {
+    return r->sum + r->compensation;
+}
+
+
+double te_reduction_mean(const te_reduction *r) {
+    return r->count ? te_reduction_sum(r) / r->count : NAN;
+}
+
+
+void te_histogram(const te_expr *n, const te_column *columns, int column_count, int count,
+        double lower, double upper, int bins, unsigned long *counts) {
+    const double scale = bins / (upper - lower);
+    array_plan p;
+    int offset, i;
+
+    if (count <= 0 || bins <= 0 || !(upper > lower)) return;
+    if (!plan_array(&p, n, columns, column_count, 0)) return;
+
+    for (offset = 0; offset < count; offset += TE_BLOCK) {
+        const int len = count - offset < TE_BLOCK ? count - offset : TE_BLOCK;
+        run_array(p.program, offset, 0, len, p.stack);
+        for (i = 0; i < len; ++i) {
+            const double v = p.stack[i];
+            int b;
+            /* Also false for NaN. */
+            if (!(v >= lower && v < upper)) continue;
+            b = (int)((v - lower) * scale);
+            ++counts[b < bins ? b : bins - 1];
+        }
+    }
+
+    free_plan(&p);
+}
+
+
+/* Tiered expressions.
+ * The expression runs on the tree walker until it has been evaluated
+ * `threshold` times, then it's linearized and runs as a program. */
+
+static double eval_tiered(const te_expr *n) {
+    te_tier *t = TIER(n);
+    ++t->evaluations;
+
+    if (t->program) return run_program(t->program);
+
+    if (!t->promoted_at && t->evaluations >= t->threshold) {
+        t->promoted_at = t->evaluations;
+        t->program = linearize(n);
+        if (t->program) return run_program(t->program);
+    }
+
+    return eval(n);
+}
+
+
+te_expr *te_compile_tiered(const char *expression, const te_variable *variables, int var_count, unsigned long threshold, int *error) {
+    te_expr *root = te_compile(expression, variables, var_count, error);
+    te_tier *t;
+    int size;
+
+    /* Constants and variables are as fast as they can get already. */
+    if (!root || OPCODE(root->type) == OP_CONSTANT || OPCODE(root->type) == OP_VARIABLE) return root;
+
+    size = node_size(root->type);
+    t = mem_alloc(sizeof(te_tier) + size);
+    if (!t) {
+        te_free(root);
+        if (error) *error = -1;
+        return 0;
+    }
+
+    t->evaluations = 0;
+    t->threshold = threshold;
+    t->promoted_at = 0;
+    t->program = 0;
+
+    memcpy(t + 1, root, size);
+    release_node(root, size);
+
+    root = (te_expr*)(t + 1);
+    root->type |= TE_FLAG_TIERED;
+    return root;
+}
+
+
+int te_get_tier_stats(const te_expr *n, te_tier_stats *stats) {
+    const te_tier *t;
+    if (!n || !(n->type & TE_FLAG_TIERED)) return 0;
+
+    t = TIER(n);
+    stats->evaluations = t->evaluations;
+    stats->threshold = t->threshold;
+    stats->promoted_at = t->promoted_at;
+    stats->tier = t->program ? 2 : 1;
+    stats->program_length = t->program ? t->program->length : 0;
+    return 1;
+}
+
+
+/* Hash-consed expression stores.
+ * Pure nodes compiled into a store are looked up by their type, payload and
+ * (already shared) children, so identical subtrees exist only once. Shared
+ * nodes carry a reference count in a header in front of them; te_free() drops
+ * a reference and only frees the node with the last one. */
+
+typedef struct te_shared {
+    unsigned long refcount;
+    unsigned long hash;
+    struct te_shared *next;
+    te_store *store;
+} te_shared;
+
+#define SHARED(n) ((te_shared*)((char*)(n) - sizeof(te_shared)))
+#define SHARED_NODE(h) ((te_expr*)((h) + 1))
+
+struct te_store {
+    te_shared **buckets;
+    unsigned long bucket_count;
+    te_store_stats stats;
+};
+
+
+te_store *te_store_new(void) {
+    te_store *st = mem_alloc(sizeof(te_store));
+    if (!st) return 0;
+    st->bucket_count = 64;
+    st->buckets = mem_calloc(st->bucket_count, sizeof(te_shared*));
+    if (!st->buckets) {
+        mem_free(st);
+        return 0;
+    }
+    memset(&st->stats, 0, sizeof(st->stats));
+    return st;
+}
+
+
+void te_store_free(te_store *st) {
+    unsigned long i;
+    te_shared *h;
+    if (!st) return;
+
+    /* Expressions still alive outlive the store; they just stop being indexed. */
+    for (i = 0; i < st->bucket_count; ++i) {
+        for (h = st->buckets[i]; h; h = h->next) h->store = 0;
+    }
+    mem_free(st->buckets);
+    mem_free(st);
+}
+
+
+void te_store_get_stats(const te_store *st, te_store_stats *stats) {
+    *stats = st->stats;
+}
+
+
+static unsigned long hash_bytes(unsigned long h, const void *data, int len) {
+    const unsigned char *p = data;
+    while (len--) h = (h ^ *p++) * 16777619UL;
+    return h;
+}
+
+
+static unsigned long hash_node(const te_expr *n) {
+    unsigned long h = hash_bytes(2166136261UL, &n->type, sizeof(n->type));
+    const int arity = ARITY(n->type);
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return hash_bytes(h, &n->value, sizeof(n->value));
+        case TE_VARIABLE: return hash_bytes(h, &n->bound, sizeof(n->bound));
+        default:
+            h = hash_bytes(h, &n->function, sizeof(n->function));
+            return hash_bytes(h, n->parameters, sizeof(void*) * (arity + (IS_CLOSURE(n->type) ? 1 : 0)));
+    }
+}
+
+
+static int same_node(const te_expr *a, const te_expr *b) {
+    const int arity = ARITY(a->type);
+    if ((a->type | TE_FLAG_SHARED) != (b->type | TE_FLAG_SHARED)) return 0;
+
+    switch (TYPE_MASK(a->type)) {
+        case TE_CONSTANT: return memcmp(&a->value, &b->value, sizeof(a->value)) == 0;
+        case TE_VARIABLE: return a->bound == b->bound;
+        default:
+            return a->function == b->function &&
+                memcmp(a->parameters, b->parameters, sizeof(void*) * (arity + (IS_CLOSURE(a->type) ? 1 : 0))) == 0;
+    }
+}
+
+
+static void store_grow(te_store *st) {
+    const unsigned long count = st->bucket_count * 2;
+    te_shared **buckets = mem_calloc(count, sizeof(te_shared*));
+    unsigned long i;
+    if (!buckets) return;
+
+    for (i = 0; i < st->bucket_count; ++i) {
+        te_shared *h = st->buckets[i];
+        while (h) {
+            te_shared *next = h->next;
+            h->next = buckets[h->hash % count];
+            buckets[h->hash % count] = h;
+            h = next;
+        }
+    }
+
+    mem_free(st->buckets);
+    st->buckets = buckets;
+    st->bucket_count = count;
+}
+
+
+/* Replaces n and its subtrees with shared nodes from the store where possible. */
+/* Returns the node to use in place of n, which may have been freed. */
+static te_expr *intern(te_store *st, te_expr *n) {
+    const int arity = ARITY(n->type);
+    const int size = node_size(n->type);
+    int i, shareable = IS_PURE(n->type) || TYPE_MASK(n->type) == TE_CONSTANT || TYPE_MASK(n->type) == TE_VARIABLE;
+    unsigned long hash;
+    te_shared *h;
+
+    for (i = 0; i < arity; ++i) {
+        n->parameters[i] = intern(st, n->parameters[i]);
+        if (!(((te_expr*)n->parameters[i])->type & TE_FLAG_SHARED)) shareable = 0;
+    }
+
+    if (!shareable) return n;
+
+    hash = hash_node(n);
+    for (h = st->buckets[hash % st->bucket_count]; h; h = h->next) {
+        if (h->hash == hash && same_node(SHARED_NODE(h), n)) {
+            /* The existing node already holds references to the same children. */
+            ++h->refcount;
+            ++st->stats.hits;
+            te_free_parameters(n);
+            STAT_NODE_FREE(size);
+            release_node(n, size);
+            return SHARED_NODE(h);
+        }
+    }
+
+    h = mem_alloc(sizeof(te_shared) + size);
+    if (!h) return n;
+
+    memcpy(SHARED_NODE(h), n, size);
+    release_node(n, size);
+    n = SHARED_NODE(h);
+    n->type |= TE_FLAG_SHARED;
+
+    h->refcount = 1;
+    h->hash = hash;
+    h->store = st;
+    h->next = st->buckets[hash % st->bucket_count];
+    st->buckets[hash % st->bucket_count] = h;
+
+    ++st->stats.nodes;
+    st->stats.bytes += sizeof(te_shared) + size;
+    if (st->stats.nodes > st->bucket_count) store_grow(st);
+
+    return n;
+}
+
+
+static void release_shared(te_expr *n) {
+    te_shared *h = SHARED(n);
+    te_store *st = h->store;
+
+    if (--h->refcount) return;
+
+    if (st) {
+        te_shared **link = &st->buckets[h->hash % st->bucket_count];
+        while (*link != h) link = &(*link)->next;
+        *link = h->next;
+        --st->stats.nodes;
+        st->stats.bytes -= sizeof(te_shared) + node_size(n->type);
+    }
+
+    te_free_parameters(n);
+    STAT_NODE_FREE(node_size(n->type));
+    mem_free(h);
+}
+
+
+te_expr *te_store_compile(te_store *st, const char *expression, const te_variable *variables, int var_count, int *error) {
+    te_expr *root = te_compile(expression, variables, var_count, error);
+    if (!root) return 0;
+    return intern(st, root);
+}
+
+
+/* Multi-expression programs.
+ * The expressions are compiled into a temporary store so that identical pure
+ * subtrees are merged, and the resulting graph is scheduled into steps that
+ * each compute one node into a slot. Shared nodes are computed once. */
+
+typedef struct te_step {
+    int op;
+    int slot;
+    int a, b;
+    union {double value; const double *bound; const te_expr *node;};
+} te_step;
+
+/* Programs with up to this many slots are evaluated on the stack. */
+#define PROGRAM_LOCAL_SLOTS 256
+
+#if defined(__GNUC__)
+#define SCRATCH_CLAIM(p) __sync_bool_compare_and_swap((p), 0, 1)
+#define SCRATCH_RETURN(p) __atomic_store_n((p), 0, __ATOMIC_RELEASE)
+#else
+#define SCRATCH_CLAIM(p) (*(p) ? 0 : (*(p) = 1))
+#define SCRATCH_RETURN(p) (*(p) = 0)
+#endif
+
+struct te_program {
+    int count;
+    int slot_count;
+    int length;
+    te_step *steps;
+    int *args;
+    int *outputs;
+    te_expr **roots;
+    double *scratch;            /* Slots of larger programs, for one te_eval_many at a time. */
+    int scratch_busy;           /* Set while a te_eval_many is using scratch. */
+};
+
+
+typedef struct slot_map {
+    const te_expr **keys;
+    int *slots;
+    unsigned long mask;
+} slot_map;
+
+
+static int *slot_find(slot_map *m, const te_expr *n) {
+    unsigned long i = ((unsigned long)(size_t)n >> 4) & m->mask;
+    while (m->keys[i] && m->keys[i] != n) i = (i + 1) & m->mask;
+    m->keys[i] = n;
+    return &m->slots[i];
+}
+
+
+/* Schedules n after its arguments and returns its slot. */
+static int schedule(te_program *p, slot_map *m, int *arg_count, const te_expr *n) {
+    const int arity = ARITY(n->type);
+    const int op = OPCODE(n->type);
+    /* Calls and variadic builtins list their argument slots in p->args. */
+    const int listed = op == OP_NONE || IS_NARY(op);
+    int *known = 0, a = 0, b = 0, first = *arg_count, i;
+    te_step *step;
+
+    if (n->type & TE_FLAG_SHARED) {
+        known = slot_find(m, n);
+        if (*known >= 0) return *known;
+    }
+
+    if (listed) *arg_count += arity;
+    for (i = 0; i < arity; ++i) {
+        const int slot = schedule(p, m, arg_count, n->parameters[i]);
+        if (listed) p->args[first + i] = slot;
+        if (i == 0) a = slot;
+        else if (i == 1) b = slot;
+    }
+
+    step = &p->steps[p->length++];
+    step->slot = p->slot_count++;
+    step->a = listed ? first : a;
+    step->b = b;
+
+    switch (op) {
+        case OP_CONSTANT: step->op = op; step->value = n->value; break;
+        case OP_VARIABLE: step->op = op; step->bound = n->bound; break;
+        case OP_LOAD: step->op = op; step->node = n; break;
+        case OP_NONE: step->op = OP_CALL; step->node = n; break;
+        default: step->op = op; step->node = n; break;
+    }
+
+    if (known) *known = step->slot;
+    return step->slot;
+}
+
+
+te_program *te_compile_many(const char *const *expressions, int count, const te_variable *variables, int var_count, int *errors) {
+    te_store *st = te_store_new();
+    te_program *p = mem_calloc(1, sizeof(te_program));
+    slot_map m;
+    int i, failed = 0, nodes = 0, arg_count = 0;
+
+    /* Running out of memory fails with no error positions. */
+    if (errors) for (i = 0; i < count; ++i) errors[i] = 0;
+
+    if (!st || !p) {
+        te_store_free(st);
+        mem_free(p);
+        return 0;
+    }
+
+    p->count = count;
+    p->roots = mem_calloc(count ? count : 1, sizeof(te_expr*));
+    p->outputs = mem_alloc(sizeof(int) * (count ? count : 1));
+    if (!p->roots || !p->outputs) {
+        te_store_free(st);
+        te_program_free(p);
+        return 0;
+    }
+
+    for (i = 0; i < count; ++i) {
+        int err = 0;
+        p->roots[i] = te_store_compile(st, expressions[i], variables, var_count, &err);
+        if (errors) errors[i] = err;
+        if (!p->roots[i]) failed = 1;
+        else nodes += count_nodes(p->roots[i]);
+    }
+    te_store_free(st);
+
+    if (failed) {
+        te_program_free(p);
+        return 0;
+    }
+
+    p->steps = mem_alloc(sizeof(te_step) * (nodes ? nodes : 1));
+    p->args = mem_alloc(sizeof(int) * (nodes ? nodes : 1));
+
+    for (m.mask = 1; m.mask < (unsigned long)nodes * 2; m.mask <<= 1);
+    m.keys = mem_calloc(m.mask, sizeof(te_expr*));
+    m.slots = mem_alloc(sizeof(int) * m.mask);
+    m.mask -= 1;
+    if (m.slots) for (i = 0; i <= (int)m.mask; ++i) m.slots[i] = -1;
+
+    if (p->steps && p->args && m.keys && m.slots) {
+        for (i = 0; i < count; ++i) {
+            p->outputs[i] = schedule(p, &m, &arg_count, p->roots[i]);
+        }
+        /* Allocated once here, so evaluating never has to. */
+        if (p->slot_count > PROGRAM_LOCAL_SLOTS && !(p->scratch = mem_alloc(sizeof(double) * p->slot_count))) {
+            te_program_free(p);
+            p = 0;
+        }
+    } else {
+        te_program_free(p);
+        p = 0;
+    }
+
+    mem_free(m.keys);
+    mem_free(m.slots);
+    return p;
+}
+
+
+void te_eval_many(const te_program *p, double *out) {
+    double local[PROGRAM_LOCAL_SLOTS], args[NARY_MAX];
+    double *s = local;
+    const te_step *step = p->steps, *end = p->steps + p->length;
+    int *busy = (int*)&p->scratch_busy;
+    int claimed = 0, i;
+
+    /* Another thread evaluating the same program at once gets slots of its own. */
+    if (p->slot_count > PROGRAM_LOCAL_SLOTS) {
+        claimed = SCRATCH_CLAIM(busy);
+        s = claimed ? p->scratch : mem_alloc(sizeof(double) * p->slot_count);
+    }
+
+    if (!s) {
+        for (i = 0; i < p->count; ++i) out[i] = NAN;
+        return;
+    }
+
+    for (; step < end; ++step) {
+        double *r = &s[step->slot];
+        switch (step->op) {
+            case OP_CONSTANT: *r = step->value; break;
+            case OP_VARIABLE: *r = *step->bound; break;
+            case OP_LOAD: *r = load(step->node); break;
+            case OP_ADD: *r = s[step->a] + s[step->b]; break;
+            case OP_SUB: *r = s[step->a] - s[step->b]; break;
+            case OP_MUL: *r = s[step->a] * s[step->b]; break;
+            case OP_DIV: *r = s[step->a] / s[step->b]; break;
+            case OP_MOD: *r = fmod(s[step->a], s[step->b]); break;
+            case OP_POW: *r = pow(s[step->a], s[step->b]); break;
+            case OP_COMMA: *r = s[step->b]; break;
+            case OP_NEG: *r = -s[step->a]; break;
+            case OP_ABS: *r = fabs(s[step->a]); break;
+            case OP_CEIL: *r = ceil(s[step->a]); break;
+            case OP_FLOOR: *r = floor(s[step->a]); break;
+            case OP_SQRT: *r = sqrt(s[step->a]); break;
+            case OP_EXP: *r = exp(s[step->a]); break;
+            case OP_LN: *r = log(s[step->a]); break;
+            case OP_LOG10: *r = log10(s[step->a]); break;
+            case OP_SIN: *r = sin(s[step->a]); break;
+            case OP_COS: *r = cos(s[step->a]); break;
+            case OP_TAN: *r = tan(s[step->a]); break;
+            case OP_CALL:
+                for (i = 0; i < ARITY(step->node->type); ++i) args[i] = s[p->args[step->a + i]];
+                *r = call_function(step->node, args);
+                break;
+            case OP_MIN: case OP_MAX: case OP_SUM: case OP_PROD: case OP_AVG: case OP_HYPOT:
+                for (i = 0; i < ARITY(step->node->type); ++i) args[i] = s[p->args[step->a + i]];
+                *r = nary_values(step->op, args, ARITY(step->node->type));
+                break;
+        }
+    }
+
+    for (i = 0; i < p->count; ++i) out[i] = s[p->outputs[i]];
+    if (claimed) SCRATCH_RETURN(busy);
+    else if (s != local) mem_free(s);
+}
+
+
+int te_program_steps(const te_program *p) {
+    return p->length;
+}
+
+
+void te_program_free(te_program *p) {
+    int i;
+    if (!p) return;
+    if (p->roots) {
+        for (i = 0; i < p->count; ++i) te_free(p->roots[i]);
+    }
+    mem_free(p->roots);
+    mem_free(p->outputs);
+    mem_free(p->steps);
+    mem_free(p->args);
+    mem_free(p->scratch);
+    mem_free(p);
+}
+
+
+/* Analysis.
+ * Costs are estimated by adding up a cost per node from the cost table, by
+ * class of operation. User functions are charged only for the call. */
+
+#define DEFAULT_COSTS {1, 1, 12, 80, 50, 40, 10}
+
+static te_cost_table cost_table = DEFAULT_COSTS;
+
+
+void te_set_cost_table(const te_cost_table *table) {
+    static const te_cost_table defaults = DEFAULT_COSTS;
+    cost_table = table ? *table : defaults;
+}
+
+
+void te_get_cost_table(te_cost_table *table) {
+    *table = cost_table;
+}
+
+
+static int is_builtin(const te_expr *n) {
+    const te_variable *f;
+    for (f = functions; f->name; ++f) {
+        if (f->address == n->function) return 1;
+    }
+    return 0;
+}
+
+
+/* The cost of n alone, not counting its arguments. */
+static double own_cost(const te_expr *n) {
+    switch (OPCODE(n->type)) {
+        case OP_CONSTANT: case OP_VARIABLE: case OP_LOAD: return cost_table.load;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_NEG: case OP_COMMA:
+        case OP_ABS: case OP_CEIL: case OP_FLOOR: return cost_table.arithmetic;
+        case OP_DIV: case OP_MOD: case OP_SQRT: return cost_table.division;
+        case OP_POW: return cost_table.pow;
+        case OP_EXP: case OP_LN: case OP_LOG10: case OP_SIN: case OP_COS: case OP_TAN: return cost_table.transcendental;
+        case OP_MIN: case OP_MAX: case OP_SUM: case OP_PROD: return cost_table.arithmetic * (ARITY(n->type) - 1);
+        case OP_AVG: return cost_table.arithmetic * (ARITY(n->type) - 1) + cost_table.division;
+        case OP_HYPOT: return (cost_table.arithmetic + cost_table.division) * ARITY(n->type) + cost_table.division;
+        default: return is_builtin(n) ? cost_table.builtin : cost_table.call;
+    }
+}
+
+
+static double node_cost(const te_expr *n) {
+    double cost = own_cost(n);
+    int i;
+    for (i = 0; i < ARITY(n->type); ++i) cost += node_cost(n->parameters[i]);
+    return cost;
+}
+
+
+/* Bytes allocated for n alone, with any header in front of it. */
+static unsigned long own_bytes(const te_expr *n) {
+    unsigned long bytes = node_size(n->type);
+    if (n->type & TE_FLAG_OWNED) bytes += sizeof(te_owner);
+    if (n->type & TE_FLAG_SHARED) bytes += sizeof(te_shared);
+    if (n->type & TE_FLAG_TIERED) {
+        const te_code *p = TIER(n)->program;
+        bytes += sizeof(te_tier);
+        if (p) bytes += sizeof(te_code) + sizeof(te_instr) * (p->length - 1);
+    }
+    return bytes;
+}
+
+
+static void analyze(const te_expr *n, int depth, te_analysis *a, const void **variables) {
+    const int op = OPCODE(n->type);
+    int i;
+
+    ++a->nodes;
+    if (depth > a->depth) a->depth = depth;
+    a->bytes += own_bytes(n);
+    a->cost += own_cost(n);
+
+    if (op == OP_VARIABLE || op == OP_LOAD) {
+        for (i = 0; i < a->variables && variables[i] != n->address; ++i);
+        if (i == a->variables) variables[a->variables++] = n->address;
+    } else if (op == OP_POW) {
+        ++a->pow_calls;
+    } else if (op >= OP_ABS || (op == OP_NONE && is_builtin(n))) {
+        ++a->builtin_calls;
+    } else if (op == OP_NONE) {
+        if (IS_CLOSURE(n->type)) ++a->closure_calls;
+        else ++a->function_calls;
+    }
+
+    for (i = 0; i < ARITY(n->type); ++i) {
+        analyze(n->parameters[i], depth + 1, a, variables);
+    }
+}
+
+
+te_analysis te_analyze(const te_expr *n) {
+    te_analysis a;
+    const void **variables;
+
+    memset(&a, 0, sizeof(a));
+    if (!n) return a;
+
+    variables = mem_alloc(sizeof(void*) * count_nodes(n));
+    if (!variables) {
+        a.cost = NAN;
+        return a;
+    }
+    analyze(n, 1, &a, variables);
+    mem_free(variables);
+    return a;
+}
+
+
+/* Schedulers.
+ * Tasks are sorted by decreasing cost and dealt out, each to the thread with
+ * the least work so far, so every thread gets a contiguous run of the order.
+ * A thread runs its own tasks from the expensive end in batches, and when it
+ * runs out it steals the cheaper half of another thread's. Each task only
+ * writes its own output, so results don't depend on which thread ran what. */
+
+/* Every TE_SCHED_SAMPLE runs, starting with the first, each task is timed. */
+#define TE_SCHED_SAMPLE 16
+
+/* Threads take tasks from their own queue until a batch is estimated to cost this many nanoseconds. */
+#define TE_SCHED_BATCH 2000.0
+
+typedef struct sched_task {
+    const te_expr *expr;
+    double *out;
+    double cost;    /* Estimated or measured nanoseconds per evaluation. */
+    int timed;
+} sched_task;
+
+typedef struct sched_entry {
+    int task;
+    double cost;
+} sched_entry;
+
+typedef struct sched_queue {
+#ifdef TE_THREADS
+    pthread_mutex_t lock;
+#endif
+    int start, end;     /* The thread's share of the order. */
+    int head, tail;     /* What's left to run this time. */
+} sched_queue;
+
+#ifdef TE_THREADS
+typedef struct sched_worker {
+    te_scheduler *s;
+    int index;
+    pthread_t thread;
+} sched_worker;
+#endif
+
+struct te_scheduler {
+    sched_task *tasks;
+    sched_entry *order;
+    int count, capacity;
+    int sorted;         /* Whether order is up to date with the task costs. */
+    int timing;         /* Whether this run times every task. */
+    unsigned long runs;
+
+    int threads;
+    sched_queue *queues;
+#ifdef TE_THREADS
+    sched_worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    unsigned long generation;
+    int running;        /* Workers still busy with this run. */
+    int stop;
+#endif
+};
+
+
+static void run_task(te_scheduler *s, int i) {
+    sched_task *t = &s->tasks[i];
+#ifdef TE_THREADS
+    if (s->timing) {
+        const unsigned long start = clock_ns();
+        double ns;
+        *t->out = te_eval(t->expr);
+        ns = (double)(clock_ns() - start);
+        t->cost = t->timed ? (3 * t->cost + ns) / 4 : ns;
+        t->timed = 1;
+        return;
+    }
+#endif
+    *t->out = te_eval(t->expr);
+}
+
+
+static int compare_entries(const void *a, const void *b) {
+    const sched_entry *x = a, *y = b;
+    if (x->cost != y->cost) return x->cost > y->cost ? -1 : 1;
+    return x->task - y->task;
+}
+
+
+/* Sorts the tasks by cost and deals them out to the threads. Returns 0 if out of memory. */
+static int sched_deal(te_scheduler *s) {
+    sched_entry *sorted = mem_alloc(sizeof(sched_entry) * (s->count ? s->count : 1));
+    int *owner = mem_alloc(sizeof(int) * (s->count ? s->count : 1));
+    double *load = mem_calloc(s->threads, sizeof(double));
+    int i, t;
+
+    if (!sorted || !owner || !load) {
+        mem_free(sorted);
+        mem_free(owner);
+        mem_free(load);
+        return 0;
+    }
+
+    for (i = 0; i < s->count; ++i) {
+        sorted[i].task = i;
+        sorted[i].cost = s->tasks[i].cost;
+    }
+    qsort(sorted, s->count, sizeof(sched_entry), compare_entries);
+
+    for (t = 0; t < s->threads; ++t) s->queues[t].end = 0;
+    for (i = 0; i < s->count; ++i) {
+        int least = 0;
+        for (t = 1; t < s->threads; ++t) if (load[t] < load[least]) least = t;
+        owner[i] = least;
+        load[least] += sorted[i].cost;
+        ++s->queues[least].end;
+    }
+
+    /* Lay the shares out one after the other, each still in decreasing cost. */
+    for (t = 0, i = 0; t < s->threads; ++t) {
+        s->queues[t].start = i;
+        i += s->queues[t].end;
+        s->queues[t].end = s->queues[t].start;
+    }
+    for (i = 0; i < s->count; ++i) {
+        s->order[s->queues[owner[i]].end++] = sorted[i];
+    }
+
+    mem_free(sorted);
+    mem_free(owner);
+    mem_free(load);
+    s->sorted = 1;
+    return 1;
+}
+
+
+#ifdef TE_THREADS
+#define SCHED_LOCK(q) pthread_mutex_lock(&(q)->lock)
+#define SCHED_UNLOCK(q) pthread_mutex_unlock(&(q)->lock)
+#else
+#define SCHED_LOCK(q) ((void)0)
+#define SCHED_UNLOCK(q) ((void)0)
+#endif
+
+/* Takes a batch from the expensive end of q. Returns how many tasks of the order, from *first, it took. */
+static int sched_take(te_scheduler *s, sched_queue *q, int *first) {
+    double cost = 0;
+    int taken = 0;
+
+    SCHED_LOCK(q);
+    *first = q->head;
+    while (q->head < q->tail && (taken == 0 || cost < TE_SCHED_BATCH)) {
+        cost += s->order[q->head++].cost;
+        ++taken;
+    }
+    SCHED_UNLOCK(q);
+    return taken;
+}
+
+
+/* Moves the cheaper half of another thread's queue to the queue of thread index. */
+/* Returns 0 if there was nothing left to steal. */
+static int sched_steal(te_scheduler *s, int index) {
+    int i;
+
+    for (i = 1; i < s->threads; ++i) {
+        sched_queue *victim = &s->queues[(index + i) % s->threads];
+        sched_queue *mine = &s->queues[index];
+        int head, tail;
+
+        SCHED_LOCK(victim);
+        tail = victim->tail;
+        head = victim->tail - (victim->tail - victim->head + 1) / 2;
+        victim->tail = head;
+        SCHED_UNLOCK(victim);
+
+        if (head < tail) {
+            SCHED_LOCK(mine);
+            mine->head = head;
+            mine->tail = tail;
+            SCHED_UNLOCK(mine);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void sched_work(te_scheduler *s, int index) {
+    for (;;) {
+        int first, k, taken = sched_take(s, &s->queues[index], &first);
+        if (!taken) {
+            if (!sched_steal(s, index)) return;
+            continue;
+        }
+        for (k = 0; k < taken; ++k) run_task(s, s->order[first + k].task);
+    }
+}
+
+
+#ifdef TE_THREADS
+static void *sched_thread(void *arg) {
+    sched_worker *w = arg;
+    te_scheduler *s = w->s;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->stop && s->generation == seen) pthread_cond_wait(&s->wake, &s->lock);
+        if (s->stop) break;
+        seen = s->generation;
+        pthread_mutex_unlock(&s->lock);
+
+        sched_work(s, w->index);
+
+        pthread_mutex_lock(&s->lock);
+        if (--s->running == 0) pthread_cond_signal(&s->idle);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+#endif
+
+
+te_scheduler *te_scheduler_new(int threads) {
+    te_scheduler *s = mem_calloc(1, sizeof(te_scheduler));
+    int i;
+
+    if (!s) return 0;
+#ifdef TE_THREADS
+    s->threads = threads > 1 ? threads : 1;
+#else
+    s->threads = 1;
+    (void)threads;
+#endif
+
+    s->queues = mem_calloc(s->threads, sizeof(sched_queue));
+    if (!s->queues) {
+        mem_free(s);
+        return 0;
+    }
+
+#ifdef TE_THREADS
+    for (i = 0; i < s->threads; ++i) pthread_mutex_init(&s->queues[i].lock, 0);
+    pthread_mutex_init(&s->lock, 0);
+    pthread_cond_init(&s->wake, 0);
+    pthread_cond_init(&s->idle, 0);
+
+    /* The calling thread is worker 0. */
+    s->workers = mem_calloc(s->threads, sizeof(sched_worker));
+    for (i = 1; s->workers && i < s->threads; ++i) {
+        s->workers[i].s = s;
+        s->workers[i].index = i;
+        if (pthread_create(&s->workers[i].thread, 0, sched_thread, &s->workers[i])) break;
+    }
+    if (!s->workers) i = 1;
+    /* Carry on with the threads we got. */
+    s->threads = i;
+#else
+    (void)i;
+#endif
+
+    return s;
+}
+
+
+int te_scheduler_add(te_scheduler *s, const te_expr *n, double *out) {
+    if (s->count == s->capacity) {
+        const int capacity = s->capacity ? s->capacity * 2 : 64;
+        sched_task *tasks = mem_alloc(sizeof(sched_task) * capacity);
+        sched_entry *order = mem_alloc(sizeof(sched_entry) * capacity);
+        if (!tasks || !order) {
+            mem_free(tasks);
+            mem_free(order);
+            return -1;
+        }
+        if (s->count) memcpy(tasks, s->tasks, sizeof(sched_task) * s->count);
+        mem_free(s->tasks);
+        mem_free(s->order);
+        s->tasks = tasks;
+        s->order = order;
+        s->capacity = capacity;
+    }
+
+    s->tasks[s->count].expr = n;
+    s->tasks[s->count].out = out;
+    /* At about 3 cycles per nanosecond, until it has been timed. */
+    s->tasks[s->count].cost = n ? node_cost(n) / 3 : 0;
+    s->tasks[s->count].timed = 0;
+    s->sorted = 0;
+    return s->count++;
+}
+
+
+void te_scheduler_run(te_scheduler *s) {
+    int t, i;
+
+    if (!s->count) return;
+
+    if (!s->sorted && !sched_deal(s)) {
+        /* Out of memory: run everything here, in order. */
+        for (i = 0; i < s->count; ++i) *s->tasks[i].out = te_eval(s->tasks[i].expr);
+        return;
+    }
+
+    for (t = 0; t < s->threads; ++t) {
+        s->queues[t].head = s->queues[t].start;
+        s->queues[t].tail = s->queues[t].end;
+    }
+
+#ifdef TE_THREADS
+    s->timing = s->threads > 1 && s->runs % TE_SCHED_SAMPLE == 0;
+
+    if (s->threads > 1) {
+        pthread_mutex_lock(&s->lock);
+        s->running = s->threads - 1;
+        ++s->generation;
+        pthread_cond_broadcast(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+
+        sched_work(s, 0);
+
+        pthread_mutex_lock(&s->lock);
+        while (s->running) pthread_cond_wait(&s->idle, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+    } else {
+        sched_work(s, 0);
+    }
+
+    /* New timings change the order. */
+    if (s->timing) s->sorted = 0;
+#else
+    sched_work(s, 0);
+#endif
+
+    ++s->runs;
+}
+
+
+double te_scheduler_cost(const te_scheduler *s, int task) {
+    return task >= 0 && task < s->count ? s->tasks[task].cost : NAN;
+}
+
+
+void te_scheduler_free(te_scheduler *s) {
+    if (!s) return;
+
+#ifdef TE_THREADS
+    {
+        int i;
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_broadcast(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+        for (i = 1; i < s->threads; ++i) pthread_join(s->workers[i].thread, 0);
+
+        for (i = 0; i < s->threads; ++i) pthread_mutex_destroy(&s->queues[i].lock);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->wake);
+        pthread_cond_destroy(&s->idle);
+        mem_free(s->workers);
+    }
+#endif
+
+    mem_free(s->queues);
+    mem_free(s->tasks);
+    mem_free(s->order);
+    mem_free(s);
+}
+
+#undef SCHED_LOCK
+#undef SCHED_UNLOCK
+
+
+/* Formula graphs.
+ * Formulas are compiled against the graph's variables and one more variable
+ * per formula, bound to the formula's value, so they read each other like any
+ * other variable. The addresses a formula's tree reads are its sources, and it
+ * is one of their dependents. A formula's level is one more than the highest
+ * of its sources, so recomputing queued formulas in order of level reaches
+ * each one after its sources. A formula whose value comes out the same
+ * doesn't queue its dependents. */
+
+typedef struct graph_node {
+    double value;
+    const void *address;        /* &value for formulas, the variable otherwise. */
+    char *name;                 /* 0 for variables. */
+    te_expr *expr;              /* 0 for variables. */
+    int index;
+    int level;                  /* 0 for variables. */
+    int queued;
+    unsigned long mark;         /* The last search that reached the node. */
+    int *sources, source_count;
+    int *dependents, dependent_count, dependent_capacity;
+    struct graph_node *next;    /* The next node in the same bucket. */
+} graph_node;
+
+struct te_graph {
+    te_variable *lookup;        /* The graph's variables, then one per formula. */
+    int var_count, lookup_count, lookup_capacity;
+    graph_node **nodes;
+    int *heap;                  /* Queued nodes, lowest level first. */
+    int node_count, node_capacity, queued;
+    graph_node **buckets;       /* Nodes by address. */
+    unsigned long bucket_count;
+    unsigned long mark;
+};
+
+#define GRAPH_BUCKET(g, address) ((unsigned long)((uintptr_t)(address) / sizeof(double)) % (g)->bucket_count)
+
+
+te_graph *te_graph_new(const te_variable *variables, int var_count) {
+    te_graph *g = mem_calloc(1, sizeof(te_graph));
+    if (!g) return 0;
+    g->var_count = g->lookup_count = var_count;
+    g->lookup_capacity = var_count + 16;
+    g->lookup = mem_alloc(sizeof(te_variable) * g->lookup_capacity);
+    g->bucket_count = 64;
+    g->buckets = mem_calloc(g->bucket_count, sizeof(graph_node*));
+    if (!g->lookup || !g->buckets) {
+        te_graph_free(g);
+        return 0;
+    }
+    if (var_count) memcpy(g->lookup, variables, sizeof(te_variable) * var_count);
+    return g;
+}
+
+
+static graph_node *graph_find(const te_graph *g, const void *address) {
+    graph_node *n = g->buckets[GRAPH_BUCKET(g, address)];
+    while (n && n->address != address) n = n->next;
+    return n;
+}
+
+
+static graph_node *graph_named(const te_graph *g, const char *name) {
+    int i;
+    for (i = 0; i < g->node_count; ++i) {
+        if (g->nodes[i]->name && strcmp(g->nodes[i]->name, name) == 0) return g->nodes[i];
+    }
+    return 0;
+}
+
+
+static void graph_grow_buckets(te_graph *g) {
+    const unsigned long count = g->bucket_count * 2;
+    graph_node **buckets = mem_calloc(count, sizeof(graph_node*));
+    graph_node **old = g->buckets;
+    unsigned long i;
+    if (!buckets) return;
+
+    g->buckets = buckets;
+    g->bucket_count = count;
+    for (i = 0; i < count / 2; ++i) {
+        graph_node *n = old[i];
+        while (n) {
+            graph_node *next = n->next;
+            const unsigned long b = GRAPH_BUCKET(g, n->address);
+            n->next = buckets[b];
+            buckets[b] = n;
+            n = next;
+        }
+    }
+    mem_free(old);
+}
+
+
+/* Adds n to the graph. Returns 0 if out of memory. */
+static int graph_add(te_graph *g, graph_node *n) {
+    unsigned long b;
+    if (g->node_count == g->node_capacity) {
+        const int capacity = g->node_capacity ? g->node_capacity * 2 : 64;
+        graph_node **nodes = mem_alloc(sizeof(graph_node*) * capacity);
+        int *queue = mem_alloc(sizeof(int) * capacity);
+        if (!nodes || !queue) {
+            mem_free(nodes);
+            mem_free(queue);
+            return 0;
+        }
+        if (g->node_count) {
+            memcpy(nodes, g->nodes, sizeof(graph_node*) * g->node_count);
+            memcpy(queue, g->heap, sizeof(int) * g->queued);
+        }
+        mem_free(g->nodes);
+        mem_free(g->heap);
+        g->nodes = nodes;
+        g->heap = queue;
+        g->node_capacity = capacity;
+    }
+
+    n->index = g->node_count;
+    g->nodes[g->node_count++] = n;
+    if ((unsigned long)g->node_count > g->bucket_count * 2) graph_grow_buckets(g);
+    b = GRAPH_BUCKET(g, n->address);
+    n->next = g->buckets[b];
+    g->buckets[b] = n;
+    return 1;
+}
+
+
+/* Finds or adds the node for a variable at address. */
+static graph_node *graph_input(te_graph *g, const void *address) {
+    graph_node *n = graph_find(g, address);
+    if (n) return n;
+    n = mem_calloc(1, sizeof(graph_node));
+    if (!n) return 0;
+    n->value = NAN;
+    n->address = address;
+    if (!graph_add(g, n)) {
+        mem_free(n);
+        return 0;
+    }
+    return n;
+}
+
+
+static void graph_free_node(graph_node *n) {
+    te_free(n->expr);
+    mem_free(n->name);
+    mem_free(n->sources);
+    mem_free(n->dependents);
+    mem_free(n);
+}
+
+
+/* Creates a formula and gives it the last entry of the lookup, without adding */
+/* it to the graph yet. Returns 0 if out of memory. */
+static graph_node *graph_formula(te_graph *g, const char *name) {
+    const size_t len = strlen(name);
+    graph_node *f = mem_calloc(1, sizeof(graph_node));
+    te_variable *v;
+    if (!f) return 0;
+    f->value = NAN;
+    f->address = &f->value;
+    f->name = mem_alloc(len + 1);
+    if (!f->name) {
+        graph_free_node(f);
+        return 0;
+    }
+    memcpy(f->name, name, len + 1);
+
+    if (g->lookup_count == g->lookup_capacity) {
+        const int capacity = g->lookup_capacity * 2;
+        te_variable *lookup = mem_alloc(sizeof(te_variable) * capacity);
+        if (!lookup) {
+            graph_free_node(f);
+            return 0;
+        }
+        memcpy(lookup, g->lookup, sizeof(te_variable) * g->lookup_count);
+        mem_free(g->lookup);
+        g->lookup = lookup;
+        g->lookup_capacity = capacity;
+    }
+
+    v = &g->lookup[g->lookup_count++];
+    v->name = f->name;
+    v->address = &f->value;
+    v->type = TE_VARIABLE;
+    v->context = 0;
+    return f;
+}
+
+
+/* Whether name could be read back by te_compile and isn't one of the graph's variables. */
+static int graph_valid_name(const te_graph *g, const char *name) {
+    const char *c;
+    int i;
+    if (!(name[0] >= 'a' && name[0] <= 'z')) return 0;
+    for (c = name + 1; *c; ++c) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9') || *c == '_')) return 0;
+    }
+    for (i = 0; i < g->var_count; ++i) {
+        if (strcmp(g->lookup[i].name, name) == 0) return 0;
+    }
+    return 1;
+}
+
+
+/* Lists the nodes n reads, once each, marking them with g->mark. Returns 1, */
+/* or 0 if n reads f itself, or -1 if out of memory. */
+static int graph_collect(te_graph *g, const graph_node *f, const te_expr *n, int *sources, int *count) {
+    const int op = OPCODE(n->type);
+    int i;
+
+    if (op == OP_VARIABLE || op == OP_LOAD) {
+        graph_node *s;
+        if (n->address == f->address) return 0;
+        s = graph_input(g, n->address);
+        if (!s) return -1;
+        if (s->mark != g->mark) {
+            s->mark = g->mark;
+            sources[(*count)++] = s->index;
+        }
+        return 1;
+    }
+
+    for (i = 0; i < ARITY(n->type); ++i) {
+        const int result = graph_collect(g, f, n->parameters[i], sources, count);
+        if (result != 1) return result;
+    }
+    return 1;
+}
+
+
+/* Whether a node marked sources depends on n. */
+static int graph_reaches(te_graph *g, const graph_node *n, unsigned long sources) {
+    int i;
+    for (i = 0; i < n->dependent_count; ++i) {
+        graph_node *d = g->nodes[n->dependents[i]];
+        if (d->mark == sources) return 1;
+        if (d->mark != g->mark) {
+            d->mark = g->mark;
+            if (graph_reaches(g, d, sources)) return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Makes room for one more dependent. Returns 0 if out of memory. */
+static int graph_reserve(graph_node *n) {
+    if (n->dependent_count == n->dependent_capacity) {
+        const int capacity = n->dependent_capacity ? n->dependent_capacity * 2 : 4;
+        int *dependents = mem_alloc(sizeof(int) * capacity);
+        if (!dependents) return 0;
+        if (n->dependent_count) memcpy(dependents, n->dependents, sizeof(int) * n->dependent_count);
+        mem_free(n->dependents);
+        n->dependents = dependents;
+        n->dependent_capacity = capacity;
+    }
+    return 1;
+}
+
+
+/* Puts the dependents of n above it. */
+static void graph_raise(te_graph *g, const graph_node *n) {
+    int i;
+    for (i = 0; i < n->dependent_count; ++i) {
+        graph_node *d = g->nodes[n->dependents[i]];
+        if (d->level <= n->level) {
+            d->level = n->level + 1;
+            graph_raise(g, d);
+        }
+    }
+}
+
+
+#define GRAPH_LEVEL(g, i) ((g)->nodes[(g)->heap[i]]->level)
+
+static void graph_sift_down(te_graph *g, int i) {
+    for (;;) {
+        int least = i, child = 2 * i + 1, t;
+        if (child < g->queued && GRAPH_LEVEL(g, child) < GRAPH_LEVEL(g, least)) least = child;
+        if (child + 1 < g->queued && GRAPH_LEVEL(g, child + 1) < GRAPH_LEVEL(g, least)) least = child + 1;
+        if (least == i) return;
+        t = g->heap[i];
+        g->heap[i] = g->heap[least];
+        g->heap[least] = t;
+        i = least;
+    }
+}
+
+
+static void graph_push(te_graph *g, graph_node *n) {
+    int i;
+    if (n->queued) return;
+    n->queued = 1;
+    i = g->queued++;
+    while (i > 0 && g->nodes[g->heap[(i - 1) / 2]]->level > n->level) {
+        g->heap[i] = g->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    g->heap[i] = n->index;
+}
+
+
+static graph_node *graph_pop(te_graph *g) {
+    graph_node *n = g->nodes[g->heap[0]];
+    g->heap[0] = g->heap[--g->queued];
+    graph_sift_down(g, 0);
+    n->queued = 0;
+    return n;
+}
+
+
+/* Gives f its new expression and sources, which can't fail once they're reserved. */
+static void graph_attach(te_graph *g, graph_node *f, te_expr *expr, int *sources, int count) {
+    int i, j;
+
+    for (i = 0; i < f->source_count; ++i) {
+        graph_node *s = g->nodes[f->sources[i]];
+        for (j = 0; s->dependents[j] != f->index; ++j);
+        s->dependents[j] = s->dependents[--s->dependent_count];
+    }
+    te_free(f->expr);
+    mem_free(f->sources);
+
+    f->expr = expr;
+    f->sources = sources;
+    f->source_count = count;
+    f->level = 1;
+    for (i = 0; i < count; ++i) {
+        graph_node *s = g->nodes[sources[i]];
+        s->dependents[s->dependent_count++] = f->index;
+        if (s->level >= f->level) f->level = s->level + 1;
+    }
+    graph_raise(g, f);
+}
+
+
+int te_graph_define(te_graph *g, const char *name, const char *expression, int *error) {
+    graph_node *f = graph_named(g, name);
+    const int created = f == 0;
+    te_expr *expr;
+    int *sources = 0;
+    int count = 0, result = 0, i;
+
+    if (error) *error = 0;
+    if (!graph_valid_name(g, name)) return TE_GRAPH_NAME;
+    if (created && !(f = graph_formula(g, name))) return TE_GRAPH_MEMORY;
+
+    expr = te_compile(expression, g->lookup, g->lookup_count, error);
+    if (!expr) result = TE_GRAPH_SYNTAX;
+    if (!result && !(sources = mem_alloc(sizeof(int) * count_nodes(expr)))) result = TE_GRAPH_MEMORY;
+
+    if (!result) {
+        ++g->mark;
+        switch (graph_collect(g, f, expr, sources, &count)) {
+            case 0: result = TE_GRAPH_CYCLE; break;
+            case -1: result = TE_GRAPH_MEMORY; break;
+        }
+    }
+
+    /* Redefining a formula makes a cycle if one of its new sources depends on it. */
+    if (!result && !created) {
+        const unsigned long marked = g->mark++;
+        if (graph_reaches(g, f, marked)) result = TE_GRAPH_CYCLE;
+    }
+
+    for (i = 0; !result && i < count; ++i) {
+        if (!graph_reserve(g->nodes[sources[i]])) result = TE_GRAPH_MEMORY;
+    }
+    if (!result && created && !graph_add(g, f)) result = TE_GRAPH_MEMORY;
+
+    if (result) {
+        te_free(expr);
+        mem_free(sources);
+        if (created) {
+            --g->lookup_count;
+            graph_free_node(f);
+        }
+        return result;
+    }
+
+    graph_attach(g, f, expr, sources, count);
+
+    /* Levels may have changed under nodes already queued. */
+    if (!created) {
+        for (i = g->queued / 2 - 1; i >= 0; --i) graph_sift_down(g, i);
+    }
+    graph_push(g, f);
+    return 0;
+}
+
+
+int te_graph_changed(te_graph *g, const void *address) {
+    const graph_node *n = graph_find(g, address);
+    int i;
+    if (!n) return 0;
+    for (i = 0; i < n->dependent_count; ++i) graph_push(g, g->nodes[n->dependents[i]]);
+    return n->dependent_count;
+}
+
+
+int te_graph_update(te_graph *g) {
+    int count = 0, i;
+    while (g->queued) {
+        graph_node *n = graph_pop(g);
+        const double value = te_eval(n->expr);
+        ++count;
+        if (memcmp(&value, &n->value, sizeof(value)) != 0) {
+            n->value = value;
+            for (i = 0; i < n->dependent_count; ++i) graph_push(g, g->nodes[n->dependents[i]]);
+        }
+    }
+    return count;
+}
+
+
+const double *te_graph_address(const te_graph *g, const char *name) {
+    const graph_node *f = graph_named(g, name);
+    return f ? &f->value : 0;
+}
+
+
+double te_graph_value(const te_graph *g, const char *name) {
+    const graph_node *f = graph_named(g, name);
+    return f ? f->value : NAN;
+}
+
+
+void te_graph_free(te_graph *g) {
+    int i;
+    if (!g) return;
+    for (i = 0; i < g->node_count; ++i) graph_free_node(g->nodes[i]);
+    mem_free(g->nodes);
+    mem_free(g->heap);
+    mem_free(g->buckets);
+    mem_free(g->lookup);
+    mem_free(g);
+}
+
+#undef GRAPH_LEVEL
+
+
+/* Hot-swappable handles.
+ * Reclamation is epoch based. Each reading thread has a record in a global
+ * list, holding the global epoch it read when it started reading, or 0. A
+ * writer publishes the new tree, then bumps the global epoch, and tags the
+ * old tree with the epoch before the bump. Any reader that could still see
+ * the old tree started in that epoch or earlier, so the tree is freed once
+ * every record is either 0 or later. Readers only ever store to their own
+ * record, and never wait. */
+
+typedef struct epoch_record {
+    unsigned long epoch;        /* The epoch the thread started reading in, or 0. */
+    int depth;                  /* Acquires not released yet. */
+    int claimed;                /* Whether a thread owns the record. */
+    struct epoch_record *next;
+} epoch_record;
+
+typedef struct handle_retired {
+    te_expr *expr;
+    unsigned long epoch;
+    struct handle_retired *next;
+} handle_retired;
+
+struct te_handle {
+    te_expr *expr;
+    handle_retired *retired;    /* Old trees, newest first. */
+    int writing;                /* Set by the writer holding the handle; readers never look. */
+};
+
+#if defined(__GNUC__)
+#define EPOCH_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define EPOCH_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define EPOCH_CLEAR(p) __atomic_store_n((p), 0, __ATOMIC_RELEASE)
+#define EPOCH_SWAP(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define EPOCH_BUMP(p) __atomic_fetch_add((p), 1, __ATOMIC_SEQ_CST)
+#define EPOCH_CAS(p, old, v) __sync_bool_compare_and_swap((p), (old), (v))
+#else
+#define EPOCH_LOAD(p) (*(p))
+#define EPOCH_STORE(p, v) (*(p) = (v))
+#define EPOCH_CLEAR(p) (*(p) = 0)
+#define EPOCH_SWAP(p, v) epoch_swap((p), (v))
+#define EPOCH_BUMP(p) ((*(p))++)
+#define EPOCH_CAS(p, old, v) (*(p) == (old) ? (*(p) = (v), 1) : 0)
+static te_expr *epoch_swap(te_expr **p, te_expr *v) {te_expr *old = *p; *p = v; return old;}
+#endif
+
+static unsigned long epoch_global = 1;
+static epoch_record *epoch_records = 0;
+static epoch_record epoch_fallback;
+
+#ifdef TE_THREAD_LOCAL
+static TE_THREAD_LOCAL epoch_record *epoch_mine = 0;
+
+/* The calling thread's record: one given up by a thread that has finished, or a new one. */
+static epoch_record *epoch_self(void) {
+    epoch_record *r = epoch_mine;
+    if (r) return r;
+
+    for (r = EPOCH_LOAD(&epoch_records); r; r = r->next) {
+        if (!EPOCH_LOAD(&r->claimed) && EPOCH_CAS(&r->claimed, 0, 1)) break;
+    }
+    if (!r) {
+        /* Records are never freed, so they don't go through the allocator. */
+        r = calloc(1, sizeof(epoch_record));
+        if (!r) return &epoch_fallback;
+        r->claimed = 1;
+        do {
+            r->next = EPOCH_LOAD(&epoch_records);
+        } while (!EPOCH_CAS(&epoch_records, r->next, r));
+    }
+    epoch_mine = r;
+    return r;
+}
+#else
+#define epoch_self() (&epoch_fallback)
+#endif
+
+
+/* The earliest epoch a reader started in, or ULONG_MAX if none is reading. */
+static unsigned long epoch_oldest(void) {
+    unsigned long oldest = ULONG_MAX, e;
+    const epoch_record *r;
+    for (r = &epoch_fallback; r; r = (r == &epoch_fallback) ? EPOCH_LOAD(&epoch_records) : r->next) {
+        e = EPOCH_LOAD(&r->epoch);
+        if (e && e < oldest) oldest = e;
+    }
+    return oldest;
+}
+
+
+/* Writers take turns by spinning on the handle's flag. That needs no threads */
+/* library, so they wait for each other in every build, and they're rare. */
+static void handle_lock(te_handle *h) {
+    while (EPOCH_LOAD(&h->writing) || !EPOCH_CAS(&h->writing, 0, 1));
+}
+
+static void handle_unlock(te_handle *h) {
+    EPOCH_CLEAR(&h->writing);
+}
+
+
+/* Frees the old trees no reader can see. Returns how many are left. Needs the writers' lock. */
+static int handle_reclaim(te_handle *h) {
+    const unsigned long oldest = epoch_oldest();
+    handle_retired **link = &h->retired;
+    int left = 0;
+    while (*link) {
+        handle_retired *r = *link;
+        if (r->epoch < oldest) {
+            *link = r->next;
+            te_free(r->expr);
+            mem_free(r);
+        } else {
+            link = &r->next;
+            ++left;
+        }
+    }
+    return left;
+}
+
+
+te_handle *te_handle_new(te_expr *n) {
+    te_handle *h = mem_alloc(sizeof(te_handle));
+    if (!h) return 0;
+    h->expr = n;
+    h->retired = 0;
+    h->writing = 0;
+    return h;
+}
+
+
+const te_expr *te_handle_acquire(te_handle *h) {
+    epoch_record *r = epoch_self();
+    if (r->depth++ == 0) EPOCH_STORE(&r->epoch, EPOCH_LOAD(&epoch_global));
+    return EPOCH_LOAD(&h->expr);
+}
+
+
+void te_handle_release(te_handle *h) {
+    epoch_record *r = epoch_self();
+    (void)h;
+    if (--r->depth == 0) EPOCH_CLEAR(&r->epoch);
+}
+
+
+double te_handle_eval(te_handle *h) {
+    const double ret = te_eval(te_handle_acquire(h));
+    te_handle_release(h);
+    return ret;
+}
+
+
+int te_handle_swap(te_handle *h, te_expr *n) {
+    handle_retired *r = mem_alloc(sizeof(handle_retired));
+    int left;
+    if (!r) return -1;
+
+    handle_lock(h);
+    r->expr = EPOCH_SWAP(&h->expr, n);
+    r->epoch = EPOCH_BUMP(&epoch_global);
+    r->next = h->retired;
+    h->retired = r;
+    left = handle_reclaim(h);
+    handle_unlock(h);
+    return left;
+}
+
+
+int te_handle_reclaim(te_handle *h) {
+    int left;
+    handle_lock(h);
+    left = handle_reclaim(h);
+    handle_unlock(h);
+    return left;
+}
+
+
+void te_handle_thread_done(void) {
+#ifdef TE_THREAD_LOCAL
+    epoch_record *r = epoch_mine;
+    if (r && r != &epoch_fallback) {
+        r->depth = 0;
+        EPOCH_CLEAR(&r->epoch);
+        EPOCH_CLEAR(&r->claimed);
+    }
+    epoch_mine = 0;
+#endif
+}
+
+
+void te_handle_free(te_handle *h) {
+    handle_retired *r;
+    if (!h) return;
+    while ((r = h->retired)) {
+        h->retired = r->next;
+        te_free(r->expr);
+        mem_free(r);
+    }
+    te_free(h->expr);
+    mem_free(h);
+}
+
+#undef EPOCH_LOAD
+#undef EPOCH_STORE
+#undef EPOCH_CLEAR
+#undef EPOCH_SWAP
+#undef EPOCH_BUMP
+#undef EPOCH_CAS
+
+
+/* Interval evaluation.
+ * Every result is widened outward by a couple of ulps so that rounding in the
+ * operators and in libm can't make the bounds miss the true range. Points at
+ * which a function is undefined are ignored; if the whole input lies outside
+ * the domain the result is NaN. */
+
+#define IV_PI 3.14159265358979323846
+
+static te_interval iv(double lower, double upper) {
+    te_interval r;
+    r.lower = lower;
+    r.upper = upper;
+    return r;
+}
+
+static int iv_nan(te_interval x) {return x.lower != x.lower || x.upper != x.upper;}
+static int iv_finite(double a) {return a - a == 0;}
+static double iv_min(double a, double b) {return a < b ? a : b;}
+static double iv_max(double a, double b) {return a > b ? a : b;}
+
+static te_interval iv_widen(te_interval x) {
+    if (iv_nan(x)) return iv(NAN, NAN);
+    if (iv_finite(x.lower)) x.lower -= fabs(x.lower) * 2 * DBL_EPSILON + DBL_MIN;
+    if (iv_finite(x.upper)) x.upper += fabs(x.upper) * 2 * DBL_EPSILON + DBL_MIN;
+    return x;
+}
+
+static te_interval iv_clamp(te_interval x, double lower, double upper) {
+    return iv(iv_max(x.lower, lower), iv_min(x.upper, upper));
+}
+
+/* Applies a function that is nondecreasing on [lower, upper] and undefined outside it. */
+static te_interval iv_increasing(double (*f)(double), te_interval x, double lower, double upper) {
+    x = iv_clamp(x, lower, upper);
+    if (x.lower > x.upper) return iv(NAN, NAN);
+    return iv_widen(iv(f(x.lower), f(x.upper)));
+}
+
+static te_interval iv_exp(te_interval x) {return iv_increasing(exp, x, -INFINITY, INFINITY);}
+static te_interval iv_log(te_interval x) {return iv_increasing(log, x, 0, INFINITY);}
+static te_interval iv_log10(te_interval x) {return iv_increasing(log10, x, 0, INFINITY);}
+static te_interval iv_sqrt(te_interval x) {return iv_increasing(sqrt, x, 0, INFINITY);}
+static te_interval iv_asin(te_interval x) {return iv_increasing(asin, x, -1, 1);}
+static te_interval iv_atan(te_interval x) {return iv_increasing(atan, x, -INFINITY, INFINITY);}
+static te_interval iv_sinh(te_interval x) {return iv_increasing(sinh, x, -INFINITY, INFINITY);}
+static te_interval iv_ceil(te_interval x) {return iv_increasing(ceil, x, -INFINITY, INFINITY);}
+static te_interval iv_floor(te_interval x) {return iv_increasing(floor, x, -INFINITY, INFINITY);}
+static te_interval iv_fac(te_interval x) {return iv_increasing(fac, x, 0, INFINITY);}
+
+static te_interval iv_tanh(te_interval x) {
+    return iv_clamp(iv_increasing(tanh, x, -INFINITY, INFINITY), -1, 1);
+}
+
+static te_interval iv_acos(te_interval x) {
+    x = iv_clamp(x, -1, 1);
+    if (x.lower > x.upper) return iv(NAN, NAN);
+    return iv_widen(iv(acos(x.upper), acos(x.lower)));
+}
+
+static te_interval iv_negate(te_interval x) {return iv(-x.upper, -x.lower);}
+
+static te_interval iv_abs(te_interval x) {
+    if (x.lower >= 0) return x;
+    if (x.upper <= 0) return iv_negate(x);
+    return iv(0, iv_max(-x.lower, x.upper));
+}
+
+static te_interval iv_cosh(te_interval x) {
+    return iv_increasing(cosh, iv_abs(x), 0, INFINITY);
+}
+
+/* Sine-like functions: maxima at peak + 2k*pi, minima at peak + (2k+1)*pi. */
+static te_interval iv_periodic(double (*f)(double), te_interval x, double peak) {
+    te_interval r;
+    double k;
+    if (!iv_finite(x.lower) || !iv_finite(x.upper) || x.upper - x.lower >= 2 * IV_PI) return iv(-1, 1);
+    r = iv(iv_min(f(x.lower), f(x.upper)), iv_max(f(x.lower), f(x.upper)));
+    k = ceil((x.lower - peak) / (2 * IV_PI));
+    if (peak + 2 * IV_PI * k <= x.upper) r.upper = 1;
+    k = ceil((x.lower - peak - IV_PI) / (2 * IV_PI));
+    if (peak + IV_PI + 2 * IV_PI * k <= x.upper) r.lower = -1;
+    return iv_clamp(iv_widen(r), -1, 1);
+}
+
+static te_interval iv_sin(te_interval x) {return iv_periodic(sin, x, IV_PI / 2);}
+static te_interval iv_cos(te_interval x) {return iv_periodic(cos, x, 0);}
+
+static te_interval iv_tan(te_interval x) {
+    double k;
+    if (!iv_finite(x.lower) || !iv_finite(x.upper) || x.upper - x.lower >= IV_PI) return iv(-INFINITY, INFINITY);
+    k = ceil((x.lower - IV_PI / 2) / IV_PI);
+    if (IV_PI / 2 + IV_PI * k <= x.upper) return iv(-INFINITY, INFINITY);
+    return iv_widen(iv(tan(x.lower), tan(x.upper)));
+}
+
+static te_interval iv_add(te_interval a, te_interval b) {
+    return iv_widen(iv(a.lower + b.lower, a.upper + b.upper));
+}
+
+static te_interval iv_sub(te_interval a, te_interval b) {
+    return iv_widen(iv(a.lower - b.upper, a.upper - b.lower));
+}
+
+/* Takes 0 * inf as 0, which is right for bounds. */
+static double iv_product(double a, double b) {
+    const double p = a * b;
+    return p == p ? p : 0;
+}
+
+static te_interval iv_mul(te_interval a, te_interval b) {
+    const double p1 = iv_product(a.lower, b.lower), p2 = iv_product(a.lower, b.upper);
+    const double p3 = iv_product(a.upper, b.lower), p4 = iv_product(a.upper, b.upper);
+    return iv_widen(iv(iv_min(iv_min(p1, p2), iv_min(p3, p4)), iv_max(iv_max(p1, p2), iv_max(p3, p4))));
+}
+
+static te_interval iv_divide(te_interval a, te_interval b) {
+    if (b.lower == 0 && b.upper == 0) return iv(NAN, NAN);
+    if (b.lower < 0 && b.upper > 0) return iv(-INFINITY, INFINITY);
+    if (b.lower == 0 || b.upper == 0) {
+        /* One end of the divisor touches zero, so one bound runs to infinity. */
+        const double far = b.lower == 0 ? b.upper : b.lower;
+        if (a.lower >= 0 && far > 0) return iv_widen(iv(a.lower / far, INFINITY));
+        if (a.upper <= 0 && far > 0) return iv_widen(iv(-INFINITY, a.upper / far));
+        if (a.lower >= 0 && far < 0) return iv_widen(iv(-INFINITY, a.lower / far));
+        if (a.upper <= 0 && far < 0) return iv_widen(iv(a.upper / far, INFINITY));
+        return iv(-INFINITY, INFINITY);
+    }
+    {
+        const double q1 = a.lower / b.lower, q2 = a.lower / b.upper;
+        const double q3 = a.upper / b.lower, q4 = a.upper / b.upper;
+        return iv_widen(iv(iv_min(iv_min(q1, q2), iv_min(q3, q4)), iv_max(iv_max(q1, q2), iv_max(q3, q4))));
+    }
+}
+
+static te_interval iv_pow(te_interval a, te_interval b) {
+    /* |a|^b is monotonic in each argument, so its extremes are at the corners. */
+    const te_interval m = iv_abs(a);
+    const double p1 = pow(m.lower, b.lower), p2 = pow(m.lower, b.upper);
+    const double p3 = pow(m.upper, b.lower), p4 = pow(m.upper, b.upper);
+    const te_interval r = iv_widen(iv(iv_min(iv_min(p1, p2), iv_min(p3, p4)), iv_max(iv_max(p1, p2), iv_max(p3, p4))));
+
+    if (a.lower >= 0) return r;
+
+    /* Negative bases are only defined for integer exponents. */
+    if (b.lower == b.upper && b.lower == floor(b.lower)) {
+        if (fmod(b.lower, 2) == 0) return r;
+        if (a.upper <= 0) return iv_negate(r);
+    }
+    return iv(-r.upper, r.upper);
+}
+
+static te_interval iv_fmod(te_interval a, te_interval b) {
+    const double m = iv_max(fabs(b.lower), fabs(b.upper));
+    if (a.lower == a.upper && b.lower == b.upper) return iv_widen(iv(fmod(a.lower, b.lower), fmod(a.lower, b.lower)));
+    if (m == 0) return iv(NAN, NAN);
+    if (a.lower >= 0) return iv(0, iv_min(a.upper, m));
+    if (a.upper <= 0) return iv(-iv_min(-a.lower, m), 0);
+    return iv(-iv_min(-a.lower, m), iv_min(a.upper, m));
+}
+
+static te_interval iv_comma(te_interval a, te_interval b) {(void)a; return b;}
+
+static te_interval iv_atan2(te_interval y, te_interval x) {
+    /* The angle range of a box not containing the origin or crossing the
+     * branch cut on the negative x axis is spanned by its corners. */
+    if (x.lower < 0 && y.lower <= 0 && y.upper >= 0) return iv(-IV_PI, IV_PI);
+    if (x.lower <= 0 && x.upper >= 0 && y.lower <= 0 && y.upper >= 0) return iv(-IV_PI, IV_PI);
+    {
+        const double a1 = atan2(y.lower, x.lower), a2 = atan2(y.lower, x.upper);
+        const double a3 = atan2(y.upper, x.lower), a4 = atan2(y.upper, x.upper);
+        return iv_widen(iv(iv_min(iv_min(a1, a2), iv_min(a3, a4)), iv_max(iv_max(a1, a2), iv_max(a3, a4))));
+    }
+}
+
+static te_interval iv_ncr(te_interval n, te_interval r) {
+    /* ncr(n, r) is at least 1 where defined, and peaks at r = n/2. */
+    if (n.upper < 0 || r.upper < 0 || n.upper < r.lower) return iv(NAN, NAN);
+    if (n.lower == n.upper && r.lower == r.upper) return iv_widen(iv(ncr(n.lower, r.lower), ncr(n.lower, r.lower)));
+    return iv_widen(iv(1, ncr(n.upper, floor(n.upper / 2))));
+}
+
+static te_interval iv_npr(te_interval n, te_interval r) {
+    /* npr(n, r) is nondecreasing in both arguments where defined. */
+    if (n.upper < 0 || r.upper < 0 || n.upper < r.lower) return iv(NAN, NAN);
+    if (n.lower == n.upper && r.lower == r.upper) return iv_widen(iv(npr(n.lower, r.lower), npr(n.lower, r.lower)));
+    return iv_widen(iv(1, npr(n.upper, iv_min(r.upper, n.upper))));
+}
+
+typedef te_interval (*te_interval_fun1)(te_interval);
+typedef te_interval (*te_interval_fun2)(te_interval, te_interval);
+
+static const struct {
+    const void *function;
+    const void *interval;
+} interval_builtins[] = {
+    {fabs, iv_abs}, {acos, iv_acos}, {asin, iv_asin}, {atan, iv_atan},
+    {ceil, iv_ceil}, {cos, iv_cos}, {cosh, iv_cosh}, {exp, iv_exp},
+    {fac, iv_fac}, {floor, iv_floor}, {log, iv_log}, {log10, iv_log10},
+    {sin, iv_sin}, {sinh, iv_sinh}, {sqrt, iv_sqrt}, {tan, iv_tan},
+    {tanh, iv_tanh}, {negate, iv_negate},
+
+    {add, iv_add}, {sub, iv_sub}, {mul, iv_mul}, {divide, iv_divide},
+    {pow, iv_pow}, {fmod, iv_fmod}, {comma, iv_comma}, {atan2, iv_atan2},
+    {ncr, iv_ncr}, {npr, iv_npr},
+    {0, 0}
+};
+
+
+
+
+/* Smallest and largest magnitude in x, for hypot. */
+static double iv_least(te_interval x) {return x.lower > 0 ? x.lower : x.upper < 0 ? -x.upper : 0;}
+static double iv_most(te_interval x) {return iv_max(fabs(x.lower), fabs(x.upper));}
+
+/* Variadic builtins are monotonic in each argument, or in its magnitude for hypot. */
+static te_interval iv_nary(const te_expr *n, const te_interval_binding *bindings, int binding_count) {
+    const int op = OPCODE(n->type), count = ARITY(n->type);
+    double low_scale = 0, low_ssq = 0, high_scale = 0, high_ssq = 0;
+    te_interval r = iv(0, 0);
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        const te_interval x = te_eval_interval(n->parameters[i], bindings, binding_count);
+        if (iv_nan(x)) return iv(NAN, NAN);
+        if (i == 0 && op != OP_HYPOT) {
+            r = x;
+            continue;
+        }
+        switch (op) {
+            case OP_MIN: r = iv(iv_min(r.lower, x.lower), iv_min(r.upper, x.upper)); break;
+            case OP_MAX: r = iv(iv_max(r.lower, x.lower), iv_max(r.upper, x.upper)); break;
+            case OP_PROD: r = iv_mul(r, x); break;
+            case OP_HYPOT:
+                hypot_step(&low_scale, &low_ssq, iv_least(x));
+                hypot_step(&high_scale, &high_ssq, iv_most(x));
+                break;
+            default: r = iv_add(r, x); break;
+        }
+    }
+
+    switch (op) {
+        case OP_AVG: return iv_divide(r, iv(count, count));
+        case OP_HYPOT: return iv_clamp(iv_widen(iv(hypot_result(low_scale, low_ssq), hypot_result(high_scale, high_ssq))), 0, INFINITY);
+        default: return r;
+    }
+}
+
+
+te_interval te_eval_interval(const te_expr *n, const te_interval_binding *bindings, int binding_count) {
+    te_interval args[7];
+    double points[7];
+    int arity, i, point = 1;
+
+    if (!n) return iv(NAN, NAN);
+
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return iv(n->value, n->value);
+
+        case TE_VARIABLE:
+            for (i = 0; i < binding_count; ++i) {
+                if (bindings[i].address == n->bound) return bindings[i].range;
+            }
+            return OPCODE(n->type) == OP_LOAD ? iv(load(n), load(n)) : iv(*n->bound, *n->bound);
+
+        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+            if (IS_NARY(OPCODE(n->type))) return iv_nary(n, bindings, binding_count);
+            arity = ARITY(n->type);
+            for (i = 0; i < arity; ++i) {
+                args[i] = te_eval_interval(n->parameters[i], bindings, binding_count);
+                if (iv_nan(args[i]) && n->function != comma) return iv(NAN, NAN);
+                if (args[i].lower != args[i].upper) point = 0;
+                points[i] = args[i].lower;
+            }
+
+            for (i = 0; i < binding_count; ++i) {
+                if (bindings[i].address == n->function && bindings[i].function) {
+                    return bindings[i].function(IS_CLOSURE(n->type) ? n->parameters[arity] : 0, args);
+                }
+            }
+
+            if (!IS_CLOSURE(n->type)) {
+                for (i = 0; interval_builtins[i].function; ++i) {
+                    if (interval_builtins[i].function != n->function) continue;
+                    if (arity == 1) return ((te_interval_fun1)interval_builtins[i].interval)(args[0]);
+                    if (arity == 2) return ((te_interval_fun2)interval_builtins[i].interval)(args[0], args[1]);
+                }
+            }
+
+            /* Without an interval version, a pure function can still be
+             * evaluated on a single point. Anything else could return anything. */
+            if (point && IS_PURE(n->type)) {
+                const double r = call_function(n, points);
+                return iv_widen(iv(r, r));
+            }
+            return iv(-INFINITY, INFINITY);
+
+        default: return iv(NAN, NAN);
+    }
+}
+
+
+
+/* Approximation.
+ * The range is cut into segments of equal width, so that finding the segment
+ * of a point is one multiply. On each segment the expression is sampled at
+ * the Chebyshev nodes and interpolated, and the series is cut short where the
+ * rest of its terms can't add up to a quarter of the tolerance. The series is
+ * then rewritten in powers, so that evaluating it takes one multiply-add per
+ * term, and the result is checked against te_eval at points between the
+ * nodes. If it's off by more than the tolerance anywhere, the number of
+ * segments is doubled. The degree is kept low both for speed and so that the
+ * rewrite loses little to rounding; the check sees whatever it does lose. */
+
+#define APPROX_NODES 9              /* Nodes per segment, one more than the highest degree. */
+#define APPROX_CHECKS 4             /* Points checked per node. */
+#define APPROX_MAX_SEGMENTS 4096
+
+struct te_approximation {
+    double lower, upper;
+    double scale;                   /* Segments per unit of the variable. */
+    int segments, degree;
+    double error;
+    double *coefficients;           /* degree + 1 powers of t in [-1, 1] per segment, lowest first. */
+};
+
+
+double te_approximation_eval(const te_approximation *a, double x) {
+    const double *c;
+    double t, r;
+    int i, k;
+    if (!(x >= a->lower && x <= a->upper)) return NAN;
+    t = (x - a->lower) * a->scale;
+    i = (int)t;
+    if (i >= a->segments) i = a->segments - 1;
+    t = 2 * (t - i) - 1;
+    c = a->coefficients + i * (a->degree + 1);
+    r = c[a->degree];
+    for (k = a->degree - 1; k >= 0; --k) r = r * t + c[k];
+    return r;
+}
+
+
+/* Fills c with the Chebyshev series of n over [from, to]. Returns the degree needed */
+/* for tolerance, or -1 if the expression isn't finite at a node. */
+static int approx_segment(const te_expr *n, double *variable, double from, double to, double tolerance, double *c) {
+    const double middle = (from + to) / 2, half = (to - from) / 2;
+    double f[APPROX_NODES], tail = 0;
+    int j, k;
+
+    for (j = 0; j < APPROX_NODES; ++j) {
+        *variable = middle + half * cos(IV_PI * (j + 0.5) / APPROX_NODES);
+        f[j] = te_eval(n);
+        if (!iv_finite(f[j])) return -1;
+    }
+
+    for (k = 0; k < APPROX_NODES; ++k) {
+        double sum = 0;
+        for (j = 0; j < APPROX_NODES; ++j) sum += f[j] * cos(IV_PI * k * (j + 0.5) / APPROX_NODES);
+        c[k] = sum * (k ? 2.0 : 1.0) / APPROX_NODES;
+    }
+
+    for (k = APPROX_NODES - 1; k > 0; --k) {
+        tail += fabs(c[k]);
+        if (tail > tolerance / 4) break;
+    }
+    return k;
+}
+
+
+/* Rewrites the Chebyshev series c in powers of t. */
+static void approx_powers(double *c, int degree) {
+    double powers[APPROX_NODES], previous[APPROX_NODES], current[APPROX_NODES];
+    int j, k;
+
+    for (j = 0; j <= degree; ++j) powers[j] = previous[j] = current[j] = 0;
+    previous[0] = 1;
+    powers[0] = c[0];
+    if (degree > 0) {
+        current[1] = 1;
+        powers[1] = c[1];
+    }
+
+    /* T(k) = 2t T(k-1) - T(k-2), updated from the top so each term reads the old ones. */
+    for (k = 2; k <= degree; ++k) {
+        for (j = k; j >= 0; --j) {
+            const double next = (j ? 2 * current[j - 1] : 0) - previous[j];
+            previous[j] = current[j];
+            current[j] = next;
+            powers[j] += c[k] * next;
+        }
+    }
+    for (j = 0; j <= degree; ++j) c[j] = powers[j];
+}
+
+
+/* Returns the largest difference between a and n at the checked points, or NaN */
+/* if n isn't finite at one of them. */
+static double approx_check(const te_approximation *a, const te_expr *n, double *variable) {
+    const int count = a->segments * APPROX_NODES * APPROX_CHECKS;
+    const double step = (a->upper - a->lower) / count;
+    double error = 0;
+    int i;
+
+    for (i = 0; i <= count; ++i) {
+        const double x = i == count ? a->upper : a->lower + i * step;
+        double f, d;
+        *variable = x;
+        f = te_eval(n);
+        if (!iv_finite(f)) return NAN;
+        d = fabs(te_approximation_eval(a, x) - f);
+        if (d > error) error = d;
+    }
+    return error;
+}
+
+
+te_approximation *te_approximate(const te_expr *n, double *variable, double lower, double upper, double tolerance) {
+    const double saved = variable ? *variable : 0;
+    te_approximation *a = 0;
+    double error;
+    int segments, i, k;
+
+    if (!n || !variable || !(lower < upper) || !iv_finite(upper - lower) || !(tolerance > 0)) return 0;
+
+    for (segments = 1; segments <= APPROX_MAX_SEGMENTS; segments *= 2) {
+        const double width = (upper - lower) / segments;
+        int degree = 0;
+
+        a = mem_alloc(sizeof(te_approximation) + sizeof(double) * segments * APPROX_NODES);
+        if (!a) break;
+        a->lower = lower;
+        a->upper = upper;
+        a->scale = segments / (upper - lower);
+        a->segments = segments;
+        a->coefficients = (double*)(a + 1);
+
+        for (i = 0; i < segments; ++i) {
+            const double from = lower + i * width, to = i == segments - 1 ? upper : from + width;
+            const int d = approx_segment(n, variable, from, to, tolerance, a->coefficients + i * APPROX_NODES);
+            if (d < 0) break;
+            if (d > degree) degree = d;
+        }
+        if (i < segments) {
+            mem_free(a);
+            a = 0;
+            break;
+        }
+
+        /* Every segment gets the highest degree any needs, so evaluation is one loop. */
+        a->degree = degree;
+        for (i = 0; i < segments; ++i) {
+            for (k = 0; k <= degree; ++k) a->coefficients[i * (degree + 1) + k] = a->coefficients[i * APPROX_NODES + k];
+            approx_powers(a->coefficients + i * (degree + 1), degree);
+        }
+
+        a->error = approx_check(a, n, variable);
+        if (a->error <= tolerance) break;
+        error = a->error;
+        mem_free(a);
+        a = 0;
+        /* A point where the expression isn't finite won't go away with more segments. */
+        if (error != error) break;
+    }
+
+    *variable = saved;
+    return a;
+}
+
+
+void te_approximation_get_stats(const te_approximation *a, te_approximation_stats *stats) {
+    stats->segments = a->segments;
+    stats->degree = a->degree;
+    stats->error = a->error;
+}
+
+
+void te_approximation_free(te_approximation *a) {
+    mem_free(a);
+}
+
+#undef APPROX_NODES
+#undef APPROX_CHECKS
+#undef APPROX_MAX_SEGMENTS
+
+
+static void pn (const te_expr *n, int depth, int costs) {
+    int i, arity;
+    if (costs) printf("%8.0f ", node_cost(n));
+    printf("%*s", depth, "");
+
+    switch(TYPE_MASK(n->type)) {
+    case TE_CONSTANT: printf("%f\n", n->value); break;
+    case TE_VARIABLE: printf("bound %p\n", n->bound); break;
+
+    case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
+    case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+    case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
+    case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+         arity = ARITY(n->type);
+         printf("f%d", arity);
+         for(i = 0; i < arity; i++) {
+             printf(" %p", n->parameters[i]);
+         }
+         printf("\n");
+         for(i = 0; i < arity; i++) {
+             pn(n->parameters[i], depth + 1, costs);
+         }
+         break;
+    }
+}
+
+
+void te_print(const te_expr *n) {
+    pn(n, 0, 0);
+}
+
+
+void te_print_analysis(const te_expr *n) {
+    const te_analysis a = te_analyze(n);
+    if (!n) return;
+    pn(n, 0, 1);
+    printf("nodes %d, depth %d, variables %d, bytes %lu\n", a.nodes, a.depth, a.variables, a.bytes);
+    printf("calls: %d builtin, %d pow, %d function, %d closure\n", a.builtin_calls, a.pow_calls, a.function_calls, a.closure_calls);
+    printf("estimated cost %.0f cycles\n", a.cost);
+}
+
+
+#ifdef TE_PROFILE
+static void profile_node(const te_expr *n, const char *expression, double total, int depth) {
+    const te_profile *p = &n->profile;
+    const int arity = ARITY(n->type);
+    int i;
+
+    printf("%10lu %14.0f %14.0f %6.1f%%  %*s", p->calls, p->inclusive, p->exclusive,
+            total > 0 ? p->exclusive * 100.0 / total : 0.0, depth * 2, "");
+
+    if (expression && p->end > p->start) {
+        printf("%.*s", p->end - p->start, expression + p->start);
+    } else {
+        switch(TYPE_MASK(n->type)) {
+            case TE_CONSTANT: printf("%g", n->value); break;
+            case TE_VARIABLE: printf("bound %p", (void*)n->bound); break;
+            default: printf("f%d", arity); break;
+        }
+    }
+    printf("\n");
+
+    for (i = 0; i < arity; i++) {
+        profile_node(n->parameters[i], expression, total, depth + 1);
+    }
+}
+#endif
+
+
+void te_profile_report(const te_expr *n, const char *expression) {
+#ifdef TE_PROFILE
+    if (!n) return;
+    printf("%10s %14s %14s %7s  %s\n", "calls", "inclusive", "exclusive", "self", "node");
+    profile_node(n, expression, n->profile.inclusive, 0);
+#else
+    (void)expression;
+    printf("Build with TE_PROFILE to collect per-node costs.\n");
+    te_print(n);
+#endif
+}
+
+
+void te_profile_reset(te_expr *n) {
+#ifdef TE_PROFILE
+    const int arity = n ? ARITY(n->type) : 0;
+    int i;
+    if (!n) return;
+    n->profile.calls = 0;
+    n->profile.inclusive = 0;
+    n->profile.exclusive = 0;
+    for (i = 0; i < arity; i++) {
+        te_profile_reset(n->parameters[i]);
+    }
+#else
+    (void)n;
+#endif
 }
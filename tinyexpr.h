@@ -26,15 +26,28 @@
 #define __TINYEXPR_H__
 
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
 
+/* Costs te_eval collects for each node when built with TE_PROFILE. */
+typedef struct te_profile {
+    unsigned long calls;
+    double inclusive;   /* Cycles spent in the node and its children. */
+    double exclusive;   /* Cycles spent in the node itself. */
+    int start, end;     /* The node's span in the expression string. */
+} te_profile;
+
 typedef struct te_expr {
     int type;
-    union {double value; const double *bound; const void *function;};
+    union {double value; const double *bound; const void *function; const void *address;};
+#ifdef TE_PROFILE
+    te_profile profile;
+#endif
     void *parameters[1];
 } te_expr;
 
@@ -48,9 +61,32 @@ enum {
     TE_CLOSURE0 = 16, TE_CLOSURE1, TE_CLOSURE2, TE_CLOSURE3,
     TE_CLOSURE4, TE_CLOSURE5, TE_CLOSURE6, TE_CLOSURE7,
 
-    TE_FLAG_PURE = 32
+    TE_FLAG_PURE = 32,
+
+    /* Functions that compute many rows per call, see te_vecfun. */
+    TE_FLAG_VECTOR = 64,
+
+    TE_VECFUNCTION1 = TE_FUNCTION1 | TE_FLAG_VECTOR, TE_VECFUNCTION2, TE_VECFUNCTION3,
+    TE_VECFUNCTION4, TE_VECFUNCTION5, TE_VECFUNCTION6, TE_VECFUNCTION7,
+
+    TE_VECCLOSURE1 = TE_CLOSURE1 | TE_FLAG_VECTOR, TE_VECCLOSURE2, TE_VECCLOSURE3,
+    TE_VECCLOSURE4, TE_VECCLOSURE5, TE_VECCLOSURE6, TE_VECCLOSURE7,
+
+    /* Pure scalar functions and closures whose results are worth caching, */
+    /* see te_set_memo_size. Use together with TE_FLAG_PURE. */
+    TE_FLAG_MEMO = 512,
+
+    /* Element types of variables and columns. A variable of type TE_FLOAT */
+    /* points at a float, and so on. Values are converted to double as they're read. */
+    TE_DOUBLE = 0, TE_FLOAT = 128, TE_INT32 = 256, TE_INT64 = 384
 };
 
+/* Vector functions set out[i] from args[0][i] .. args[arity-1][i] for i < count. */
+/* te_eval_array calls them once per block of rows; te_eval calls them with count 1. */
+/* out never overlaps args. */
+typedef void (*te_vecfun)(const double *const *args, int count, double *out);
+typedef void (*te_vecclosure)(void *context, const double *const *args, int count, double *out);
+
 typedef struct te_variable {
     const char *name;
     const void *address;
@@ -71,9 +107,394 @@ te_expr *te_compile(const char *expression, const te_variable *variables, int va
 /* Evaluates the expression. */
 double te_eval(const te_expr *n);
 
+/* Calls of prev, delta, ema and sma keep state in the expression, and each */
+/* te_eval is one step of them, so such an expression can't be evaluated from */
+/* several threads at once. This starts them over as if nothing had been seen. */
+void te_reset(te_expr *n);
+
+/* Bounds on what compiling one expression may use. 0 means no limit. */
+typedef struct te_limits {
+    int max_length;             /* Characters of input read. */
+    int max_nodes;              /* Nodes allocated by the parser. */
+    int max_depth;              /* Nesting of parentheses and function calls. */
+    unsigned long max_bytes;    /* Bytes of nodes and time-series state allocated by the parser. */
+} te_limits;
+
+/* Reasons te_compile_limited fails. */
+enum {
+    TE_ERROR_NONE = 0, TE_ERROR_SYNTAX,
+    TE_ERROR_LENGTH, TE_ERROR_NODES, TE_ERROR_DEPTH, TE_ERROR_BYTES,
+    TE_ERROR_MEMORY
+};
+
+/* Like te_compile, but gives up as soon as a limit is passed. */
+/* error is set to the position as with te_compile, and reason to one of the */
+/* TE_ERROR codes, if they are not 0. */
+te_expr *te_compile_limited(const char *expression, const te_variable *variables, int var_count,
+        const te_limits *limits, int *error, int *reason);
+
+typedef struct te_allocator {
+    void *(*alloc)(void *context, size_t size);
+    void (*free)(void *context, void *block);
+    void *context;
+} te_allocator;
+
+/* Routes all of the library's memory through allocator, or back to malloc and free if it's 0. */
+/* Set it before compiling anything: memory must be freed by the allocator it came from. */
+void te_set_allocator(const te_allocator *allocator);
+
+/* Like te_compile, but the nodes of the expression come from allocator, which */
+/* must stay valid until te_free. If allocator is 0 this is the same as te_compile. */
+te_expr *te_compile_with(const te_allocator *allocator, const char *expression, const te_variable *variables, int var_count, int *error);
+
+/* Keeps up to max_nodes freed nodes of each size per thread, to be reused by the */
+/* next compile on that thread instead of going to the allocator. 0 turns pools off, */
+/* which is the default. */
+void te_set_node_pool(int max_nodes);
+
+/* Gives the nodes pooled by the calling thread back to the allocator. */
+/* Call it before a thread that has compiled expressions exits. */
+void te_pool_drain(void);
+
+/* Each thread caches results of TE_FLAG_MEMO functions, keyed on the function, */
+/* its context and the bits of its arguments. Sets the entries per thread, */
+/* rounded up to a power of two. 0 turns memoization off. The default is 1024. */
+void te_set_memo_size(int entries);
+
+/* Forgets every memoized result on all threads, as when a closure's context */
+/* has changed. The calling thread's cache is freed: call it before a thread */
+/* that has evaluated memoized functions exits. */
+void te_memo_clear(void);
+
+/* Counts the memo cache lookups made so far by the calling thread: hits were */
+/* answered from the cache, misses called the function. */
+void te_memo_counts(unsigned long *hits, unsigned long *misses);
+
+
+typedef struct te_column {
+    const void *address;
+    const void *values;
+    int type;       /* Element type of values, TE_DOUBLE if 0. */
+    int stride;     /* Bytes from one row to the next, or 0 if the values are packed. */
+} te_column;
+
+/* Evaluates the expression for count rows, writing one result per row to out. */
+/* Each column gives the per-row values of the variable bound at address. Variables */
+/* without values are uniform: they're read once, and pure subexpressions that */
+/* depend only on uniform variables are computed once per call. Columns with a */
+/* type or stride, such as a field of an array of structs, are read in place. */
+void te_eval_array(const te_expr *n, const te_column *columns, int column_count, int count, double *out);
+
+/* Packs the results of selected rows at the start of out, see te_eval_selected. */
+#define TE_SELECT_COMPACT 1
+
+/* Like te_eval_array, but only for the count rows listed in selection. Results go */
+/* to out[selection[i]], leaving the other rows of out untouched, or to out[i] */
+/* with TE_SELECT_COMPACT. flags is 0 or TE_SELECT_COMPACT. */
+void te_eval_selected(const te_expr *n, const te_column *columns, int column_count,
+        const int *selection, int count, double *out, int flags);
+
+/* Like te_eval_selected, for the rows in [0, count) whose bit is set in mask. */
+/* Row i is bit i % 8 of mask[i / 8]. Returns the number of rows evaluated. */
+int te_eval_masked(const te_expr *n, const te_column *columns, int column_count,
+        const unsigned char *mask, int count, double *out, int flags);
+
+/* Sums with compensation for rounding errors, see te_reduce. */
+#define TE_REDUCE_COMPENSATED 1
+
+typedef struct te_reduction {
+    int flags;
+    unsigned long rows;     /* Rows reduced so far. */
+    unsigned long count;    /* Rows whose value wasn't NaN. */
+    double sum, compensation;
+    double min, max;        /* NaN until a row is counted. */
+    long argmin, argmax;    /* First row holding min and max, or -1. */
+} te_reduction;
+
+/* Clears r. flags is 0 or TE_REDUCE_COMPENSATED. */
+void te_reduce_init(te_reduction *r, int flags);
+
+/* Evaluates the expression for count rows like te_eval_array, and adds the */
+/* results to r without storing them. NaN results are skipped. Rows are */
+/* numbered from r->rows, so several calls continue where the last one stopped. */
+void te_reduce(const te_expr *n, const te_column *columns, int column_count, int count, te_reduction *r);
+
+/* Adds from, which reduced the rows that come right after those of into. */
+/* To reduce in parallel, give each thread its own slice of the columns and */
+/* te_reduction, then merge them in row order. */
+void te_reduce_merge(te_reduction *into, const te_reduction *from);
+
+double te_reduction_sum(const te_reduction *r);
+
+/* Returns NaN if no row was counted. */
+double te_reduction_mean(const te_reduction *r);
+
+/* Counts the results for count rows into bins of equal width over [lower, upper). */
+/* Results outside that range and NaNs aren't counted. counts is added to, not */
+/* cleared, so partial histograms of slices of the rows sum up. */
+void te_histogram(const te_expr *n, const te_column *columns, int column_count, int count,
+        double lower, double upper, int bins, unsigned long *counts);
+
+typedef struct te_tier_stats {
+    unsigned long evaluations;
+    unsigned long threshold;
+    unsigned long promoted_at;
+    int tier;
+    int program_length;
+} te_tier_stats;
+
+/* Like te_compile, but the expression starts on the tree walker and switches itself */
+/* to a linearized program once te_eval has been called threshold times. */
+/* The expression updates its counters in te_eval, so don't share one between threads. */
+te_expr *te_compile_tiered(const char *expression, const te_variable *variables, int var_count, unsigned long threshold, int *error);
+
+/* Reports evaluation counts and promotion state of a tiered expression. */
+/* Returns 0 if the expression wasn't compiled with te_compile_tiered. */
+int te_get_tier_stats(const te_expr *n, te_tier_stats *stats);
+
+typedef struct te_store te_store;
+
+typedef struct te_store_stats {
+    unsigned long nodes;
+    unsigned long bytes;
+    unsigned long hits;
+} te_store_stats;
+
+/* Creates a store in which identical pure subtrees are shared between expressions. */
+te_store *te_store_new(void);
+
+/* Like te_compile, but shares nodes with the other expressions in the store. */
+/* Free the result with te_free as usual. A store isn't safe to use from several threads. */
+te_expr *te_store_compile(te_store *store, const char *expression, const te_variable *variables, int var_count, int *error);
+
+/* Reports the unique nodes held, their memory, and how many nodes were reused. */
+void te_store_get_stats(const te_store *store, te_store_stats *stats);
+
+/* Frees the store. Expressions compiled into it stay valid until te_free. */
+void te_store_free(te_store *store);
+
+typedef struct te_program te_program;
+
+/* Compiles several expressions over the same variables into one program. */
+/* Identical pure subexpressions are computed once for all of them. */
+/* If errors is not 0, errors[i] is set to the parse error position of expression i, or 0. */
+/* Returns 0 if any expression fails to compile, or if memory runs out. */
+te_program *te_compile_many(const char *const *expressions, int count, const te_variable *variables, int var_count, int *errors);
+
+/* Evaluates every expression of the program, writing the results to out in order. */
+/* It doesn't allocate, unless another thread is evaluating the same large program. */
+void te_eval_many(const te_program *p, double *out);
+
+/* Returns the number of steps te_eval_many runs, one per unique node. */
+int te_program_steps(const te_program *p);
+
+/* Frees the program. This is safe to call on NULL pointers. */
+void te_program_free(te_program *p);
+
+typedef struct te_scheduler te_scheduler;
+
+/* Creates a scheduler that evaluates its expressions on threads threads, the */
+/* calling thread included. Without TE_THREADS it always uses the calling thread. */
+te_scheduler *te_scheduler_new(int threads);
+
+/* Adds an expression whose value te_scheduler_run writes to *out. */
+/* Returns the index of the task, or -1 if out of memory. */
+int te_scheduler_add(te_scheduler *s, const te_expr *n, double *out);
+
+/* Evaluates every expression once, sharing the work out by estimated cost. */
+/* Each output gets the same value te_eval would give, whatever thread runs it, */
+/* but user functions may be called from several threads at once. */
+void te_scheduler_run(te_scheduler *s);
+
+/* Returns the cost of a task in nanoseconds, estimated from its tree until it */
+/* has been measured. */
+double te_scheduler_cost(const te_scheduler *s, int task);
+
+/* Stops the threads and frees the scheduler, but not its expressions. */
+void te_scheduler_free(te_scheduler *s);
+
+typedef struct te_graph te_graph;
+
+/* Reasons te_graph_define fails. */
+enum {
+    TE_GRAPH_SYNTAX = 1,    /* The expression doesn't compile. */
+    TE_GRAPH_CYCLE,         /* The formula would depend on itself. */
+    TE_GRAPH_NAME,          /* The name isn't a valid variable name, or is one of the graph's variables. */
+    TE_GRAPH_MEMORY
+};
+
+/* Creates a graph of named formulas over variables, which are bound as with te_compile. */
+te_graph *te_graph_new(const te_variable *variables, int var_count);
+
+/* Defines the formula name, or replaces its expression. The expression may use the */
+/* graph's variables and the formulas defined so far. Returns 0, or a TE_GRAPH reason */
+/* and leaves the graph as it was. error is set to the parse error position or 0. */
+/* The formula is computed by the next te_graph_update. */
+int te_graph_define(te_graph *g, const char *name, const char *expression, int *error);
+
+/* Tells the graph the variable at address has changed, queueing the formulas that */
+/* read it. Returns how many formulas that was. */
+int te_graph_changed(te_graph *g, const void *address);
+
+/* Recomputes the queued formulas, and those downstream of them whose inputs */
+/* came out different, each after its sources. Returns how many were computed. */
+/* A graph isn't safe to use from several threads. */
+int te_graph_update(te_graph *g);
+
+/* Returns the value of a formula as of the last update, or NaN if there's no such formula. */
+double te_graph_value(const te_graph *g, const char *name);
+
+/* Returns where the value of a formula is kept, for binding it in other */
+/* expressions, or 0 if there's no such formula. It stays valid until te_graph_free. */
+const double *te_graph_address(const te_graph *g, const char *name);
+
+/* Frees the graph and its formulas. This is safe to call on NULL pointers. */
+void te_graph_free(te_graph *g);
+
+typedef struct te_handle te_handle;
+
+/* Creates a handle holding n, which it takes over. Readers on any thread can */
+/* evaluate it while writers replace it, without locks. */
+te_handle *te_handle_new(te_expr *n);
+
+/* Evaluates the expression the handle holds. Never waits for a writer. */
+double te_handle_eval(te_handle *h);
+
+/* Returns the expression the handle holds, which stays valid until the calling */
+/* thread calls te_handle_release, even if it's swapped out meanwhile. Pairs nest. */
+const te_expr *te_handle_acquire(te_handle *h);
+void te_handle_release(te_handle *h);
+
+/* Makes n the expression of the handle, which it takes over. The old one is freed */
+/* once no reader can still see it, here or in a later swap or reclaim. Writers */
+/* wait for each other in every build, but not for readers. Returns how many old expressions are */
+/* still waiting to be freed, or -1 if out of memory, leaving the handle as it was. */
+int te_handle_swap(te_handle *h, te_expr *n);
+
+/* Frees the old expressions no reader can see. Returns how many are left. */
+int te_handle_reclaim(te_handle *h);
+
+/* Gives up the calling thread's place in the list of readers, to be reused by */
+/* another thread. Call it before a thread that has read handles exits. */
+void te_handle_thread_done(void);
+
+/* Frees the handle and every expression it holds. No thread may be reading it. */
+void te_handle_free(te_handle *h);
+
+typedef struct te_interval {
+    double lower, upper;
+} te_interval;
+
+typedef te_interval (*te_interval_function)(void *context, const te_interval *args);
+
+typedef struct te_interval_binding {
+    const void *address;
+    te_interval range;
+    te_interval_function function;
+} te_interval_binding;
+
+/* Evaluates the expression over intervals, returning bounds on its range. */
+/* Bindings give ranges for variables and interval versions of user functions, */
+/* both matched on the address given to te_compile. Unbound variables use their current value. */
+/* Returns {NaN, NaN} if the expression is undefined over the whole box. */
+te_interval te_eval_interval(const te_expr *n, const te_interval_binding *bindings, int binding_count);
+
+typedef struct te_approximation te_approximation;
+
+typedef struct te_approximation_stats {
+    int segments;       /* Pieces of equal width the range is cut into. */
+    int degree;         /* Of the polynomial on each piece, at most 8. */
+    double error;       /* Largest difference from te_eval found when checking. */
+} te_approximation_stats;
+
+/* Builds a piecewise Chebyshev interpolant of the expression as a function of the */
+/* variable at address variable over [lower, upper]. Other variables keep their */
+/* current values. The interpolant is checked against te_eval at 36 points per */
+/* piece, and pieces are added until it's within tolerance, an absolute error, of */
+/* it at all of them. Evaluating it takes a multiply-add per degree. */
+/* Returns 0 if the expression isn't finite everywhere on the range, or the */
+/* tolerance can't be met with 4096 pieces. *variable is left as it was. */
+te_approximation *te_approximate(const te_expr *n, double *variable, double lower, double upper, double tolerance);
+
+/* Evaluates the interpolant at x, or returns NaN if x is outside the range. */
+double te_approximation_eval(const te_approximation *a, double x);
+
+void te_approximation_get_stats(const te_approximation *a, te_approximation_stats *stats);
+
+/* Frees the interpolant. This is safe to call on NULL pointers. */
+void te_approximation_free(te_approximation *a);
+
+#define TE_STATS_BUCKETS 32
+
+/* Library-wide counters, collected when built with TE_STATS. */
+typedef struct te_stats {
+    unsigned long compiles;         /* Calls to te_compile, including failed ones. */
+    unsigned long compile_errors;
+    unsigned long evals;
+    unsigned long frees;
+    unsigned long nodes_allocated;
+    unsigned long nodes_freed;
+    unsigned long bytes_allocated;  /* Bytes of expression nodes. */
+    unsigned long bytes_freed;
+    unsigned long nodes_live;       /* nodes_allocated - nodes_freed */
+    unsigned long bytes_held;       /* bytes_allocated - bytes_freed */
+    unsigned long memo_hits;        /* Calls of TE_FLAG_MEMO functions found in the cache. */
+    unsigned long memo_misses;
+
+    /* Latency histograms: bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds. */
+    unsigned long compile_ns[TE_STATS_BUCKETS];
+    unsigned long eval_ns[TE_STATS_BUCKETS];
+} te_stats;
+
+/* Sums the counters of every thread into stats. Counters are kept per thread, */
+/* so this never blocks the threads updating them. */
+/* Returns 0 and zeroes stats if the library was built without TE_STATS. */
+int te_stats_snapshot(te_stats *stats);
+
 /* Prints debugging information on the syntax tree. */
 void te_print(const te_expr *n);
 
+/* Estimated cycles per operation, by class. */
+typedef struct te_cost_table {
+    double load;            /* Constants and variables. */
+    double arithmetic;      /* + - * negation, abs, ceil, floor and the comma. */
+    double division;        /* / % sqrt */
+    double pow;             /* ^ and pow */
+    double transcendental;  /* exp ln log log10 sin cos tan */
+    double builtin;         /* Other builtin functions. */
+    double call;            /* Calling a user function or closure, not counting its body. */
+} te_cost_table;
+
+typedef struct te_analysis {
+    int nodes;
+    int depth;              /* Nodes on the longest path from the root. */
+    int builtin_calls;      /* Builtin functions, other than pow. */
+    int pow_calls;
+    int function_calls;     /* User functions. */
+    int closure_calls;
+    int variables;          /* Distinct variables referenced. */
+    unsigned long bytes;    /* Memory held by the expression. */
+    double cost;            /* Estimated cycles per te_eval. */
+} te_analysis;
+
+/* Counts what the expression is made of and estimates the cost of evaluating it. */
+te_analysis te_analyze(const te_expr *n);
+
+/* Replaces the costs te_analyze uses, for example with figures measured on the */
+/* target machine. If table is 0, the built-in defaults are restored. */
+void te_set_cost_table(const te_cost_table *table);
+void te_get_cost_table(te_cost_table *table);
+
+/* Like te_print, with the estimated cost of every subtree and the figures of te_analyze. */
+void te_print_analysis(const te_expr *n);
+
+/* Prints the syntax tree with the calls and cycles of every node, and the part */
+/* of expression each node came from. Costs are only collected with TE_PROFILE. */
+void te_profile_report(const te_expr *n, const char *expression);
+
+/* Clears the profile counters of every node. */
+void te_profile_reset(te_expr *n);
+
 /* Frees the expression. */
 /* This is safe to call on NULL pointers. */
 void te_free(te_expr *n);